@@ -0,0 +1,236 @@
+/*
+    Benchmark of BuddyArena (buddy_arena.hpp) as a std::pmr::memory_resource
+    for node based containers, against std::pmr::unsynchronized_pool_resource
+    and glibc malloc behind the same interface:
+
+      list   - a std::pmr::list of -l nodes, popping a node off one end and
+               pushing one onto the other, or a random end, -n times
+      map    - a std::pmr::map of up to -l random keys, inserting and
+               erasing at random -n times
+      umap   - the same with a std::pmr::unordered_map, whose bucket array
+               grows to a large block as it fills
+      sizes  - allocate and deallocate directly, 16 to 4096 bytes, with up to
+               -l blocks live
+
+    Every trace runs on a fresh resource each time, so no resource starts
+    with memory another one warmed up. The arena is a BuddyArena<16, 22>
+    without a lock, mapping ARENA_BYTES.
+
+    usage: arena_bench [-n operations] [-l live] [-s seed] [-t trace]
+*/
+
+extern "C"
+{
+#include "bench.h"
+}
+#include "../buddy_arena.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+
+#define ARENA_BYTES (256ull << 20) // mapped, the pages are only touched as they are handed out
+
+using Arena = lumos::BuddyArena<16, 22>;
+
+static_assert(Arena::order_for(1) == 0 && Arena::order_for(17) == 1 && Arena::order_for(Arena::max_bytes + 1) == 23, "");
+static_assert(Arena::metadata_bytes(64 * 64) == (64 + 32 + 16 + 8 + 4 + 2 + 1 + 6) * 8, "a word per order from 64 blocks down");
+
+// glibc malloc as a memory_resource, the blocks are only aligned as malloc aligns them
+class MallocResource : public std::pmr::memory_resource
+{
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *address = (alignment > alignof(std::max_align_t)) ? aligned_alloc(alignment, (bytes + alignment - 1) & ~(alignment - 1))
+                                                                 : malloc(bytes);
+        if (address == nullptr)
+            throw std::bad_alloc();
+        return address;
+    }
+
+    void do_deallocate(void *address, std::size_t bytes, std::size_t alignment) override
+    {
+        free(address);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+static uint64_t ops = 1000000;
+static uint64_t live = 100000;
+static uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+static void traceList(std::pmr::memory_resource *resource, struct bench_latency *lat)
+{
+    std::pmr::list<uint64_t> list(resource);
+    uint64_t rng = seed, start;
+
+    for (uint64_t i = 0; i < live; i++)
+        list.push_back(i);
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_rand(&rng);
+
+        start = bench_now_ns();
+        if (r & 1)
+        {
+            list.pop_front();
+            list.push_back(r);
+        }
+        else
+        {
+            list.pop_back();
+            list.push_front(r);
+        }
+        bench_latency_add(lat, bench_now_ns() - start);
+    }
+}
+
+template <class Map> static void traceMap(std::pmr::memory_resource *resource, struct bench_latency *lat)
+{
+    Map map(resource);
+    std::vector<uint64_t> keys;
+    uint64_t rng = seed, start;
+
+    keys.reserve(live);
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_rand(&rng);
+
+        // grow to the live set, then erase about as often as insert
+        if (keys.size() < live && (keys.empty() || (r & 1)))
+        {
+            start = bench_now_ns();
+            map.emplace(r, i);
+            bench_latency_add(lat, bench_now_ns() - start);
+            keys.push_back(r);
+        }
+        else
+        {
+            uint64_t slot = (r >> 1) % keys.size();
+
+            start = bench_now_ns();
+            map.erase(keys[slot]);
+            bench_latency_add(lat, bench_now_ns() - start);
+            keys[slot] = keys.back();
+            keys.pop_back();
+        }
+    }
+}
+
+static void traceSizes(std::pmr::memory_resource *resource, struct bench_latency *lat)
+{
+    struct block
+    {
+        void *address;
+        std::size_t bytes;
+    };
+    std::vector<block> blocks;
+    uint64_t rng = seed, start;
+
+    blocks.reserve(live);
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_rand(&rng);
+
+        if (blocks.size() < live && (blocks.empty() || (r & 1)))
+        {
+            std::size_t bytes = 16 + (r >> 1) % 4081;
+
+            start = bench_now_ns();
+            void *address = resource->allocate(bytes, 16);
+            bench_latency_add(lat, bench_now_ns() - start);
+            blocks.push_back({address, bytes});
+        }
+        else
+        {
+            uint64_t slot = (r >> 1) % blocks.size();
+
+            start = bench_now_ns();
+            resource->deallocate(blocks[slot].address, blocks[slot].bytes, 16);
+            bench_latency_add(lat, bench_now_ns() - start);
+            blocks[slot] = blocks.back();
+            blocks.pop_back();
+        }
+    }
+    for (block &b : blocks)
+        resource->deallocate(b.address, b.bytes, 16);
+}
+
+// Run a trace on a fresh arena, pool and malloc resource
+static void run(const char *name, void (*trace)(std::pmr::memory_resource *, struct bench_latency *))
+{
+    struct bench_latency lat;
+
+    {
+        Arena arena(ARENA_BYTES);
+        bench_latency_init(&lat, ops);
+        trace(&arena, &lat);
+        bench_report(name, "buddy", &lat);
+        bench_latency_free(&lat);
+    }
+    {
+        std::pmr::unsynchronized_pool_resource pool(std::pmr::new_delete_resource());
+        bench_latency_init(&lat, ops);
+        trace(&pool, &lat);
+        bench_report(name, "pool", &lat);
+        bench_latency_free(&lat);
+    }
+    {
+        MallocResource heap;
+        bench_latency_init(&lat, ops);
+        trace(&heap, &lat);
+        bench_report(name, "malloc", &lat);
+        bench_latency_free(&lat);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = nullptr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:s:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            live = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 't':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n operations] [-l live] [-s seed] [-t list|map|umap|sizes]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (live == 0)
+        live = 1;
+
+    bench_report_header();
+    if (only == nullptr || strcmp(only, "list") == 0)
+        run("list", traceList);
+    if (only == nullptr || strcmp(only, "map") == 0)
+        run("map", traceMap<std::pmr::map<uint64_t, uint64_t>>);
+    if (only == nullptr || strcmp(only, "umap") == 0)
+        run("umap", traceMap<std::pmr::unordered_map<uint64_t, uint64_t>>);
+    if (only == nullptr || strcmp(only, "sizes") == 0)
+        run("sizes", traceSizes);
+    return 0;
+}
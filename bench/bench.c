@@ -0,0 +1,153 @@
+#include "bench.h"
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+void bench_latency_init(struct bench_latency *lat, uint64_t capacity)
+{
+    lat->samples = malloc(capacity * sizeof(uint64_t));
+    lat->count = 0;
+    lat->capacity = capacity;
+    lat->totalNs = 0;
+    if (lat->samples == NULL)
+    {
+        perror("[bench] : malloc");
+        exit(1);
+    }
+}
+
+void bench_latency_add(struct bench_latency *lat, uint64_t ns)
+{
+    if (lat->count == lat->capacity)
+    {
+        lat->capacity *= 2;
+        lat->samples = realloc(lat->samples, lat->capacity * sizeof(uint64_t));
+        if (lat->samples == NULL)
+        {
+            perror("[bench] : realloc");
+            exit(1);
+        }
+    }
+    lat->samples[lat->count++] = ns;
+    lat->totalNs += ns;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t bench_latency_percentile(struct bench_latency *lat, double p)
+{
+    if (lat->count == 0)
+        return 0;
+    qsort(lat->samples, lat->count, sizeof(uint64_t), compareSamples);
+    uint64_t index = (uint64_t)(p * (lat->count - 1));
+    return lat->samples[index];
+}
+
+void bench_latency_free(struct bench_latency *lat)
+{
+    free(lat->samples);
+    lat->samples = NULL;
+    lat->count = lat->capacity = 0;
+}
+
+void bench_counters_open(struct bench_counters *counters)
+{
+    static const struct
+    {
+        uint32_t type;
+        uint64_t config;
+    } events[BENCH_COUNTERS] = {
+        [BENCH_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        [BENCH_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+    struct perf_event_attr attr;
+
+    counters->available = true;
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fd[i] < 0)
+            counters->available = false;
+    }
+}
+
+void bench_counters_start(struct bench_counters *counters)
+{
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+        if (counters->fd[i] >= 0)
+        {
+            ioctl(counters->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void bench_counters_stop(struct bench_counters *counters)
+{
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+        if (counters->fd[i] >= 0)
+            ioctl(counters->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+uint64_t bench_counters_read(struct bench_counters *counters, enum bench_counter counter)
+{
+    uint64_t value = 0;
+    if (counters->fd[counter] < 0 || read(counters->fd[counter], &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+}
+
+void bench_counters_close(struct bench_counters *counters)
+{
+    for (int i = 0; i < BENCH_COUNTERS; i++)
+        if (counters->fd[i] >= 0)
+            close(counters->fd[i]);
+}
+
+void bench_report_header(void)
+{
+    printf("%-10s %-8s %10s %14s %9s %9s %9s\n", "trace", "op", "count", "ops/sec", "p50(ns)", "p99(ns)", "p999(ns)");
+}
+
+void bench_report(const char *trace, const char *op, struct bench_latency *lat)
+{
+    double opsPerSec = lat->totalNs ? (double)lat->count * 1e9 / lat->totalNs : 0.0;
+    uint64_t p50 = bench_latency_percentile(lat, 0.50);
+    uint64_t p99 = bench_latency_percentile(lat, 0.99);
+    uint64_t p999 = bench_latency_percentile(lat, 0.999);
+    printf("%-10s %-8s %10llu %14.0f %9llu %9llu %9llu\n", trace, op, (unsigned long long)lat->count, opsPerSec,
+           (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+}
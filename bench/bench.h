@@ -0,0 +1,56 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+    Shared helpers for the hosted benchmarks: a monotonic clock, a fast
+    deterministic PRNG, latency sample collection with percentiles and 
+    hardware cache miss counters.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct bench_latency
+{
+    uint64_t *samples; // one sample per operation, in ns
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t totalNs;
+};
+
+uint64_t bench_now_ns(void);
+uint64_t bench_rand(uint64_t *state); // xorshift64*, state must be non-zero
+
+void bench_latency_init(struct bench_latency *lat, uint64_t capacity);
+void bench_latency_add(struct bench_latency *lat, uint64_t ns);
+uint64_t bench_latency_percentile(struct bench_latency *lat, double p); // sorts the samples
+void bench_latency_free(struct bench_latency *lat);
+
+/*
+    Cache miss counters of the calling thread, through perf_event_open. 
+    Virtual machines and locked down kernels often don't expose them, in
+    which case available is false and the reads return 0.
+*/
+enum bench_counter
+{
+    BENCH_L1D_MISSES, // L1 data cache read misses
+    BENCH_LLC_MISSES, // last level cache misses
+    BENCH_COUNTERS
+};
+
+struct bench_counters
+{
+    int fd[BENCH_COUNTERS];
+    bool available;
+};
+
+void bench_counters_open(struct bench_counters *counters);
+void bench_counters_start(struct bench_counters *counters); // reset and enable
+void bench_counters_stop(struct bench_counters *counters);
+uint64_t bench_counters_read(struct bench_counters *counters, enum bench_counter counter);
+void bench_counters_close(struct bench_counters *counters);
+
+void bench_report_header(void);
+void bench_report(const char *trace, const char *op, struct bench_latency *lat); // one line: count, ops/sec, p50/p99/p999
+
+#endif
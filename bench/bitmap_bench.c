@@ -0,0 +1,110 @@
+/*
+    Microbenchmark for the bitmap search kernels on nearly full maps, the
+    case where a search has to look furthest, with and without a summary.
+    Built once per kernel (scalar/sse2/avx2) so they can be compared side 
+    by side.
+
+    usage: bitmap_bench [-p pages] [-r rounds]
+*/
+
+#include "bench.h"
+#include <lumos/bitmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void report(const char *op, uint64_t elapsed, uint64_t rounds, uint64_t pages)
+{
+    printf("%-26s %12.1f %14.3f\n", op, (double)elapsed / rounds, (double)elapsed / rounds / (pages / 256.0));
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t pages = 16ull << 20; // 64 GB of 4K pages
+    uint64_t rounds = 20;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            pages = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            rounds = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p pages] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    uint32_t words = (pages + 31) / 32;
+    uint32_t *full = malloc(words * 4);
+    uint32_t *sparse = malloc(words * 4);
+    struct bitmap_summary fullSummary, sparseSummary;
+    uint64_t rng = 0x9E3779B97F4A7C15ull, start;
+    volatile intmax_t sink;
+
+    // everything reserved but the last page
+    memset(full, 0xFF, words * 4);
+    unset_bit(full, NULL, pages - 1);
+
+    // isolated free pages every 4K pages, and the only free pair at the very end
+    memset(sparse, 0xFF, words * 4);
+    for (uint64_t i = 4096; i < pages; i += 4096)
+        unset_bit(sparse, NULL, i - 1 - bench_rand(&rng) % 1024);
+    unset_bits(sparse, NULL, pages - 2, pages - 1);
+
+    summaryInit(&fullSummary, malloc(summaryWords(words) * sizeof(uint64_t)), full, words);
+    summaryInit(&sparseSummary, malloc(summaryWords(words) * sizeof(uint64_t)), sparse, words);
+
+    printf("bitmap_bench: %s kernel, %llu pages\n", bitmapKernelName(), (unsigned long long)pages);
+    printf("%-26s %12s %14s\n", "op", "ns/call", "ns/256 pages");
+
+    start = bench_now_ns();
+    for (uint64_t r = 0; r < rounds; r++)
+        sink = findFirstFreeBit(full, NULL, words);
+    report("findFirstFreeBit", bench_now_ns() - start, rounds, pages);
+
+    start = bench_now_ns();
+    for (uint64_t r = 0; r < rounds; r++)
+        sink = findFirstFreeBit(full, &fullSummary, words);
+    report("findFirstFreeBit+summary", bench_now_ns() - start, rounds, pages);
+
+    start = bench_now_ns();
+    for (uint64_t r = 0; r < rounds; r++)
+        sink = findFreeRun(sparse, NULL, pages, 2);
+    report("findFreeRun", bench_now_ns() - start, rounds, pages);
+
+    start = bench_now_ns();
+    for (uint64_t r = 0; r < rounds; r++)
+        sink = findFreeRun(sparse, &sparseSummary, pages, 2);
+    report("findFreeRun+summary", bench_now_ns() - start, rounds, pages);
+
+    start = bench_now_ns();
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        unset_bits(full, NULL, 3, pages - 5);
+        set_bits(full, NULL, 3, pages - 5);
+    }
+    report("set/unset_bits", (bench_now_ns() - start) / 2, rounds, pages);
+
+    start = bench_now_ns();
+    for (uint64_t r = 0; r < rounds * 1000; r++)
+    {
+        uint32_t bit = bench_rand(&rng) % pages;
+        unset_bit(full, &fullSummary, bit);
+        set_bit(full, &fullSummary, bit);
+    }
+    printf("%-26s %12.3f\n", "set/unset_bit+summary", (double)(bench_now_ns() - start) / (rounds * 1000) / 2);
+
+    (void)sink;
+    free(fullSummary.level[0]);
+    free(sparseSummary.level[0]);
+    free(full);
+    free(sparse);
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+    Correctness check for the bitmap kernels, built once per kernel
+    (scalar/sse2/avx2) like bitmap_bench. Random maps of 1 to
+    CHECK_MAX_WORDS words, from nearly empty to nearly full, are searched
+    with and without a summary and every answer is compared with a bit by
+    bit reference: findFirstFreeBit, findFreeBitFrom from offsets around
+    the word and 64-bit boundaries at the start of the map and at a random
+    spot in it, and findFreeRun for lengths around those boundaries, also
+    with a limit that cuts the last word short. The maps
+    are then changed with set_bits/unset_bits over ranges that start and
+    end around the boundaries, and with set_bit/unset_bit/set_mask, and
+    after every change the map has to match the reference bit for bit and
+    the summary has to match one built from scratch. make bitmap-check
+    runs every kernel the CPU has.
+
+    usage: bitmap_check [-n maps] [-s seed]
+*/
+
+#include "bench.h"
+#include <lumos/bitmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK_MAX_WORDS 300   // 32-bit words of the largest map, a few summary words
+#define CHECK_CHANGES 16      // changes made to each map
+#define CHECK_MAX_FAILURES 16 // failures printed before giving up
+
+static uint64_t checks, failures;
+
+// offsets where the word at a time and SIMD kernels change how they look at the map
+static const uint32_t edges[] = {0, 1, 31, 32, 33, 63, 64, 65, 127, 128, 129, 255, 256, 257};
+#define EDGES (sizeof(edges) / sizeof(edges[0]))
+
+static bool refTest(const uint32_t *map, uint32_t bit)
+{
+    return (map[bit / 32] >> (bit % 32)) & 1;
+}
+
+// first unset bit at or after from below bits, -1 if none
+static intmax_t refFreeBitFrom(const uint32_t *map, uint32_t bits, uint32_t from)
+{
+    for (uint32_t bit = from; bit < bits; bit++)
+        if (!refTest(map, bit))
+            return bit;
+    return -1;
+}
+
+static intmax_t refFreeRun(const uint32_t *map, uint32_t bits, uint32_t length)
+{
+    uint32_t run = 0;
+
+    if (length == 0)
+        return -1;
+    for (uint32_t bit = 0; bit < bits; bit++)
+    {
+        run = refTest(map, bit) ? 0 : run + 1;
+        if (run == length)
+            return bit + 1 - length;
+    }
+    return -1;
+}
+
+static void expect(intmax_t got, intmax_t want, const char *what, uint32_t words, uint32_t arg, bool summary)
+{
+    checks++;
+    if (got == want)
+        return;
+    if (failures++ < CHECK_MAX_FAILURES)
+        printf("%s(%u)%s on a map of %u words: got %jd, expected %jd\n", what, arg, summary ? " with a summary" : "",
+               words, got, want);
+}
+
+// A map of words words, every bit reserved with a probability of density / 1024, with a few runs thrown in
+static void randomMap(uint32_t *map, uint32_t words, uint32_t density, uint64_t *rng)
+{
+    for (uint32_t bit = 0; bit < words * 32; bit++)
+    {
+        if (bench_rand(rng) % 1024 < density)
+            map[bit / 32] |= 1u << (bit % 32);
+        else
+            map[bit / 32] &= ~(1u << (bit % 32));
+    }
+
+    // free runs that cross word boundaries, and a fully reserved stretch
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        uint32_t start = bench_rand(rng) % (words * 32), length = 1 + bench_rand(rng) % 160;
+        for (uint32_t bit = start; bit < start + length && bit < words * 32; bit++)
+            map[bit / 32] &= ~(1u << (bit % 32));
+    }
+    if (words > 8 && bench_rand(rng) % 2)
+    {
+        uint32_t start = bench_rand(rng) % (words - 8);
+        memset(map + start, 0xFF, (bench_rand(rng) % (words - start) + 1) * 4);
+    }
+}
+
+static void checkSearches(uint32_t *map, struct bitmap_summary *summary, uint32_t words, uint64_t *rng)
+{
+    uint32_t bits = words * 32, base = (bits > 512) ? (bench_rand(rng) % (bits - 256)) & ~63u : 0;
+
+    expect(findFirstFreeBit(map, summary, words), refFreeBitFrom(map, bits, 0), "findFirstFreeBit", words, 0, summary);
+
+    // from the boundaries at the start of the map and at a random 64-bit word
+    for (uint32_t i = 0; i < EDGES; i++)
+        for (uint32_t from = edges[i]; from < bits; from = (from < base + edges[i]) ? base + edges[i] : bits)
+            expect(findFreeBitFrom(map, summary, words, from), refFreeBitFrom(map, bits, from), "findFreeBitFrom", words, from,
+                   summary);
+
+    // the whole map, and a limit that cuts the last word short
+    for (uint32_t limit = 0; limit < 2; limit++)
+    {
+        uint32_t maxBits = (limit == 0 || bits <= 32) ? bits : bits - 1 - (bits / 7) % 31;
+        for (uint32_t i = 1; i < EDGES; i++)
+            expect(findFreeRun(map, summary, maxBits, edges[i]), (edges[i] > maxBits) ? -1 : refFreeRun(map, maxBits, edges[i]),
+                   "findFreeRun", words, edges[i], summary);
+        expect(findFreeRun(map, summary, maxBits, 2), refFreeRun(map, maxBits, 2), "findFreeRun", words, 2, summary);
+        expect(findFreeRun(map, summary, maxBits, 3), refFreeRun(map, maxBits, 3), "findFreeRun", words, 3, summary);
+        expect(findFreeRun(map, summary, maxBits, maxBits), refFreeRun(map, maxBits, maxBits), "findFreeRun", words, maxBits, summary);
+    }
+}
+
+// The summary of the map has to be what summaryInit builds from it
+static void checkSummary(uint32_t *map, struct bitmap_summary *summary, uint32_t words, uint64_t *scratch)
+{
+    struct bitmap_summary fresh;
+
+    summaryInit(&fresh, scratch, map, words);
+    for (uint32_t l = 0; l < fresh.levels; l++)
+        expect(memcmp(summary->level[l], fresh.level[l], fresh.levelWords[l] * sizeof(uint64_t)) != 0, 0, "summary level", words,
+               l, true);
+}
+
+// A random offset, around a boundary half the time
+static uint32_t randomOffset(uint32_t bits, uint64_t *rng)
+{
+    uint32_t offset = bench_rand(rng) % bits;
+
+    if (bench_rand(rng) % 2)
+        offset = (offset & ~63u) + edges[bench_rand(rng) % EDGES] % 66;
+    return (offset < bits) ? offset : bits - 1;
+}
+
+/*
+    Change the map and a bit by bit copy of it the same way, with a range
+    kernel or a single bit one, and check the map, the summary and the
+    searches after each change.
+*/
+static void checkChanges(uint32_t *map, struct bitmap_summary *summary, uint32_t words, uint64_t *scratch, uint64_t *rng)
+{
+    uint32_t bits = words * 32;
+    uint32_t *ref = malloc(words * 4);
+
+    memcpy(ref, map, words * 4);
+    for (uint32_t change = 0; change < CHECK_CHANGES; change++)
+    {
+        uint32_t op = bench_rand(rng) % 5, a = randomOffset(bits, rng), b = randomOffset(bits, rng), mask;
+        uint32_t first = (a < b) ? a : b, last = (a < b) ? b : a;
+
+        switch (op)
+        {
+        case 0:
+            set_bits(map, summary, first, last);
+            for (uint32_t bit = first; bit <= last; bit++)
+                ref[bit / 32] |= 1u << (bit % 32);
+            break;
+        case 1:
+            unset_bits(map, summary, first, last);
+            for (uint32_t bit = first; bit <= last; bit++)
+                ref[bit / 32] &= ~(1u << (bit % 32));
+            break;
+        case 2:
+            set_bit(map, summary, a);
+            ref[a / 32] |= 1u << (a % 32);
+            break;
+        case 3:
+            unset_bit(map, summary, a);
+            ref[a / 32] &= ~(1u << (a % 32));
+            break;
+        default:
+            mask = (uint32_t)bench_rand(rng) | ((bench_rand(rng) % 2) ? ~ref[a / 32] : 0); // fills the word half the time
+            set_mask(map, summary, a / 32, mask);
+            ref[a / 32] |= mask;
+            break;
+        }
+
+        for (uint32_t word = 0; word < words; word++)
+            expect(map[word], ref[word], "map word after a change", words, word, summary != NULL);
+        if (summary != NULL)
+            checkSummary(map, summary, words, scratch);
+        checkSearches(map, summary, words, rng);
+    }
+    free(ref);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t maps = 1000, rng = 0x9E3779B97F4A7C15ull;
+    uint32_t *map = malloc(CHECK_MAX_WORDS * 4);
+    uint64_t *storage = malloc(summaryWords(CHECK_MAX_WORDS) * sizeof(uint64_t));
+    uint64_t *scratch = malloc(summaryWords(CHECK_MAX_WORDS) * sizeof(uint64_t));
+    struct bitmap_summary summary;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            maps = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n maps] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (uint64_t i = 0; i < maps && failures < CHECK_MAX_FAILURES; i++)
+    {
+        // small maps around the word and SIMD group sizes most of the time
+        uint32_t words = 1 + bench_rand(&rng) % ((i % 4 == 0) ? CHECK_MAX_WORDS : 20);
+        uint32_t density = (i % 8 == 0) ? 1024 - bench_rand(&rng) % 4 : bench_rand(&rng) % 1025;
+        bool summarized = i % 2;
+
+        randomMap(map, words, density, &rng);
+        if (summarized)
+            summaryInit(&summary, storage, map, words);
+        checkSearches(map, summarized ? &summary : NULL, words, &rng);
+        checkChanges(map, summarized ? &summary : NULL, words, scratch, &rng);
+    }
+
+    printf("bitmap_check: %s kernel, %llu maps, %llu checks, %llu failed\n", bitmapKernelName(), (unsigned long long)maps,
+           (unsigned long long)checks, (unsigned long long)failures);
+    free(map);
+    free(storage);
+    free(scratch);
+    return failures != 0;
+}
@@ -0,0 +1,1368 @@
+/*
+    Allocator benchmark for the hosted build. Boots the pmm on a synthetic
+    PC memory map and replays allocation traces against it:
+
+      storm  - page fault storm: back to back 4K allocations, then the whole
+               working set is released in random order
+      mixed  - random 1-256 block requests against a bounded live set
+      churn  - fill most of memory, then free/alloc at random for a long
+               time, sampling fragmentation as it goes
+      threads - 1 to PMM_MAX_CPUS threads, each on its own CPU id, doing
+               bursts of 4K allocations and frees, with and without the
+               per-CPU caches
+      bulk   - batches of 1 to BULK_MAX_BATCH 4K pages, taken and released
+               with pmm_alloc/pmm_free in a loop and with pmm_alloc_bulk/
+               pmm_free_bulk, reporting the cost per page
+      cache  - the mixed request sizes with the per-CPU caches off, so
+               every operation walks the pool metadata, reporting L1D and
+               last level cache misses per operation from perf counters
+      boot   - init_pmm time on PC memory maps from 64 MB to 64 GB, building
+               everything at boot and with deferred init, and the cost of
+               building the rest later a chunk at a time (ignores -m)
+      fill   - 4K allocations until memory runs out on PC memory maps from
+               1 GB to 64 GB, reporting how much was handed out, how much of
+               it from above 4 GB and the cost per allocation (ignores -m)
+      numa   - NUMA_THREADS threads spread over NUMA_NODES simulated nodes
+               each fill their share of memory with 4K pages, without a 
+               node table and with the local, interleave and bind policies,
+               reporting the share of pages that are local to the thread
+      stats  - the mixed request sizes, then the pmm_get_stats counters of
+               every zone and order, and with a TRACE=1 build the latency
+               histograms and what the trace ring of the CPU kept
+      mobility - 64 processes fault in 4K pages in runs of 32 until memory
+               is 99% in use, then exit until it is 60% in use, over and
+               over. The kernel keeps an eighth of it in long lived 4K
+               pages taken alongside. Every so often a quarter of the free
+               memory is asked for in 8 page blocks. Run with everything
+               unmovable, then with the process pages and probes movable,
+               reporting the share of the probes served as it goes
+      compact  - fill memory with movable 4K pages held through the fake
+               migrate client, free three in four at random, then ask for
+               a quarter of the free memory in 8 page blocks without a
+               migrate client, with compaction on failure and after a 
+               pmm_compact, reporting what was served and what it cost
+      huge     - ask for HUGE_BLOCKS 2 MB blocks with pmm_alloc_huge on a 
+               fresh boot, then again after filling memory with 4K pages 
+               and freeing three in four, without a huge page reserve and
+               with one of HUGE_BLOCKS blocks, reporting what was served 
+               and what it cost
+      slab     - a kmem_cache of each object size from 16 B to 2 KB holding
+               SLAB_LIVE objects, freeing one at random and allocating
+               another -n times, reporting objects/sec, the memory the
+               slabs take over the objects they hold, against whole pages
+               from pmm_alloc, and the slabs left once all are freed
+      zero     - a process faults in -n movable 4K pages, ZERO_WORK_NS of
+               work apart, holding ZERO_LIVE of them and writing all over
+               each one. The fault path takes a page with pmm_alloc and
+               clears it, then with pmm_alloc_zeroed and no zero pool, then
+               with a pool a background thread keeps filled with
+               pmm_zero_idle, reporting the fault path latency and how many
+               faults the pool served. Before that, what every clearing
+               kernel the CPU has takes per page
+      restart  - on PC memory maps from 256 MB to RESTART_MAX_MB, boot, hold
+               RESTART_KEEP allocations of 1 to RESTART_MAX_PAGES pages, and
+               restart the pmm on its saved state: in place, from a buffer
+               taken with pmm_alloc, without and with the full checksum, 
+               and from a file on a fresh arena. Reports the image size and
+               the time of init_pmm, of saving and of each adopt, and 
+               checks that the held blocks and their contents survive and
+               that freeing them brings back all of memory (ignores -m)
+
+    With -r file, the traces that boot on the -m map record every call to
+    the pmm from their last boot on (see pmm_record_start), and the 
+    recording is written to file for pmm_replay. Needs a TRACE=1 build.
+
+    usage: pmm_bench [-m ramMB] [-n ops] [-s seed] [-r file] [trace...]
+*/
+
+#include "bench.h"
+#include "hosted.h"
+#include <lumos/percpu.h>
+#include <lumos/pmm.h>
+#include <lumos/slab.h>
+#include <lumos/state.h>
+#include <lumos/trace.h>
+#include <lumos/zero.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIXED_MAX_LIVE 4096
+#define THREAD_BURST 64 // pages a thread holds at most in the threads trace
+#define BULK_MAX_BATCH 512
+#define BOOT_MAX_MB 65536
+#define NUMA_NODES 4
+#define NUMA_THREADS 8
+#define MOBILITY_WINDOWS 10      // success rates reported per run
+#define MOBILITY_PROCESSES 64
+#define MOBILITY_BURST 32        // pages a process faults in per step
+#define MOBILITY_KERNEL_EVERY 8  // process faults per long lived kernel page
+#define MOBILITY_KERNEL_SHARE 8  // at most 1/share of the memory in use is kernel pages
+#define MOBILITY_HIGH 99         // percent of memory in use before processes exit
+#define MOBILITY_LOW 60          // and once they stop
+#define MOBILITY_PROBE_EVERY 256 // steps
+#define COMPACT_KEEP 4           // one in this many pages is kept in the compact trace
+#define PROBE_BLOCKS 8           // blocks of the probes of the mobility and compact traces
+#define HUGE_BLOCKS 16           // 2 MB blocks the huge trace asks for
+#define HUGE_KEEP 4              // one in this many pages is kept in the huge trace
+#define SLAB_LIVE 16384          // objects held in the slab trace
+#define ZERO_LIVE 4096           // pages the process holds in the zero trace
+#define ZERO_WORK_NS 2000        // the process runs this long between two faults
+#define ZERO_ROUNDS 16           // times each clearing kernel fills the pool
+#define RESTART_MAX_MB 16384     // largest map of the restart trace
+#define RESTART_KEEP 4096        // allocations held across a restart
+#define RESTART_MAX_PAGES 16     // of 1 to this many pages
+#define RECORD_BYTES (256ull << 20) // buffer of -r, only touched as far as the recording goes
+#define RESTART_PATTERN(address) ((address) * 0x9E3779B97F4A7C15ull) // written at the start of each held allocation
+
+struct allocation
+{
+    phys_addr_t address;
+    uint32_t size; // bytes, as passed to pmm_alloc
+};
+
+static uint64_t ramMB = 512;
+static uint64_t ops = 200000;
+static uint64_t seed = 0x9E3779B97F4A7C15ull;
+static const char *recordPath = NULL;
+static void *recordBuffer = NULL;
+
+// Write the running recording to the -r file, if any
+static void recordDump(void)
+{
+    size_t bytes = pmm_record_stop();
+    FILE *file;
+
+    if (bytes == 0)
+        return;
+    file = fopen(recordPath, "wb");
+    if (file == NULL || fwrite(recordBuffer, 1, bytes, file) != bytes)
+        fprintf(stderr, "pmm_bench: can't write %s\n", recordPath);
+    else
+        printf("%-10s %llu records written to %s, %llu dropped\n", "record",
+               (unsigned long long)((struct pmm_record_header *)recordBuffer)->count, recordPath,
+               (unsigned long long)((struct pmm_record_header *)recordBuffer)->dropped);
+    if (file != NULL)
+        fclose(file);
+}
+
+static void boot(void)
+{
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    uint32_t count = hosted_map_pc(regions, ramMB << 20);
+
+    if (recordPath != NULL)
+        recordDump();
+    hosted_boot(regions, count);
+    if (recordPath != NULL && !pmm_record_start(recordBuffer, RECORD_BYTES))
+        fprintf(stderr, "pmm_bench: can't record, the pmm is built without PMM_TRACE\n");
+}
+
+// Request size distribution for the mixed and churn traces: mostly single
+// pages, with a long tail up to 256 blocks. Requests above the largest
+// block pmm_alloc can serve are clamped.
+static uint32_t mixedSize(uint64_t *rng)
+{
+    uint64_t r = bench_rand(rng) % 100;
+    uint32_t blocks;
+    if (r < 50)
+        blocks = 1;
+    else if (r < 80)
+        blocks = 2 + bench_rand(rng) % 15;
+    else if (r < 95)
+        blocks = 17 + bench_rand(rng) % 48;
+    else
+        blocks = 65 + bench_rand(rng) % 192;
+    if (blocks > MAX_ALLOC_BLOCKS)
+        blocks = MAX_ALLOC_BLOCKS;
+    return blocks * BLOCK_SIZE;
+}
+
+static int timedAlloc(struct bench_latency *lat, struct allocation *out, uint32_t size)
+{
+    uint64_t start = bench_now_ns();
+    phys_addr_t p = pmm_alloc(size);
+    bench_latency_add(lat, bench_now_ns() - start);
+    out->address = p;
+    out->size = size;
+    return p != 0;
+}
+
+static void timedFree(struct bench_latency *lat, struct allocation *a)
+{
+    uint64_t start = bench_now_ns();
+    pmm_free(a->address, a->size);
+    bench_latency_add(lat, bench_now_ns() - start);
+}
+
+static void traceStorm(void)
+{
+    struct bench_latency allocLat, freeLat;
+    struct allocation *live = malloc(ops * sizeof(*live));
+    uint64_t rng = seed, count = 0, failures = 0;
+
+    boot();
+    bench_latency_init(&allocLat, ops);
+    bench_latency_init(&freeLat, ops);
+
+    while (count < ops)
+    {
+        if (!timedAlloc(&allocLat, &live[count], BLOCK_SIZE))
+        {
+            failures++;
+            break;
+        }
+        count++;
+    }
+    double fragFull = hosted_fragmentation();
+
+    // exit of the faulting process: pages come back in no particular order
+    for (uint64_t i = count; i > 1; i--)
+    {
+        uint64_t j = bench_rand(&rng) % i;
+        struct allocation t = live[i - 1];
+        live[i - 1] = live[j];
+        live[j] = t;
+    }
+    for (uint64_t i = 0; i < count; i++)
+        timedFree(&freeLat, &live[i]);
+
+    bench_report("storm", "alloc", &allocLat);
+    bench_report("storm", "free", &freeLat);
+    printf("%-10s failures %llu, fragmentation after allocs %.3f, after frees %.3f\n", "storm",
+           (unsigned long long)failures, fragFull, hosted_fragmentation());
+
+    bench_latency_free(&allocLat);
+    bench_latency_free(&freeLat);
+    free(live);
+}
+
+static void traceMixed(void)
+{
+    struct bench_latency allocLat, freeLat;
+    struct allocation live[MIXED_MAX_LIVE];
+    uint64_t rng = seed, liveCount = 0, failures = 0;
+
+    boot();
+    bench_latency_init(&allocLat, ops);
+    bench_latency_init(&freeLat, ops);
+
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        if (liveCount == 0 || (liveCount < MIXED_MAX_LIVE && bench_rand(&rng) % 2))
+        {
+            if (timedAlloc(&allocLat, &live[liveCount], mixedSize(&rng)))
+                liveCount++;
+            else
+                failures++;
+        }
+        else
+        {
+            uint64_t j = bench_rand(&rng) % liveCount;
+            timedFree(&freeLat, &live[j]);
+            live[j] = live[--liveCount];
+        }
+    }
+
+    bench_report("mixed", "alloc", &allocLat);
+    bench_report("mixed", "free", &freeLat);
+    printf("%-10s failures %llu, live %llu, fragmentation %.3f\n", "mixed",
+           (unsigned long long)failures, (unsigned long long)liveCount, hosted_fragmentation());
+
+    for (uint64_t i = 0; i < liveCount; i++)
+        pmm_free(live[i].address, live[i].size);
+    bench_latency_free(&allocLat);
+    bench_latency_free(&freeLat);
+}
+
+static void traceChurn(void)
+{
+    struct bench_latency allocLat, freeLat;
+    uint64_t rng = seed, liveCount = 0, liveBlocks = 0, failures = 0;
+    uint64_t maxLive, sampleEvery;
+    struct allocation *live;
+
+    boot();
+    maxLive = hosted_free_blocks();
+    live = malloc(maxLive * sizeof(*live));
+    bench_latency_init(&allocLat, ops);
+    bench_latency_init(&freeLat, ops);
+
+    // fill three quarters of memory
+    uint64_t target = hosted_free_blocks() * 3 / 4;
+    while (liveBlocks < target)
+    {
+        uint32_t size = mixedSize(&rng);
+        phys_addr_t p = pmm_alloc(size);
+        if (p == 0)
+            break;
+        live[liveCount++] = (struct allocation){p, size};
+        liveBlocks += size / BLOCK_SIZE;
+    }
+    printf("%-10s filled %llu blocks in %llu allocations, fragmentation %.3f\n", "churn",
+           (unsigned long long)liveBlocks, (unsigned long long)liveCount, hosted_fragmentation());
+
+    sampleEvery = ops / 10 ? ops / 10 : 1;
+    for (uint64_t i = 1; i <= ops; i++)
+    {
+        uint64_t j = bench_rand(&rng) % liveCount;
+        liveBlocks -= live[j].size / BLOCK_SIZE;
+        timedFree(&freeLat, &live[j]);
+        live[j] = live[--liveCount];
+
+        if (timedAlloc(&allocLat, &live[liveCount], mixedSize(&rng)))
+            liveBlocks += live[liveCount++].size / BLOCK_SIZE;
+        else
+            failures++;
+
+        if (i % sampleEvery == 0)
+            printf("%-10s step %8llu: live %llu blocks, failures %llu, fragmentation %.3f\n", "churn",
+                   (unsigned long long)i, (unsigned long long)liveBlocks, (unsigned long long)failures,
+                   hosted_fragmentation());
+    }
+
+    bench_report("churn", "alloc", &allocLat);
+    bench_report("churn", "free", &freeLat);
+
+    for (uint64_t i = 0; i < liveCount; i++)
+        pmm_free(live[i].address, live[i].size);
+    bench_latency_free(&allocLat);
+    bench_latency_free(&freeLat);
+    free(live);
+}
+
+struct worker
+{
+    uint32_t cpu;
+    uint64_t failures;
+    uint64_t start, end; // timed inside the worker, the main thread may be scheduled late
+    pthread_barrier_t *barrier;
+};
+
+static void *threadWorker(void *arg)
+{
+    struct worker *w = arg;
+    phys_addr_t held[THREAD_BURST];
+
+    hosted_set_cpu(w->cpu);
+    pthread_barrier_wait(w->barrier);
+
+    w->start = bench_now_ns();
+    for (uint64_t i = 0; i < ops; i += THREAD_BURST)
+    {
+        for (uint32_t j = 0; j < THREAD_BURST; j++)
+            if ((held[j] = pmm_alloc(BLOCK_SIZE)) == 0)
+                w->failures++;
+        for (uint32_t j = 0; j < THREAD_BURST; j++)
+            if (held[j] != 0)
+                pmm_free(held[j], BLOCK_SIZE);
+    }
+    w->end = bench_now_ns();
+    return NULL;
+}
+
+static void traceThreads(void)
+{
+    pthread_t threads[PMM_MAX_CPUS];
+    struct worker workers[PMM_MAX_CPUS];
+    pthread_barrier_t barrier;
+
+    printf("%-10s %-8s %8s %14s %8s %9s\n", "threads", "caches", "threads", "ops/sec", "speedup", "failures");
+    for (int cached = 1; cached >= 0; cached--)
+    {
+        double single = 0.0;
+        for (uint32_t n = 1; n <= PMM_MAX_CPUS; n *= 2)
+        {
+            uint64_t failures = 0, start = UINT64_MAX, end = 0;
+
+            boot();
+            if (!cached)
+                pmm_pcp_tune(1, 0, 0, 0);
+
+            pthread_barrier_init(&barrier, NULL, n + 1);
+            for (uint32_t i = 0; i < n; i++)
+            {
+                workers[i] = (struct worker){i, 0, 0, 0, &barrier};
+                pthread_create(&threads[i], NULL, threadWorker, &workers[i]);
+            }
+            pthread_barrier_wait(&barrier);
+            for (uint32_t i = 0; i < n; i++)
+            {
+                pthread_join(threads[i], NULL);
+                failures += workers[i].failures;
+                start = workers[i].start < start ? workers[i].start : start;
+                end = workers[i].end > end ? workers[i].end : end;
+            }
+            pthread_barrier_destroy(&barrier);
+
+            double opsPerSec = (double)n * ops * 2 * 1e9 / (end - start);
+            if (n == 1)
+                single = opsPerSec;
+            printf("%-10s %-8s %8u %14.0f %8.2f %9llu\n", "threads", cached ? "on" : "off", n, opsPerSec,
+                   opsPerSec / single, (unsigned long long)failures);
+        }
+    }
+}
+
+// Time rounds of taking and releasing a batch of 4K pages, as ns per page
+static void bulkRounds(uint32_t size, bool bulk, double *allocNs, double *freeNs)
+{
+    phys_addr_t batch[BULK_MAX_BATCH];
+    uint64_t rounds = ops / size ? ops / size : 1, allocTotal = 0, freeTotal = 0, start;
+    uint32_t got = size;
+
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        start = bench_now_ns();
+        if (bulk)
+            got = pmm_alloc_bulk(0, size, batch);
+        else
+            for (uint32_t i = 0; i < size; i++)
+                batch[i] = pmm_alloc(BLOCK_SIZE);
+        allocTotal += bench_now_ns() - start;
+
+        start = bench_now_ns();
+        if (bulk)
+            pmm_free_bulk(0, batch, got);
+        else
+            for (uint32_t i = 0; i < size; i++)
+                pmm_free(batch[i], BLOCK_SIZE);
+        freeTotal += bench_now_ns() - start;
+    }
+    *allocNs = (double)allocTotal / (rounds * size);
+    *freeNs = (double)freeTotal / (rounds * size);
+}
+
+static void traceBulk(void)
+{
+    static const char *methods[] = {"loop", "loop-nopcp", "bulk"};
+    double allocNs[3], freeNs[3];
+
+    printf("%-10s %8s %-11s %14s %14s %8s %9s\n", "bulk", "batch", "method", "alloc/page", "free/page", "vs loop", "vs nopcp");
+    for (uint32_t size = 1; size <= BULK_MAX_BATCH; size *= 4)
+    {
+        for (uint32_t m = 0; m < 3; m++)
+        {
+            boot();
+            if (m == 1)
+                pmm_pcp_tune(1, 0, 0, 0);
+            bulkRounds(size, m == 2, &allocNs[m], &freeNs[m]);
+        }
+        for (uint32_t m = 0; m < 3; m++)
+        {
+            double ns = allocNs[m] + freeNs[m];
+            printf("%-10s %8u %-11s %11.1f ns %11.1f ns %7.2fx %8.2fx\n", "bulk", size, methods[m], allocNs[m], freeNs[m],
+                   (allocNs[0] + freeNs[0]) / ns, (allocNs[1] + freeNs[1]) / ns);
+        }
+    }
+}
+
+// Timed and counted phase of the cache trace
+static void cachePhase(struct bench_counters *counters, const char *op, uint64_t count, uint64_t ns)
+{
+    printf("%-10s %-8s %10llu %11.1f ns", "cache", op, (unsigned long long)count, (double)ns / count);
+    if (counters->available)
+        printf(" %12.2f %12.2f\n", (double)bench_counters_read(counters, BENCH_L1D_MISSES) / count,
+               (double)bench_counters_read(counters, BENCH_LLC_MISSES) / count);
+    else
+        printf(" %12s %12s\n", "n/a", "n/a");
+}
+
+static void traceCache(void)
+{
+    struct bench_counters counters;
+    struct allocation *live = malloc(ops * sizeof(*live));
+    uint64_t rng = seed, count = 0, start, ns;
+
+    boot();
+    for (uint32_t blocks = 1; blocks <= PCP_MAX_BLOCKS; blocks *= 2)
+        pmm_pcp_tune(blocks, 0, 0, 0);
+
+    // pick the sizes up front so the RNG stays out of the counts
+    for (uint64_t i = 0; i < ops; i++)
+        live[i].size = mixedSize(&rng);
+
+    bench_counters_open(&counters);
+    printf("%-10s %-8s %10s %14s %12s %12s\n", "cache", "op", "count", "time/op", "L1D miss/op", "LLC miss/op");
+
+    bench_counters_start(&counters);
+    start = bench_now_ns();
+    while (count < ops && (live[count].address = pmm_alloc(live[count].size)) != 0)
+        count++;
+    ns = bench_now_ns() - start;
+    bench_counters_stop(&counters);
+    cachePhase(&counters, "alloc", count, ns);
+
+    for (uint64_t i = count; i > 1; i--)
+    {
+        uint64_t j = bench_rand(&rng) % i;
+        struct allocation t = live[i - 1];
+        live[i - 1] = live[j];
+        live[j] = t;
+    }
+
+    bench_counters_start(&counters);
+    start = bench_now_ns();
+    for (uint64_t i = 0; i < count; i++)
+        pmm_free(live[i].address, live[i].size);
+    ns = bench_now_ns() - start;
+    bench_counters_stop(&counters);
+    cachePhase(&counters, "free", count, ns);
+
+    if (!counters.available)
+        printf("%-10s hardware cache counters are not available here (perf_event_open failed)\n", "cache");
+    bench_counters_close(&counters);
+    free(live);
+}
+
+static void traceBoot(void)
+{
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    multiboot_info_t *mbt;
+    uint64_t start, eager, deferred, finish, chunks;
+
+    printf("%-10s %10s %12s %12s %12s %12s\n", "boot", "RAM(MB)", "managed(MB)", "eager", "deferred", "per chunk");
+    for (uint64_t mb = 64; mb <= BOOT_MAX_MB; mb *= 4)
+    {
+        uint32_t count = hosted_map_pc(regions, mb << 20);
+
+        pmm_set_deferred_init(0);
+        mbt = hosted_prepare(regions, count);
+        start = bench_now_ns();
+        init_pmm(mbt);
+        eager = bench_now_ns() - start;
+        uint64_t managed = ((uint64_t)hosted_free_blocks() + hosted_free_dma_blocks()) * BLOCK_SIZE >> 20;
+
+        pmm_set_deferred_init(PMM_INIT_CHUNK);
+        mbt = hosted_prepare(regions, count);
+        start = bench_now_ns();
+        init_pmm(mbt);
+        deferred = bench_now_ns() - start;
+
+        // what the idle loop, or allocations running into unbuilt memory, pay later
+        start = bench_now_ns();
+        for (chunks = 0; pmm_init_deferred(PMM_INIT_CHUNK); chunks++)
+            ;
+        finish = bench_now_ns() - start;
+
+        printf("%-10s %10llu %12llu %9.3f ms %9.3f ms %9.1f us\n", "boot", (unsigned long long)mb, (unsigned long long)managed,
+               eager / 1e6, deferred / 1e6, chunks ? finish / 1e3 / chunks : 0.0);
+    }
+    pmm_set_deferred_init(0);
+}
+
+static void traceFill(void)
+{
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    uint64_t start, elapsed, allocs, high;
+    phys_addr_t address;
+
+    printf("%-10s %10s %12s %12s %12s\n", "fill", "RAM(MB)", "alloc(MB)", "above 4G(MB)", "ns/alloc");
+    for (uint64_t mb = 1024; mb <= BOOT_MAX_MB; mb *= 4)
+    {
+        hosted_boot(regions, hosted_map_pc(regions, mb << 20));
+
+        allocs = high = 0;
+        start = bench_now_ns();
+        while ((address = pmm_alloc(BLOCK_SIZE)) != 0)
+        {
+            allocs++;
+            high += address >= HIGH_MEMORY_START;
+        }
+        elapsed = bench_now_ns() - start;
+
+        printf("%-10s %10llu %12llu %12llu %12.1f\n", "fill", (unsigned long long)mb, (unsigned long long)(allocs * BLOCK_SIZE >> 20),
+               (unsigned long long)(high * BLOCK_SIZE >> 20), allocs ? (double)elapsed / allocs : 0.0);
+    }
+}
+
+struct numaWorker
+{
+    uint32_t cpu;
+    uint32_t policy; // PMM_POLICY_*, binding is to node 0
+    uint64_t pages;  // 4K pages to take and hold
+    uint64_t local, failures;
+    uint64_t start, end;
+    pthread_barrier_t *barrier;
+};
+
+static struct pmm_node_range numaRanges[PMM_MAX_NODES];
+static uint32_t numaRangeCount;
+
+static uint32_t numaNodeOf(phys_addr_t address)
+{
+    for (uint32_t i = 0; i < numaRangeCount; i++)
+        if (address >= numaRanges[i].base && address - numaRanges[i].base < numaRanges[i].length)
+            return numaRanges[i].node;
+    return 0;
+}
+
+static void *numaThread(void *arg)
+{
+    struct numaWorker *w = arg;
+    phys_addr_t *held = malloc(w->pages * sizeof(*held));
+    uint64_t count = 0;
+
+    hosted_set_cpu(w->cpu);
+    pmm_set_policy(w->policy, 0);
+    pthread_barrier_wait(w->barrier);
+
+    w->start = bench_now_ns();
+    for (uint64_t i = 0; i < w->pages; i++)
+    {
+        if ((held[count] = pmm_alloc(BLOCK_SIZE)) == 0)
+        {
+            w->failures++;
+            continue;
+        }
+        w->local += numaNodeOf(held[count]) == w->cpu % NUMA_NODES;
+        count++;
+    }
+    for (uint64_t i = 0; i < count; i++)
+        pmm_free(held[i], BLOCK_SIZE);
+    w->end = bench_now_ns();
+
+    pmm_pcp_drain();
+    free(held);
+    return NULL;
+}
+
+static void traceNuma(void)
+{
+    static const struct
+    {
+        const char *name;
+        bool aware;
+        uint32_t policy;
+    } modes[] = {
+        {"no-table", false, PMM_POLICY_LOCAL},
+        {"local", true, PMM_POLICY_LOCAL},
+        {"interleave", true, PMM_POLICY_INTERLEAVE},
+        {"bind-0", true, PMM_POLICY_BIND},
+    };
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    pthread_t threads[NUMA_THREADS];
+    struct numaWorker workers[NUMA_THREADS];
+    pthread_barrier_t barrier;
+    struct pmm_node_stats stats;
+
+    uint32_t count = hosted_map_pc(regions, ramMB << 20);
+    numaRangeCount = hosted_numa_ranges(regions, count, NUMA_NODES, numaRanges);
+
+    printf("%-10s %-10s %14s %8s %9s %8s\n", "numa", "policy", "ops/sec", "local", "failures", "pmm hit");
+    for (uint32_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        uint64_t local = 0, pages = 0, failures = 0, hit = 0, miss = 0, start = UINT64_MAX, end = 0;
+
+        if (modes[m].aware)
+            hosted_boot_numa(regions, count, numaRanges, numaRangeCount);
+        else
+            hosted_boot(regions, count);
+        for (uint32_t cpu = 0; cpu < NUMA_THREADS; cpu++)
+            pmm_set_cpu_node(cpu, cpu % NUMA_NODES);
+
+        // leave a fifth of every node free, so the local policy never has to fall back
+        uint64_t share = (uint64_t)hosted_free_blocks() * 4 / 5 / NUMA_THREADS;
+        pthread_barrier_init(&barrier, NULL, NUMA_THREADS + 1);
+        for (uint32_t i = 0; i < NUMA_THREADS; i++)
+        {
+            workers[i] = (struct numaWorker){i, modes[m].policy, share < ops ? share : ops, 0, 0, 0, 0, &barrier};
+            pthread_create(&threads[i], NULL, numaThread, &workers[i]);
+        }
+        pthread_barrier_wait(&barrier);
+        for (uint32_t i = 0; i < NUMA_THREADS; i++)
+        {
+            pthread_join(threads[i], NULL);
+            local += workers[i].local;
+            pages += workers[i].pages;
+            failures += workers[i].failures;
+            start = workers[i].start < start ? workers[i].start : start;
+            end = workers[i].end > end ? workers[i].end : end;
+        }
+        pthread_barrier_destroy(&barrier);
+
+        for (uint32_t node = 0; node < pmm_node_count(); node++)
+        {
+            pmm_get_node_stats(node, &stats);
+            hit += stats.hit;
+            miss += stats.miss;
+        }
+        printf("%-10s %-10s %14.0f %7.1f%% %9llu %7.1f%%\n", "numa", modes[m].name, (double)(pages - failures) * 2 * 1e9 / (end - start),
+               pages - failures ? 100.0 * local / (pages - failures) : 0.0, (unsigned long long)failures, hit + miss ? 100.0 * hit / (hit + miss) : 0.0);
+    }
+}
+
+// Upper bound in ns of the histogram bucket the given share of the calls fall in, 0 if there are none
+static uint64_t histogramPercentile(const uint64_t *buckets, double share)
+{
+    uint64_t total = 0, seen = 0;
+
+    for (uint32_t i = 0; i < PMM_LATENCY_BUCKETS; i++)
+        total += buckets[i];
+    for (uint32_t i = 0; i < PMM_LATENCY_BUCKETS && total > 0; i++)
+    {
+        seen += buckets[i];
+        if (seen >= total * share)
+            return 1ull << i;
+    }
+    return 0;
+}
+
+static void traceStats(void)
+{
+    static const char *zoneTypes[] = {"DMA", "Normal", "High"};
+    static const char *events[PMM_EVENT_COUNT] = {"alloc", "alloc-fail", "free", "alloc-bulk", "free-bulk", "alloc-dma", "free-dma", "alloc-node", "compact", "alloc-huge", "free-huge", "alloc-zeroed", "free-zeroed"};
+    static struct pmm_stats stats;
+    static struct pmm_trace_record records[PMM_TRACE_RING_SIZE];
+    struct allocation live[MIXED_MAX_LIVE];
+    uint64_t rng = seed, liveCount = 0, cursor = 0;
+    uint32_t kept;
+
+    boot();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        if (liveCount == 0 || (liveCount < MIXED_MAX_LIVE && bench_rand(&rng) % 2))
+        {
+            live[liveCount].size = mixedSize(&rng);
+            live[liveCount].address = pmm_alloc(live[liveCount].size);
+            if (live[liveCount].address != 0)
+                liveCount++;
+        }
+        else
+        {
+            uint64_t j = bench_rand(&rng) % liveCount;
+            pmm_free(live[j].address, live[j].size);
+            live[j] = live[--liveCount];
+        }
+    }
+    for (uint64_t i = 0; i < liveCount; i++)
+        pmm_free(live[i].address, live[i].size);
+
+    pmm_get_stats(&stats);
+    printf("%-10s calls: %llu allocs, %llu frees, %llu failed allocs, %llu pools locked\n", "stats", (unsigned long long)stats.allocs,
+           (unsigned long long)stats.frees, (unsigned long long)stats.allocFails, (unsigned long long)stats.poolScans);
+    printf("%-10s %-12s %6s %12s %12s %12s %12s %12s %8s\n", "stats", "zone", "pages", "allocs", "frees", "splits", "merges", "searches", "steals");
+    for (uint32_t i = 0; i < stats.zoneCount; i++)
+    {
+        struct pmm_zone_stats *zone = &stats.zones[i];
+        char name[16];
+
+        if (zone->poolCount == 0)
+            continue;
+        snprintf(name, sizeof(name), "%s/%u", zoneTypes[zone->type], zone->node);
+        for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+            printf("%-10s %-12s %6u %12llu %12llu %12llu %12llu %12llu %8llu\n", "stats", name, 1u << order,
+                   (unsigned long long)zone->orders[order].allocs, (unsigned long long)zone->orders[order].frees,
+                   (unsigned long long)zone->orders[order].splits, (unsigned long long)zone->orders[order].merges,
+                   (unsigned long long)zone->orders[order].searches, (unsigned long long)zone->orders[order].steals);
+        printf("%-10s %-12s %u pools, %u pages free, %llu failed takes\n", "stats", name, zone->poolCount, zone->freeBlocks,
+               (unsigned long long)zone->fails);
+    }
+
+    kept = pmm_trace_read(0, &cursor, records, PMM_TRACE_RING_SIZE);
+    if (kept == 0)
+    {
+        printf("%-10s no latency histograms or trace records, build with TRACE=1\n", "stats");
+        return;
+    }
+    printf("%-10s %-12s %12s %10s %10s %10s\n", "stats", "event", "calls", "p50(ns)<", "p99(ns)<", "p999(ns)<");
+    for (uint32_t event = 0; event < PMM_EVENT_COUNT; event++)
+    {
+        uint64_t calls = 0;
+        for (uint32_t i = 0; i < PMM_LATENCY_BUCKETS; i++)
+            calls += stats.latency[event][i];
+        if (calls > 0)
+            printf("%-10s %-12s %12llu %10llu %10llu %10llu\n", "stats", events[event], (unsigned long long)calls,
+                   (unsigned long long)histogramPercentile(stats.latency[event], 0.5), (unsigned long long)histogramPercentile(stats.latency[event], 0.99),
+                   (unsigned long long)histogramPercentile(stats.latency[event], 0.999));
+    }
+    printf("%-10s trace ring of CPU 0 kept %u of %llu records, the last one: %s of %u @ %llx in %u ns\n", "stats", kept, (unsigned long long)cursor,
+           events[records[kept - 1].event], records[kept - 1].arg, (unsigned long long)records[kept - 1].address, records[kept - 1].latency);
+}
+
+struct process
+{
+    phys_addr_t *pages;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+static void endProcess(struct process *procs, uint64_t *procCount, uint64_t j, uint64_t *used)
+{
+    for (uint32_t i = 0; i < procs[j].count; i++)
+        pmm_free(procs[j].pages[i], BLOCK_SIZE);
+    *used -= procs[j].count;
+    free(procs[j].pages);
+    procs[j] = procs[--*procCount];
+}
+
+// One run of the mobility trace, fills success[] with the probe success rate of each window
+static void mobilityRun(bool typed, double success[MOBILITY_WINDOWS], uint64_t *steals, uint64_t *failures)
+{
+    static struct pmm_stats stats;
+    uint64_t rng = seed, steps = ops, window = steps / MOBILITY_WINDOWS ? steps / MOBILITY_WINDOWS : 1;
+    uint64_t used = 0, high, low, kernelMax, kernelCount = 0, procCount = 0, faults = 0, wanted = 0, hits = 0;
+    uint32_t processType = typed ? PMM_MOVABLE : PMM_UNMOVABLE;
+    struct process procs[MOBILITY_PROCESSES];
+    bool shrinking = false;
+    phys_addr_t *kernel, *probe;
+
+    boot();
+    probe = malloc((hosted_free_blocks() / 4 / PROBE_BLOCKS + 1) * sizeof(*probe));
+    high = hosted_free_blocks() * MOBILITY_HIGH / 100;
+    low = hosted_free_blocks() * MOBILITY_LOW / 100;
+    kernelMax = high / MOBILITY_KERNEL_SHARE;
+    kernel = malloc((kernelMax + 1) * sizeof(*kernel));
+    *failures = 0;
+
+    for (uint64_t step = 1; step <= steps; step++)
+    {
+        uint64_t j;
+
+        // load comes in waves: memory fills up, then processes exit until it is back at low
+        if (used >= high)
+            shrinking = true;
+        else if (used <= low)
+            shrinking = false;
+        if (shrinking && procCount > 0)
+            endProcess(procs, &procCount, bench_rand(&rng) % procCount, &used);
+        else
+        {
+            if (procCount < MOBILITY_PROCESSES)
+                procs[procCount++] = (struct process){NULL, 0, 0};
+
+            // a random process faults in a run of pages, the kernel allocating alongside it
+            j = bench_rand(&rng) % procCount;
+            if (procs[j].count + MOBILITY_BURST > procs[j].capacity)
+            {
+                procs[j].capacity = 2 * procs[j].capacity + MOBILITY_BURST;
+                procs[j].pages = realloc(procs[j].pages, procs[j].capacity * sizeof(*procs[j].pages));
+            }
+            for (uint32_t i = 0; i < MOBILITY_BURST; i++)
+            {
+                if ((procs[j].pages[procs[j].count] = pmm_alloc_type(BLOCK_SIZE, processType)) != 0)
+                {
+                    procs[j].count++;
+                    used++;
+                    faults++;
+                }
+                else
+                    (*failures)++;
+
+                if (faults % MOBILITY_KERNEL_EVERY == 0 && kernelMax > 0)
+                {
+                    if (kernelCount == kernelMax)
+                    {
+                        uint64_t k = bench_rand(&rng) % kernelCount;
+                        pmm_free(kernel[k], BLOCK_SIZE);
+                        kernel[k] = kernel[--kernelCount];
+                        used--;
+                    }
+                    if ((kernel[kernelCount] = pmm_alloc(BLOCK_SIZE)) != 0)
+                    {
+                        kernelCount++;
+                        used++;
+                    }
+                    else
+                        (*failures)++;
+                }
+            }
+        }
+
+        // ask for a quarter of the free memory in 8 page blocks, give them back right away
+        if (step % MOBILITY_PROBE_EVERY == 0)
+        {
+            uint32_t want = hosted_free_blocks() / 4 / PROBE_BLOCKS, got = 0;
+            while (got < want && (probe[got] = pmm_alloc_type(PROBE_BLOCKS * BLOCK_SIZE, processType)) != 0)
+                got++;
+            for (uint32_t i = 0; i < got; i++)
+                pmm_free(probe[i], PROBE_BLOCKS * BLOCK_SIZE);
+            wanted += want;
+            hits += got;
+        }
+        if (step % window == 0 && step / window <= MOBILITY_WINDOWS)
+        {
+            success[step / window - 1] = wanted ? 100.0 * hits / wanted : 0.0;
+            hits = wanted = 0;
+        }
+    }
+
+    pmm_get_stats(&stats);
+    *steals = 0;
+    for (uint32_t i = 0; i < stats.zoneCount; i++)
+        for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+            *steals += stats.zones[i].orders[order].steals;
+
+    while (procCount > 0)
+        endProcess(procs, &procCount, 0, &used);
+    for (uint64_t i = 0; i < kernelCount; i++)
+        pmm_free(kernel[i], BLOCK_SIZE);
+    free(kernel);
+    free(probe);
+}
+
+static void traceMobility(void)
+{
+    double untyped[MOBILITY_WINDOWS] = {0}, typed[MOBILITY_WINDOWS] = {0};
+    uint64_t untypedSteals, typedSteals, untypedFailures, typedFailures;
+
+    mobilityRun(false, untyped, &untypedSteals, &untypedFailures);
+    mobilityRun(true, typed, &typedSteals, &typedFailures);
+
+    printf("%-10s %-8s %21s %21s\n", "mobility", "window", "untyped 8 page ok", "typed 8 page ok");
+    for (uint32_t w = 0; w < MOBILITY_WINDOWS; w++)
+        printf("%-10s %-8u %20.1f%% %20.1f%%\n", "mobility", w + 1, untyped[w], typed[w]);
+    printf("%-10s %-8s %21llu %21llu\n", "mobility", "steals", (unsigned long long)untypedSteals, (unsigned long long)typedSteals);
+    printf("%-10s %-8s %21llu %21llu\n", "mobility", "failures", (unsigned long long)untypedFailures, (unsigned long long)typedFailures);
+}
+
+// Ask for a quarter of the free memory in 8 page blocks, give them back afterwards
+static void compactProbe(const char *name)
+{
+    uint32_t want = hosted_free_blocks() / 4 / PROBE_BLOCKS, got = 0;
+    phys_addr_t *probe = malloc((want + 1) * sizeof(*probe));
+    uint64_t moves = hosted_movable_moves(), start = bench_now_ns(), elapsed;
+
+    while (got < want && (probe[got] = pmm_alloc_type(PROBE_BLOCKS * BLOCK_SIZE, PMM_MOVABLE)) != 0)
+        got++;
+    elapsed = bench_now_ns() - start;
+    for (uint32_t i = 0; i < got; i++)
+        pmm_free(probe[i], PROBE_BLOCKS * BLOCK_SIZE);
+    printf("%-10s %-14s %10u %10u %12llu %12.1f\n", "compact", name, want, got, (unsigned long long)(hosted_movable_moves() - moves),
+           want ? (double)elapsed / want : 0.0);
+    free(probe);
+}
+
+static void traceCompact(void)
+{
+    uint64_t rng = seed, start, elapsed;
+    uint32_t count = 0, kept = 0, moved;
+    uint32_t *slots;
+    phys_addr_t p;
+    double fragmented, compacted;
+
+    boot();
+    slots = malloc((hosted_free_blocks() + hosted_free_dma_blocks()) * sizeof(*slots)); // pmm_alloc spills into the DMA zone
+    while ((p = pmm_alloc_type(BLOCK_SIZE, PMM_MOVABLE)) != 0)
+        slots[count++] = hosted_movable_add(p, 0);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (bench_rand(&rng) % COMPACT_KEEP == 0)
+            slots[kept++] = slots[i];
+        else
+            pmm_free(hosted_movable_remove(slots[i]), BLOCK_SIZE);
+    }
+    pmm_pcp_drain();
+    fragmented = hosted_fragmentation();
+
+    printf("%-10s %-14s %10s %10s %12s %12s\n", "compact", "8 page probe", "wanted", "served", "moved", "ns/request");
+    compactProbe("no client");
+    pmm_set_migrate(hosted_migrate);
+    compactProbe("on failure");
+    start = bench_now_ns();
+    moved = pmm_compact();
+    elapsed = bench_now_ns() - start;
+    compacted = hosted_fragmentation();
+    compactProbe("after compact");
+    printf("%-10s held %u of %u pages, fragmentation %.3f, pmm_compact moved %u blocks in %.2f ms, fragmentation %.3f, %llu corrupted\n",
+           "compact", kept, count, fragmented, moved, elapsed / 1e6, compacted, (unsigned long long)hosted_movable_errors());
+
+    for (uint32_t i = 0; i < kept; i++)
+        pmm_free(hosted_movable_remove(slots[i]), BLOCK_SIZE);
+    pmm_set_migrate(NULL);
+    free(slots);
+}
+
+// Ask for HUGE_BLOCKS 2 MB blocks with pmm_alloc_huge, returns how many were served and what they cost
+static uint32_t hugeProbe(uint64_t *elapsed)
+{
+    phys_addr_t probe[HUGE_BLOCKS];
+    uint64_t start = bench_now_ns();
+    uint32_t got = 0;
+
+    while (got < HUGE_BLOCKS && (probe[got] = pmm_alloc_huge(PMM_PAGEBLOCK_ORDER)) != 0)
+        got++;
+    *elapsed = bench_now_ns() - start;
+    for (uint32_t i = 0; i < got; i++)
+        pmm_free_huge(probe[i], PMM_PAGEBLOCK_ORDER);
+    return got;
+}
+
+// One run of the huge trace, with reserve 2 MB blocks set aside at boot
+static void hugeRun(const char *name, uint32_t reserve)
+{
+    uint64_t rng = seed, clean, fragmented;
+    uint32_t count = 0, kept = 0, cleanGot, fragmentedGot;
+    phys_addr_t *pages;
+
+    pmm_set_huge_reserve(PMM_PAGEBLOCK_ORDER, reserve);
+    boot();
+    cleanGot = hugeProbe(&clean);
+
+    // long lived kernel pages all over memory, so that no 2 MB block is left free
+    pages = malloc((hosted_free_blocks() + hosted_free_dma_blocks()) * sizeof(*pages));
+    while ((pages[count] = pmm_alloc(BLOCK_SIZE)) != 0)
+        count++;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (bench_rand(&rng) % HUGE_KEEP == 0)
+            pages[kept++] = pages[i];
+        else
+            pmm_free(pages[i], BLOCK_SIZE);
+    }
+    pmm_pcp_drain();
+    fragmentedGot = hugeProbe(&fragmented);
+
+    printf("%-10s %-14s %10u %10u %12.1f %14u %12.1f %10.3f\n", "huge", name, HUGE_BLOCKS, cleanGot, cleanGot ? (double)clean / cleanGot : 0.0,
+           fragmentedGot, fragmentedGot ? (double)fragmented / fragmentedGot : 0.0, hosted_fragmentation());
+
+    for (uint32_t i = 0; i < kept; i++)
+        pmm_free(pages[i], BLOCK_SIZE);
+    free(pages);
+    pmm_set_huge_reserve(PMM_PAGEBLOCK_ORDER, 0);
+}
+
+static void traceHuge(void)
+{
+    printf("%-10s %-14s %10s %10s %12s %14s %12s %10s\n", "huge", "2 MB blocks", "wanted", "clean ok", "ns/alloc", "fragmented ok", "ns/alloc",
+           "fragment");
+    hugeRun("no reserve", 0);
+    hugeRun("reserve", HUGE_BLOCKS);
+}
+
+/*
+    Churn the objects of a cache of every size. Each sample is a free and
+    an allocation, so objects/sec counts objects allocated and freed. The
+    overhead is what the slabs take beyond the bytes asked for, over them,
+    next to what pmm_alloc would take for the same objects.
+*/
+static void traceSlab(void)
+{
+    static const uint32_t sizes[] = {16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048};
+    void **objects = malloc(SLAB_LIVE * sizeof(*objects));
+
+    printf("%-10s %-8s %10s %14s %9s %9s %8s %10s %10s %10s\n", "slab", "object", "count", "objects/sec", "p50(ns)", "p99(ns)", "colors",
+           "overhead", "pages", "slabs left");
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        struct kmem_cache_stats stats;
+        struct kmem_cache *cache;
+        struct bench_latency lat;
+        uint64_t rng = seed, start, live;
+        double overhead;
+        char name[16];
+
+        boot();
+        pmm_set_reclaim(kmem_reclaim);
+        cache = kmem_cache_create("bench", sizes[s], 0, 0);
+        for (uint32_t i = 0; i < SLAB_LIVE; i++)
+            objects[i] = kmem_cache_alloc(cache);
+
+        bench_latency_init(&lat, ops);
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            uint32_t slot = bench_rand(&rng) % SLAB_LIVE;
+
+            start = bench_now_ns();
+            kmem_cache_free(cache, objects[slot]);
+            objects[slot] = kmem_cache_alloc(cache);
+            bench_latency_add(&lat, bench_now_ns() - start);
+            memset(objects[slot], 0, sizes[s]);
+        }
+
+        kmem_cache_get_stats(cache, &stats);
+        live = (uint64_t)stats.activeObjects * sizes[s];
+        overhead = ((double)stats.slabs * stats.slabBytes - live) * 100.0 / live;
+
+        for (uint32_t i = 0; i < SLAB_LIVE; i++)
+            kmem_cache_free(cache, objects[i]);
+        kmem_cache_shrink(cache);
+        kmem_cache_get_stats(cache, &stats);
+
+        snprintf(name, sizeof(name), "%u B", sizes[s]);
+        printf("%-10s %-8s %10llu %14.0f %9llu %9llu %8u %9.1f%% %9.1f%% %10u\n", "slab", name, (unsigned long long)lat.count,
+               lat.totalNs ? (double)lat.count * 1e9 / lat.totalNs : 0.0, (unsigned long long)bench_latency_percentile(&lat, 0.50),
+               (unsigned long long)bench_latency_percentile(&lat, 0.99), stats.colors, overhead,
+               (double)(BLOCK_SIZE - sizes[s]) * 100.0 / sizes[s], stats.slabs);
+
+        // nothing of the slab layer may point into the arena the next boot maps again
+        kmem_cache_destroy(cache);
+        kmem_reclaim(0);
+        pmm_set_reclaim(NULL);
+        bench_latency_free(&lat);
+    }
+    free(objects);
+}
+
+// What a clearing kernel takes per page, filling an empty pool ZERO_ROUNDS times
+static void zeroKernelRun(const char *name)
+{
+    uint64_t elapsed = 0, start;
+    uint32_t pages = 0;
+
+    boot();
+    if (!pmm_set_zero_kernel(name))
+        return;
+    for (uint32_t round = 0; round < ZERO_ROUNDS; round++)
+    {
+        pmm_set_zero_pool(PMM_MOVABLE, PMM_ZERO_POOL_MAX);
+        start = bench_now_ns();
+        pages += pmm_zero_idle(PMM_ZERO_POOL_MAX);
+        elapsed += bench_now_ns() - start;
+        pmm_set_zero_pool(PMM_MOVABLE, 0);
+    }
+    printf("%-10s %-8s %10u %14.0f %9.1f\n", "zero", name, pages, elapsed ? (double)pages * 1e9 / elapsed : 0.0,
+           pages ? (double)elapsed / pages : 0.0);
+}
+
+// The background thread of the pooled run, on a CPU of its own, resting when the pool is full
+static void *zeroWorker(void *arg)
+{
+    bool *stop = arg;
+
+    hosted_set_cpu(1);
+    while (!__atomic_load_n(stop, __ATOMIC_ACQUIRE))
+        if (pmm_zero_idle(PMM_ZERO_BATCH) == 0)
+            usleep(20);
+    return NULL;
+}
+
+// One run of the zero trace: mode 0 clears pmm_alloc pages itself, 1 uses pmm_alloc_zeroed without a pool, 2 with one
+static void zeroRun(const char *name, int mode)
+{
+    phys_addr_t *live = calloc(ZERO_LIVE, sizeof(*live));
+    struct pmm_stats *stats = malloc(sizeof(*stats));
+    struct bench_latency lat;
+    uint64_t rng = seed, start, dirty = 0;
+    pthread_t worker;
+    bool stop = false;
+
+    boot();
+    if (mode == 2)
+    {
+        pmm_set_zero_pool(PMM_MOVABLE, PMM_ZERO_POOL_MAX);
+        pmm_zero_idle(PMM_ZERO_POOL_MAX);
+        pthread_create(&worker, NULL, zeroWorker, &stop);
+    }
+
+    bench_latency_init(&lat, ops);
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        uint32_t slot = bench_rand(&rng) % ZERO_LIVE;
+        phys_addr_t p;
+        uint64_t *page;
+
+        // the process runs until its next fault
+        for (start = bench_now_ns(); bench_now_ns() - start < ZERO_WORK_NS;)
+            ;
+
+        start = bench_now_ns();
+        if (mode == 0 && (p = pmm_alloc_type(BLOCK_SIZE, PMM_MOVABLE)) != 0)
+            memset(HOSTED_PHYS_TO_VIRT(p), 0, BLOCK_SIZE);
+        else if (mode != 0)
+            p = pmm_alloc_zeroed_type(BLOCK_SIZE, PMM_MOVABLE);
+        bench_latency_add(&lat, bench_now_ns() - start);
+        if (p == 0)
+            continue;
+
+        page = HOSTED_PHYS_TO_VIRT(p);
+        for (uint32_t w = 0; w < BLOCK_SIZE / sizeof(*page); w += 61)
+            dirty += page[w] != 0;
+        memset(page, 0xA5, BLOCK_SIZE);
+        if (live[slot] != 0)
+            pmm_free(live[slot], BLOCK_SIZE);
+        live[slot] = p;
+    }
+
+    if (mode == 2)
+    {
+        __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+        pthread_join(worker, NULL);
+    }
+    pmm_get_stats(stats);
+    bench_report("zero", name, &lat);
+    printf("%-10s %-8s %10llu pool hits, %llu cleared on the fault path, %llu in the background, %llu dirty words\n", "zero", name,
+           (unsigned long long)stats->zeroHits, (unsigned long long)stats->zeroMisses, (unsigned long long)stats->zeroed,
+           (unsigned long long)dirty);
+
+    for (uint32_t i = 0; i < ZERO_LIVE; i++)
+        if (live[i] != 0)
+            pmm_free(live[i], BLOCK_SIZE);
+    pmm_set_zero_pool(PMM_MOVABLE, 0);
+    bench_latency_free(&lat);
+    free(stats);
+    free(live);
+}
+
+static void traceZero(void)
+{
+    static const char *kernels[] = {"avx", "sse2", "stosb", "memset"};
+
+    printf("%-10s %-8s %10s %14s %9s\n", "zero", "kernel", "pages", "pages/sec", "ns/page");
+    for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+        zeroKernelRun(kernels[k]);
+    zeroRun("memset", 0);
+    zeroRun("cold", 1);
+    zeroRun("pooled", 2);
+}
+
+// Whether the held allocations still read their pattern, and freeing them brings the free count to expected
+static bool restartCheck(struct allocation *kept, bool contents, uint64_t expected)
+{
+    bool ok = true;
+
+    for (uint32_t i = 0; i < RESTART_KEEP; i++)
+    {
+        if (contents && *(uint64_t *)HOSTED_PHYS_TO_VIRT(kept[i].address) != RESTART_PATTERN(kept[i].address))
+            ok = false;
+        pmm_free(kept[i].address, 0);
+    }
+    pmm_pcp_drain();
+    return ok && (uint64_t)hosted_free_blocks() + hosted_free_dma_blocks() == expected;
+}
+
+static void traceRestart(void)
+{
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    struct allocation *kept = calloc(RESTART_KEEP, sizeof(*kept));
+    char path[] = "/tmp/pmm_state_XXXXXX";
+    uint64_t rng = seed, start, initNs, saveNs, adoptNs, verifyNs, fileNs, managed, held, imaged;
+    phys_addr_t image;
+    size_t bytes;
+    bool ok;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0)
+    {
+        perror("restart: mkstemp");
+        free(kept);
+        return;
+    }
+    close(fd);
+
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s %6s\n", "restart", "RAM(MB)", "image(MB)", "init", "save", "adopt", "verify", "file", "check");
+    for (uint64_t mb = 256; mb <= RESTART_MAX_MB; mb *= 4)
+    {
+        uint32_t count = hosted_map_pc(regions, mb << 20);
+        multiboot_info_t *mbt = hosted_prepare(regions, count);
+
+        start = bench_now_ns();
+        init_pmm(mbt);
+        initNs = bench_now_ns() - start;
+        managed = (uint64_t)hosted_free_blocks() + hosted_free_dma_blocks();
+
+        for (uint32_t i = 0; i < RESTART_KEEP; i++)
+        {
+            kept[i].size = (1 + bench_rand(&rng) % RESTART_MAX_PAGES) * BLOCK_SIZE;
+            kept[i].address = pmm_alloc(kept[i].size);
+            *(uint64_t *)HOSTED_PHYS_TO_VIRT(kept[i].address) = RESTART_PATTERN(kept[i].address);
+        }
+        ok = hosted_save_state(path);
+        held = (uint64_t)hosted_free_blocks() + hosted_free_dma_blocks();
+
+        // a kexec: the state is saved into memory the pmm hands out, and the new kernel adopts it where it is
+        bytes = pmm_state_size();
+        image = pmm_alloc(bytes);
+        imaged = (uint64_t)hosted_free_blocks() + hosted_free_dma_blocks();
+        start = bench_now_ns();
+        ok &= pmm_save_state(HOSTED_PHYS_TO_VIRT(image), bytes);
+        saveNs = bench_now_ns() - start;
+        start = bench_now_ns();
+        ok &= pmm_adopt_state(HOSTED_PHYS_TO_VIRT(image), bytes, 0);
+        adoptNs = bench_now_ns() - start;
+
+        // adopting relocates the image, so it is saved once more to adopt it with the full checksum
+        ok &= pmm_save_state(HOSTED_PHYS_TO_VIRT(image), bytes);
+        start = bench_now_ns();
+        ok &= pmm_adopt_state(HOSTED_PHYS_TO_VIRT(image), bytes, PMM_ADOPT_VERIFY);
+        verifyNs = bench_now_ns() - start;
+        ok &= (uint64_t)hosted_free_blocks() + hosted_free_dma_blocks() == imaged;
+        ok &= restartCheck(kept, true, managed - (held - imaged)); // the image stays where the new kernel adopted it
+
+        // a restart of the service, from the file on a fresh arena
+        hosted_prepare(regions, count);
+        start = bench_now_ns();
+        ok &= hosted_restore_state(path, 0);
+        fileNs = bench_now_ns() - start;
+        ok &= (uint64_t)hosted_free_blocks() + hosted_free_dma_blocks() == held;
+        ok &= restartCheck(kept, false, managed);
+
+        printf("%-10s %10llu %10.1f %7.3f ms %7.3f ms %7.1f us %7.3f ms %7.1f us %6s\n", "restart", (unsigned long long)mb, bytes / 1048576.0,
+               initNs / 1e6, saveNs / 1e6, adoptNs / 1e3, verifyNs / 1e6, fileNs / 1e3, ok ? "ok" : "FAIL");
+    }
+    unlink(path);
+    free(kept);
+}
+
+static const struct
+{
+    const char *name;
+    void (*run)(void);
+} traces[] = {
+    {"storm", traceStorm},
+    {"mixed", traceMixed},
+    {"churn", traceChurn},
+    {"threads", traceThreads},
+    {"bulk", traceBulk},
+    {"cache", traceCache},
+    {"boot", traceBoot},
+    {"fill", traceFill},
+    {"numa", traceNuma},
+    {"stats", traceStats},
+    {"mobility", traceMobility},
+    {"compact", traceCompact},
+    {"huge", traceHuge},
+    {"slab", traceSlab},
+    {"zero", traceZero},
+    {"restart", traceRestart},
+};
+
+#define TRACE_COUNT (sizeof(traces) / sizeof(traces[0]))
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:s:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            ramMB = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'r':
+            recordPath = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m ramMB] [-n ops] [-s seed] [-r file] [storm|mixed|churn|threads|bulk|cache|boot|fill|numa|stats|mobility|compact|huge|slab|zero|restart...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (recordPath != NULL && (recordBuffer = malloc(RECORD_BYTES)) == NULL)
+        return 1;
+    printf("pmm_bench: %llu MB RAM, %llu ops, seed %llx\n", (unsigned long long)ramMB,
+           (unsigned long long)ops, (unsigned long long)seed);
+    bench_report_header();
+
+    for (size_t t = 0; t < TRACE_COUNT; t++)
+    {
+        bool selected = (optind == argc);
+        for (int i = optind; i < argc; i++)
+            if (strcmp(argv[i], traces[t].name) == 0)
+                selected = true;
+        if (selected)
+            traces[t].run();
+    }
+    if (recordPath != NULL)
+        recordDump();
+    return 0;
+}
@@ -0,0 +1,636 @@
+/*
+    Replays a recording of the pmm (see pmm_record_start in trace.h)
+    against a freshly booted hosted pmm, for regression benchmarking on
+    the traffic of a real workload. pmm_bench -r file writes one.
+
+    The pmm is booted on the memory map, node table, deferred init, DMA
+    reserve and huge page reserve of the recording. Every free is matched
+    to the allocation that handed its address out, and frees the address
+    the replayed allocation got instead. Every call runs under the CPU id
+    it was recorded on, as fast as it can rather than at the pace of the
+    timestamps. Bulk calls only carry their first address and pmm_compact
+    needs the migrate client of the recorded kernel, so they are skipped,
+    together with frees of blocks whose allocation isn't in the recording
+    or which compaction moved to another address.
+    The zero pools are not part of a recording either, so the replay has
+    none: pmm_alloc_zeroed always clears what it takes, and pmm_free_zeroed
+    frees the page like pmm_free.
+
+    By default the calls are replayed in the order they were recorded from
+    one thread. With -c every recorded CPU gets a thread of its own that
+    plays the calls of that CPU in their order, waiting for a block
+    another CPU allocates before freeing it, so that the per-CPU caches and
+    pool locks see the recorded concurrency.
+
+    Reports throughput and latency of the replay next to the recorded
+    latencies, where replayed allocations failed when the recorded ones
+    didn't and the other way round, allocations that ended up in another
+    zone, and free memory, the largest free block and fragmentation at the
+    end of each of -w windows of the recording.
+
+    With -t, instead of a file, it records a short workload of its own on
+    a hosted pmm and replays that: allocations of every mobility type up to
+    MAX_ALLOC_BLOCKS pages, beyond what 16 bits of page count hold, plain
+    and zeroed, one too large to serve, and a free of each, a zeroed page
+    into a pool with pmm_free_zeroed. It checks that
+    every recorded call decodes to the size and type that was asked for,
+    that the replayed ones fail where the recorded ones did, and that the
+    replay gives back all the memory it took. Needs a TRACE=1 build;
+    make replay-check runs it.
+
+    usage: pmm_replay [-c] [-w windows] file
+           pmm_replay -t
+*/
+
+#include "bench.h"
+#include "hosted.h"
+#include <lumos/percpu.h>
+#include <lumos/pmm.h>
+#include <lumos/trace.h>
+#include <lumos/zero.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REPLAY_MAX_WINDOWS 100
+#define REPLAY_FAIL_POINTS 8 // failures listed one by one
+#define NO_MATCH UINT64_MAX
+#define CHECK_RAM_MB 2048 // memory of the -t check, room for a block of MAX_ALLOC_BLOCKS pages
+
+// what a record is replayed as
+enum replay_kind
+{
+    REPLAY_SKIP,
+    REPLAY_ALLOC,
+    REPLAY_FREE,
+};
+
+// a call of the -t check
+struct check_call
+{
+    uint32_t event; // PMM_EVENT_* it is recorded as
+    uint32_t pages;
+    uint32_t type;
+    bool zeroedFree; // freed with pmm_free_zeroed into a pool with room, else with pmm_free
+};
+
+struct replay_cpu
+{
+    uint32_t cpu;
+    uint64_t *indices; // records of this CPU, NULL to play every record
+    uint64_t count;
+    uint64_t failures;
+    struct bench_latency allocLat, freeLat;
+};
+
+static struct pmm_record_header *header;
+static struct pmm_record *records;
+static uint8_t *kinds;
+static uint64_t *matches;       // for a free, the record of its allocation
+static phys_addr_t *replayed;   // for an allocation, the address it got in the replay
+static uint8_t *done;           // set once replayed holds it
+static uint64_t windowEnd[REPLAY_MAX_WINDOWS];
+static uint32_t windows = 10;
+static pthread_barrier_t barrier;
+static uint64_t sampleNs; // time spent sampling between windows
+
+static struct pmm_stats bootStats; // for the pool table
+static uint32_t bootFree;          // free blocks of every zone after the boot
+
+static const struct check_call checkCalls[] = {
+    {PMM_EVENT_ALLOC, 1, PMM_UNMOVABLE},
+    {PMM_EVENT_ALLOC, MAX_ALLOC_BLOCKS, PMM_MOVABLE},
+    {PMM_EVENT_ALLOC, MAX_ALLOC_BLOCKS / 2 + 1, PMM_RECLAIMABLE},
+    {PMM_EVENT_ALLOC, 0x10001, PMM_UNMOVABLE}, // more than 16 bits, fails on 32-bit builds
+    {PMM_EVENT_ALLOC_ZEROED, MAX_ALLOC_BLOCKS / 4, PMM_MOVABLE},
+    {PMM_EVENT_ALLOC_ZEROED, 3, PMM_RECLAIMABLE},
+    {PMM_EVENT_ALLOC_ZEROED, 1, PMM_UNMOVABLE, true},
+    {PMM_EVENT_ALLOC_FAIL, MAX_ALLOC_BLOCKS * 2, PMM_MOVABLE},
+};
+#define CHECK_CALLS (sizeof(checkCalls) / sizeof(checkCalls[0]))
+
+static bool load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    long bytes;
+    void *buffer;
+
+    if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (bytes = ftell(file)) < (long)sizeof(*header))
+    {
+        fprintf(stderr, "pmm_replay: can't read %s\n", path);
+        if (file != NULL)
+            fclose(file);
+        return false;
+    }
+    rewind(file);
+    buffer = malloc(bytes);
+    if (buffer == NULL || fread(buffer, 1, bytes, file) != (size_t)bytes)
+    {
+        fprintf(stderr, "pmm_replay: can't read %s\n", path);
+        fclose(file);
+        free(buffer);
+        return false;
+    }
+    fclose(file);
+
+    header = buffer;
+    records = (struct pmm_record *)(header + 1);
+    if (header->magic != PMM_RECORD_MAGIC || header->version != PMM_RECORD_VERSION ||
+        header->recordBytes != sizeof(struct pmm_record) || header->blockSize != BLOCK_SIZE ||
+        header->count > (bytes - sizeof(*header)) / sizeof(struct pmm_record) ||
+        header->mapCount > HOSTED_MAX_REGIONS || header->nodeRangeCount > PMM_MAX_NODE_RANGES)
+    {
+        fprintf(stderr, "pmm_replay: %s is not a recording of this build\n", path);
+        return false;
+    }
+    for (uint64_t i = 0; i < header->count; i++)
+        if (records[i].event >= PMM_EVENT_COUNT || records[i].cpu >= PMM_MAX_CPUS)
+        {
+            fprintf(stderr, "pmm_replay: record %llu of %s is corrupt\n", (unsigned long long)i, path);
+            return false;
+        }
+    return true;
+}
+
+// Boot the pmm the way the recorded one was
+static void boot(void)
+{
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    multiboot_info_t *mbt;
+
+    for (uint32_t i = 0; i < header->mapCount; i++)
+        regions[i] = (struct hosted_region){header->map[i].base, header->map[i].length, header->map[i].type};
+
+    mbt = hosted_prepare(regions, header->mapCount);
+    pmm_set_deferred_init(header->bootBlocks);
+    for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+        if (header->hugeReserve[order] != 0)
+            pmm_set_huge_reserve(order, header->hugeReserve[order]);
+    if (header->nodeRangeCount > 0)
+        init_pmm_numa(mbt, header->nodeRanges, header->nodeRangeCount);
+    else
+        init_pmm(mbt);
+    pmm_set_dma_reserve(header->dmaReserve);
+    pmm_get_stats(&bootStats);
+    bootFree = hosted_free_blocks() + hosted_free_dma_blocks();
+}
+
+/*
+    The -t check: record checkCalls, each freed again, on a freshly booted
+    pmm. The zero pool sizes outlive a boot, so the pools the check frees
+    into are set to none again for the replay.
+*/
+static bool checkRecord(void)
+{
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    uint32_t count = hosted_map_pc(regions, (uint64_t)CHECK_RAM_MB << 20);
+    size_t bytes = sizeof(*header) + 4 * CHECK_CALLS * sizeof(struct pmm_record);
+    phys_addr_t address;
+
+    header = malloc(bytes);
+    hosted_boot(regions, count);
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+        pmm_set_zero_pool(type, 1); // the pool is the one of the pageblock the page landed in
+    if (!pmm_record_start(header, bytes))
+    {
+        fprintf(stderr, "pmm_replay: -t needs a TRACE=1 build\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < CHECK_CALLS; i++)
+    {
+        if (checkCalls[i].event == PMM_EVENT_ALLOC_ZEROED)
+            address = pmm_alloc_zeroed_type(checkCalls[i].pages * BLOCK_SIZE, checkCalls[i].type);
+        else
+            address = pmm_alloc_type(checkCalls[i].pages * BLOCK_SIZE, checkCalls[i].type);
+        if (address != 0 && checkCalls[i].zeroedFree)
+            pmm_free_zeroed(address);
+        else if (address != 0)
+            pmm_free(address, 0);
+    }
+    pmm_record_stop();
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+        pmm_set_zero_pool(type, 0);
+    records = (struct pmm_record *)(header + 1);
+    return true;
+}
+
+static bool isAlloc(uint32_t event)
+{
+    return event == PMM_EVENT_ALLOC || event == PMM_EVENT_ALLOC_FAIL || event == PMM_EVENT_ALLOC_DMA ||
+           event == PMM_EVENT_ALLOC_NODE || event == PMM_EVENT_ALLOC_HUGE || event == PMM_EVENT_ALLOC_ZEROED;
+}
+
+/*
+    Sort the records into allocations, frees and skipped ones, and match
+    every free to an allocation of its page, through an open addressing
+    table of the allocations held. Records are in the order the calls
+    returned in, so a free that was preempted before writing its record
+    can come after another CPU took the page again: a page can have more
+    than one allocation held, and a free takes the last one that started
+    before it did. Freed entries are left as tombstones; there are at most
+    count allocations, so the table never fills up.
+*/
+static void match(uint64_t skipped[PMM_EVENT_COUNT], uint64_t *unmatched)
+{
+    uint64_t size = 16;
+    uint64_t *table;
+    const uint64_t empty = UINT64_MAX, tombstone = UINT64_MAX - 1;
+
+    while (size < 2 * header->count)
+        size <<= 1;
+    table = malloc(size * sizeof(*table));
+    memset(table, 0xFF, size * sizeof(*table));
+
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        struct pmm_record *record = &records[i];
+        uint64_t slot = ((uint64_t)record->page * 0x9E3779B97F4A7C15ull) >> 20;
+        uint64_t *hole = NULL, *before = NULL, *last = NULL;
+
+        kinds[i] = REPLAY_SKIP;
+        matches[i] = NO_MATCH;
+        for (; record->page != 0; slot++)
+        {
+            uint64_t *entry = &table[slot & (size - 1)];
+            if (*entry == empty || *entry == tombstone)
+            {
+                hole = (hole == NULL) ? entry : hole;
+                if (*entry == empty)
+                    break;
+            }
+            else if (records[*entry].page == record->page)
+            {
+                struct pmm_record *held = &records[*entry];
+                if (last == NULL || *entry > *last)
+                    last = entry;
+                if (held->timestamp <= record->timestamp && (before == NULL || *entry > *before))
+                    before = entry;
+            }
+        }
+
+        if (isAlloc(record->event))
+        {
+            kinds[i] = REPLAY_ALLOC;
+            if (record->page != 0)
+                *hole = i;
+        }
+        else if (record->event == PMM_EVENT_FREE || record->event == PMM_EVENT_FREE_DMA || record->event == PMM_EVENT_FREE_HUGE ||
+                 record->event == PMM_EVENT_FREE_ZEROED)
+        {
+            if (before == NULL)
+                before = last;
+            if (before == NULL)
+            {
+                (*unmatched)++;
+                continue;
+            }
+            kinds[i] = REPLAY_FREE;
+            matches[i] = *before;
+            *before = tombstone;
+        }
+        else
+            skipped[record->event]++;
+    }
+    free(table);
+}
+
+static void replayRecord(struct replay_cpu *cpu, uint64_t i)
+{
+    struct pmm_record *record = &records[i];
+    uint32_t pages = PMM_ALLOC_ARG_PAGES(record->arg), type = PMM_ALLOC_ARG_TYPE(record->arg);
+    phys_addr_t address = 0;
+    uint64_t start;
+
+    if (cpu->indices == NULL)
+        hosted_set_cpu(record->cpu);
+
+    if (kinds[i] == REPLAY_ALLOC)
+    {
+        start = bench_now_ns();
+        switch (record->event)
+        {
+        case PMM_EVENT_ALLOC_DMA:
+            address = pmm_alloc_dma(record->arg);
+            break;
+        case PMM_EVENT_ALLOC_NODE:
+            address = pmm_alloc_node(record->arg >> 8, record->arg & 0xFF);
+            break;
+        case PMM_EVENT_ALLOC_HUGE:
+            address = pmm_alloc_huge(record->arg);
+            break;
+        case PMM_EVENT_ALLOC_ZEROED:
+            address = pmm_alloc_zeroed_type(pages * BLOCK_SIZE, type);
+            break;
+        default:
+            address = pmm_alloc_type(pages * BLOCK_SIZE, type);
+            break;
+        }
+        bench_latency_add(&cpu->allocLat, bench_now_ns() - start);
+        if (address == 0)
+            cpu->failures++;
+
+        __atomic_store_n(&replayed[i], address, __ATOMIC_RELAXED);
+        __atomic_store_n(&done[i], 1, __ATOMIC_RELEASE);
+    }
+    else if (kinds[i] == REPLAY_FREE)
+    {
+        // the allocation may be another CPU's, which hasn't got there yet
+        while (!__atomic_load_n(&done[matches[i]], __ATOMIC_ACQUIRE))
+            sched_yield();
+        address = __atomic_load_n(&replayed[matches[i]], __ATOMIC_RELAXED);
+        if (address == 0)
+            return; // failed in the replay, nothing to free
+
+        start = bench_now_ns();
+        if (record->event == PMM_EVENT_FREE_DMA)
+            pmm_free_dma(address, record->arg);
+        else if (record->event == PMM_EVENT_FREE_HUGE)
+            pmm_free_huge(address, record->arg);
+        else if (record->event == PMM_EVENT_FREE_ZEROED)
+            pmm_free_zeroed(address);
+        else
+            pmm_free(address, 0);
+        bench_latency_add(&cpu->freeLat, bench_now_ns() - start);
+    }
+}
+
+// Free memory, largest free block and fragmentation at the end of a window
+static void sample(uint32_t window, uint64_t failures)
+{
+    uint64_t start = bench_now_ns();
+
+    printf("%-10s window %3u: record %10llu, %8.1f ms in, free %8llu MB, largest %6llu KB, failures %8llu, fragmentation %.3f\n",
+           "replay", window, (unsigned long long)windowEnd[window],
+           (windowEnd[window] > 0) ? records[windowEnd[window] - 1].timestamp / 1e6 : 0.0,
+           (unsigned long long)(((uint64_t)hosted_free_blocks() + hosted_free_dma_blocks()) * BLOCK_SIZE >> 20),
+           (unsigned long long)((uint64_t)hosted_largest_free() * BLOCK_SIZE >> 10), (unsigned long long)failures,
+           hosted_fragmentation());
+    sampleNs += bench_now_ns() - start;
+}
+
+static void *replayThread(void *arg)
+{
+    struct replay_cpu *cpu = arg;
+    uint64_t next = 0, failures;
+
+    if (cpu->indices != NULL)
+        hosted_set_cpu(cpu->cpu);
+    pthread_barrier_wait(&barrier);
+
+    for (uint32_t w = 0; w < windows; w++)
+    {
+        if (cpu->indices == NULL)
+            for (; next < windowEnd[w]; next++)
+                replayRecord(cpu, next);
+        else
+            for (; next < cpu->count && cpu->indices[next] < windowEnd[w]; next++)
+                replayRecord(cpu, cpu->indices[next]);
+
+        // the first CPU samples once every one is done with the window
+        if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        {
+            failures = 0;
+            for (uint64_t i = 0; i < windowEnd[w]; i++)
+                failures += (kinds[i] == REPLAY_ALLOC && replayed[i] == 0);
+            sample(w, failures);
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+// Latencies the recording measured, for the calls that are replayed
+static void recordedLatency(void)
+{
+    struct bench_latency allocLat, freeLat;
+
+    bench_latency_init(&allocLat, header->count);
+    bench_latency_init(&freeLat, header->count);
+    for (uint64_t i = 0; i < header->count; i++)
+        if (kinds[i] == REPLAY_ALLOC)
+            bench_latency_add(&allocLat, records[i].latency);
+        else if (kinds[i] == REPLAY_FREE)
+            bench_latency_add(&freeLat, records[i].latency);
+
+    bench_report("recorded", "alloc", &allocLat);
+    bench_report("recorded", "free", &freeLat);
+    bench_latency_free(&allocLat);
+    bench_latency_free(&freeLat);
+}
+
+// Index of the zone of an address in pmm_stats.zones, from the pool table
+static uint32_t zoneOf(phys_addr_t address)
+{
+    for (uint32_t i = 0; i < bootStats.poolCount && i < PMM_STATS_MAX_POOLS; i++)
+    {
+        struct pmm_pool_stats *pool = &bootStats.pools[i];
+        if (address >= pool->start + (phys_addr_t)pool->firstBlock * BLOCK_SIZE &&
+            address < pool->start + (phys_addr_t)pool->totalBlocks * BLOCK_SIZE)
+            return pool->zone;
+    }
+    return PMM_RECORD_NO_ZONE;
+}
+
+// Allocations that failed on one side only, the first few one by one, and allocations that landed in another zone
+static void compare(void)
+{
+    uint64_t onlyReplay = 0, onlyRecorded = 0, both = 0, zoneMoves = 0, listed = 0;
+
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        struct pmm_record *record = &records[i];
+        bool recordedFail = (record->page == 0), replayFail = (replayed[i] == 0);
+
+        if (kinds[i] != REPLAY_ALLOC)
+            continue;
+        if (recordedFail && replayFail)
+            both++;
+        else if (recordedFail)
+            onlyRecorded++;
+        else if (replayFail)
+            onlyReplay++;
+        else if (record->zone != PMM_RECORD_NO_ZONE && zoneOf(replayed[i]) != record->zone)
+            zoneMoves++;
+
+        if (replayFail && listed++ < REPLAY_FAIL_POINTS)
+            printf("%-10s failure at record %llu, %.1f ms in, cpu %u, event %u, arg %#x%s\n", "replay",
+                   (unsigned long long)i, record->timestamp / 1e6, record->cpu, record->event, record->arg,
+                   recordedFail ? ", failed in the recording too" : "");
+    }
+    printf("%-10s failures: %llu in both, %llu only in the replay, %llu only in the recording\n", "replay",
+           (unsigned long long)both, (unsigned long long)onlyReplay, (unsigned long long)onlyRecorded);
+    printf("%-10s allocations in another zone than recorded: %llu\n", "replay", (unsigned long long)zoneMoves);
+}
+
+/*
+    Whether the replay of the -t check matched what was asked: every
+    allocation decodes to the event, pages and type of its call and failed
+    in the replay where it failed in the recording, and all memory is free
+    again once the calling CPU's cache is drained.
+*/
+static bool checkReplay(void)
+{
+    uint32_t call = 0, wrong = 0, freeBlocks;
+
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        struct pmm_record *record = &records[i];
+        const struct check_call *want = &checkCalls[call];
+
+        if (!isAlloc(record->event))
+            continue;
+        if (call++ >= CHECK_CALLS || record->event != want->event || PMM_ALLOC_ARG_PAGES(record->arg) != want->pages ||
+            PMM_ALLOC_ARG_TYPE(record->arg) != want->type || (record->page == 0) != (replayed[i] == 0))
+        {
+            printf("%-10s check: record %llu, event %u, arg %#x, %s in the replay, expected event %u of %u pages of type %u\n",
+                   "replay", (unsigned long long)i, record->event, record->arg, replayed[i] ? "allocated" : "failed",
+                   want->event, want->pages, want->type);
+            wrong++;
+        }
+    }
+    pmm_pcp_drain();
+    freeBlocks = hosted_free_blocks() + hosted_free_dma_blocks();
+
+    printf("pmm_replay: check of %u calls, %u recorded, %u wrong, free blocks %u -> %u\n", (uint32_t)CHECK_CALLS, call,
+           wrong, bootFree, freeBlocks);
+    return call == CHECK_CALLS && wrong == 0 && freeBlocks == bootFree;
+}
+
+int main(int argc, char **argv)
+{
+    struct replay_cpu cpus[PMM_MAX_CPUS] = {0}, *active[PMM_MAX_CPUS];
+    pthread_t threads[PMM_MAX_CPUS];
+    uint64_t skipped[PMM_EVENT_COUNT] = {0}, unmatched = 0, allocs = 0, frees = 0, start, elapsed;
+    uint32_t activeCount = 0;
+    struct bench_latency allocLat, freeLat;
+    bool perCpu = false, check = false, passed = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cw:t")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            perCpu = true;
+            break;
+        case 't':
+            check = true;
+            break;
+        case 'w':
+            windows = strtoul(optarg, NULL, 0);
+            if (windows < 1 || windows > REPLAY_MAX_WINDOWS)
+                windows = 10;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - !check)
+    {
+        fprintf(stderr, "usage: %s [-c] [-w windows] file\n       %s -t\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (check ? !checkRecord() : !load(argv[optind]))
+        return 1;
+
+    kinds = malloc(header->count + 1);
+    matches = malloc((header->count + 1) * sizeof(*matches));
+    replayed = calloc(header->count + 1, sizeof(*replayed));
+    done = calloc(header->count + 1, 1);
+    match(skipped, &unmatched);
+
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        allocs += (kinds[i] == REPLAY_ALLOC);
+        frees += (kinds[i] == REPLAY_FREE);
+        cpus[records[i].cpu].count++;
+    }
+    for (uint32_t w = 0; w < windows; w++)
+        windowEnd[w] = header->count * (w + 1) / windows;
+
+    printf("pmm_replay: %s, %llu records (%llu dropped), %.1f ms, %u map entries, %u node ranges, %s\n", check ? "the -t check" : argv[optind],
+           (unsigned long long)header->count, (unsigned long long)header->dropped,
+           (header->count > 0) ? records[header->count - 1].timestamp / 1e6 : 0.0, header->mapCount,
+           header->nodeRangeCount, perCpu ? "per-CPU threads" : "one thread");
+    printf("%-10s replaying %llu allocations and %llu frees, skipping %llu frees of unrecorded blocks, %llu bulk calls, "
+           "%llu compactions\n", "replay", (unsigned long long)allocs,
+           (unsigned long long)frees, (unsigned long long)unmatched,
+           (unsigned long long)(skipped[PMM_EVENT_ALLOC_BULK] + skipped[PMM_EVENT_FREE_BULK]),
+           (unsigned long long)skipped[PMM_EVENT_COMPACT]);
+
+    // every CPU of the recording gets its thread, or one thread plays them all
+    if (perCpu)
+    {
+        for (uint32_t c = 0; c < PMM_MAX_CPUS; c++)
+            if (cpus[c].count > 0)
+            {
+                cpus[c].cpu = c;
+                cpus[c].indices = malloc(cpus[c].count * sizeof(uint64_t));
+                cpus[c].count = 0;
+                active[activeCount++] = &cpus[c];
+            }
+        for (uint64_t i = 0; i < header->count; i++)
+            cpus[records[i].cpu].indices[cpus[records[i].cpu].count++] = i;
+    }
+    else
+    {
+        cpus[0].count = header->count;
+        active[activeCount++] = &cpus[0];
+    }
+    if (activeCount == 0)
+        active[activeCount++] = &cpus[0];
+    for (uint32_t t = 0; t < activeCount; t++)
+    {
+        bench_latency_init(&active[t]->allocLat, active[t]->count + 1);
+        bench_latency_init(&active[t]->freeLat, active[t]->count + 1);
+    }
+
+    boot();
+    bench_report_header();
+
+    pthread_barrier_init(&barrier, NULL, activeCount);
+    start = bench_now_ns();
+    for (uint32_t t = 1; t < activeCount; t++)
+        pthread_create(&threads[t], NULL, replayThread, active[t]);
+    replayThread(active[0]);
+    for (uint32_t t = 1; t < activeCount; t++)
+        pthread_join(threads[t], NULL);
+    elapsed = bench_now_ns() - start - sampleNs;
+    pthread_barrier_destroy(&barrier);
+
+    bench_latency_init(&allocLat, allocs + 1);
+    bench_latency_init(&freeLat, frees + 1);
+    for (uint32_t t = 0; t < activeCount; t++)
+    {
+        for (uint64_t i = 0; i < active[t]->allocLat.count; i++)
+            bench_latency_add(&allocLat, active[t]->allocLat.samples[i]);
+        for (uint64_t i = 0; i < active[t]->freeLat.count; i++)
+            bench_latency_add(&freeLat, active[t]->freeLat.samples[i]);
+        bench_latency_free(&active[t]->allocLat);
+        bench_latency_free(&active[t]->freeLat);
+        free(active[t]->indices);
+    }
+
+    recordedLatency();
+    bench_report("replay", "alloc", &allocLat);
+    bench_report("replay", "free", &freeLat);
+    printf("%-10s %llu calls in %.1f ms, %.0f calls/sec\n", "replay", (unsigned long long)(allocLat.count + freeLat.count),
+           elapsed / 1e6, elapsed ? (allocLat.count + freeLat.count) * 1e9 / elapsed : 0.0);
+    compare();
+    if (check)
+        passed = checkReplay();
+
+    bench_latency_free(&allocLat);
+    bench_latency_free(&freeLat);
+    free(kinds);
+    free(matches);
+    free(replayed);
+    free(done);
+    free(header);
+    return !passed;
+}
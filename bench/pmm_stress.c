@@ -0,0 +1,440 @@
+/*
+    Concurrency stress for the hosted build, meant to run under
+    ThreadSanitizer (make tsan). Every thread runs on its own CPU id and
+    mixes cached and uncached allocation sizes with small cache
+    watermarks, so refills, drains and pool locking all race with each
+    other. At the end every object has to be back in its slabs and every
+    block back in the zone.
+
+    Allocations: now and then a thread takes and releases a batch with
+    pmm_alloc_bulk, a block of the DMA zone or a block of a given node.
+    Memory is split between STRESS_NODES nodes and the threads use the
+    local, interleave and bind policies in turn. Now and then a thread
+    takes a 2 MB block with pmm_alloc_huge, racing the others for the few
+    in the huge page reserve.
+
+    Deferred init: only the first chunk of each pool is built at boot.
+    The first CPU builds the rest halfway through, as an idle loop would.
+
+    Corruption: each allocated page gets a tag written into it that is
+    checked before the page is freed, which catches a block handed out
+    twice. Movable blocks are held through the fake migrate client of the
+    hosted build instead, which checks them on every move, and now and
+    then a thread compacts everything while the others keep going.
+
+    Frees: half of the held blocks are freed without their size. Now and
+    then a thread frees a page in the middle of a block it holds, which
+    the pmm has to drop and count in badFrees. Built with PMM_CHECK_FREE
+    (make checked), every free is checked too.
+
+    Stats and traces: threads take pmm_get_stats snapshots and read the
+    trace ring of another CPU.
+
+    Slabs: the threads share a few slab caches and tag every object they
+    take. They hand objects to each other through a mailbox, so objects
+    are freed on another CPU than the one that took them.
+
+    Zero pools: threads take pages of the zero pool, which any of them
+    refills with pmm_zero_idle. They check that the pages read as zero
+    and give part of them back with pmm_free_zeroed.
+
+    Warm restart: a quarter of the way in the threads stop while the
+    first one saves the state of the pmm and restarts it on that image.
+    They hold on to everything they have across the restart.
+
+    usage: pmm_stress [-t threads] [-n ops]
+*/
+
+#include "bench.h"
+#include "hosted.h"
+#include <lumos/percpu.h>
+#include <lumos/pmm.h>
+#include <lumos/slab.h>
+#include <lumos/state.h>
+#include <lumos/trace.h>
+#include <lumos/zero.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define STRESS_MAX_HELD 32
+#define STRESS_BULK 16 // blocks in a bulk batch
+#define STRESS_NODES 2
+#define STRESS_TRACE_READ 64 // records read from a trace ring at a time
+#define STRESS_MAX_MOVABLE 16
+#define STRESS_MAX_ORDER 3    // largest order of the mixed traffic, 32 KB
+#define STRESS_HUGE_RESERVE 2 // 2 MB blocks set aside for pmm_alloc_huge, fewer than the threads that race for them
+#define STRESS_CACHES 3       // slab caches the threads share, of the sizes in cacheSizes
+#define STRESS_MAX_OBJECTS 64 // objects a thread holds at most
+#define STRESS_ZERO_POOL 64   // pages kept zeroed
+
+static const uint32_t cacheSizes[STRESS_CACHES] = {24, 200, 1500};
+static struct kmem_cache *caches[STRESS_CACHES];
+static void *mailbox[STRESS_CACHES]; // an object of each cache on its way to another thread
+static uint64_t badFrees;            // frees of pages in the middle of a block, made on purpose
+static uint64_t restartBadFrees;     // bad frees the pmm had counted before the restart, which starts the counters over
+
+struct stressThread
+{
+    uint32_t cpu;
+    uint64_t ops;
+    uint64_t errors;
+    pthread_barrier_t *barrier;
+};
+
+static void tagBlocks(phys_addr_t address, uint32_t size, uint64_t tag)
+{
+    for (uint32_t offset = 0; offset < size; offset += BLOCK_SIZE)
+        *(volatile uint64_t *)HOSTED_PHYS_TO_VIRT(address + offset) = tag;
+}
+
+static uint64_t checkBlocks(phys_addr_t address, uint32_t size, uint64_t tag)
+{
+    uint64_t errors = 0;
+    for (uint32_t offset = 0; offset < size; offset += BLOCK_SIZE)
+        if (*(volatile uint64_t *)HOSTED_PHYS_TO_VIRT(address + offset) != tag)
+            errors++;
+    return errors;
+}
+
+// The tag goes in the first and last word of an object, which is what neighbours would overwrite
+static void tagObject(void *object, uint32_t size, uint64_t tag)
+{
+    ((volatile uint64_t *)object)[0] = tag;
+    ((volatile uint64_t *)object)[size / 8 - 1] = tag;
+}
+
+static uint64_t checkObject(void *object, uint32_t size)
+{
+    return ((volatile uint64_t *)object)[0] != ((volatile uint64_t *)object)[size / 8 - 1];
+}
+
+// small watermarks, so the caches refill and drain all the time
+static void tuneCaches(void)
+{
+    for (uint32_t blocks = 1; blocks <= PCP_MAX_BLOCKS; blocks *= 2)
+        pmm_pcp_tune(blocks, 2, 8, 4);
+}
+
+/*
+    Save the state of the pmm into a buffer outside the arena and adopt it
+    there, with every other thread waiting. What the restart starts over,
+    the node of each CPU, the cache watermarks and the counters, is set up
+    again; the policies are set again by each thread.
+*/
+static bool restart(struct pmm_stats *stats)
+{
+    size_t bytes = pmm_state_size();
+    void *image = aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+
+    pmm_get_stats(stats);
+    restartBadFrees = stats->badFrees;
+    if (image == NULL || !pmm_save_state(image, bytes) || !pmm_adopt_state(image, bytes, PMM_ADOPT_VERIFY))
+        return false;
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        pmm_set_cpu_node(cpu, cpu % STRESS_NODES);
+    tuneCaches();
+    return true;
+}
+
+static void *stressWorker(void *arg)
+{
+    struct stressThread *t = arg;
+    phys_addr_t held[STRESS_MAX_HELD];
+    uint32_t sizes[STRESS_MAX_HELD];
+    uint64_t tags[STRESS_MAX_HELD];
+    uint32_t movable[STRESS_MAX_MOVABLE], movableOrders[STRESS_MAX_MOVABLE], movableCount = 0;
+    phys_addr_t batch[STRESS_BULK];
+    void *objects[STRESS_MAX_OBJECTS];
+    uint32_t objectCaches[STRESS_MAX_OBJECTS], objectCount = 0;
+    struct kmem_cache_stats cacheStats;
+    struct pmm_trace_record records[STRESS_TRACE_READ];
+    struct pmm_stats *stats = malloc(sizeof(*stats));
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (t->cpu + 1), cursor = 0;
+    uint32_t count = 0;
+
+    static const uint32_t policies[] = {PMM_POLICY_LOCAL, PMM_POLICY_INTERLEAVE, PMM_POLICY_BIND};
+
+    hosted_set_cpu(t->cpu);
+    pmm_set_policy(policies[t->cpu % 3], t->cpu % STRESS_NODES);
+    pthread_barrier_wait(t->barrier);
+
+    for (uint64_t i = 0; i < t->ops; i++)
+    {
+        if (t->cpu == 0 && i == t->ops / 2)
+            while (pmm_init_deferred(PMM_INIT_CHUNK))
+                ;
+        if (i == t->ops / 4)
+        {
+            pthread_barrier_wait(t->barrier);
+            if (t->cpu == 0)
+                t->errors += !restart(stats);
+            pthread_barrier_wait(t->barrier);
+            pmm_set_policy(policies[t->cpu % 3], t->cpu % STRESS_NODES);
+        }
+
+        if (bench_rand(&rng) % 256 == 0)
+        {
+            pmm_get_stats(stats);
+            pmm_trace_read((t->cpu + 1) % PMM_MAX_CPUS, &cursor, records, STRESS_TRACE_READ);
+            kmem_cache_get_stats(caches[i % STRESS_CACHES], &cacheStats);
+        }
+        else if (bench_rand(&rng) % 4 == 0)
+        {
+            uint32_t c = bench_rand(&rng) % STRESS_CACHES;
+            uint32_t j = bench_rand(&rng) % (objectCount + 1);
+
+            if (objectCount < STRESS_MAX_OBJECTS && (objectCount == 0 || bench_rand(&rng) % 2))
+            {
+                void *object = kmem_cache_alloc(caches[c]);
+                if (object == NULL)
+                    continue;
+                tagObject(object, cacheSizes[c], ((uint64_t)t->cpu << 48) | i);
+                objects[objectCount] = object;
+                objectCaches[objectCount++] = c;
+            }
+            else if (j < objectCount)
+            {
+                // swap an object for the one in the mailbox of its cache, and free what came out
+                void *object = __atomic_exchange_n(&mailbox[objectCaches[j]], objects[j], __ATOMIC_ACQ_REL);
+                c = objectCaches[j];
+                objectCount--;
+                objects[j] = objects[objectCount];
+                objectCaches[j] = objectCaches[objectCount];
+                if (object == NULL)
+                    continue;
+                t->errors += checkObject(object, cacheSizes[c]);
+                kmem_cache_free(caches[c], object);
+            }
+        }
+        else if (bench_rand(&rng) % 32 == 0)
+        {
+            phys_addr_t p;
+            uint64_t *page;
+
+            if (bench_rand(&rng) % 4 == 0)
+            {
+                pmm_zero_idle(PMM_ZERO_BATCH);
+                continue;
+            }
+            if ((p = pmm_alloc_zeroed(BLOCK_SIZE)) == 0)
+                continue;
+            page = HOSTED_PHYS_TO_VIRT(p);
+            for (uint32_t w = 0; w < BLOCK_SIZE / sizeof(*page); w++)
+                t->errors += page[w] != 0;
+            if (bench_rand(&rng) % 2)
+                pmm_free_zeroed(p);
+            else
+            {
+                tagBlocks(p, BLOCK_SIZE, i);
+                pmm_free(p, BLOCK_SIZE);
+            }
+        }
+        else if (bench_rand(&rng) % 2048 == 0)
+            pmm_compact();
+        else if (bench_rand(&rng) % 512 == 0)
+        {
+            phys_addr_t p = pmm_alloc_huge(PMM_PAGEBLOCK_ORDER);
+            if (p == 0)
+                continue;
+            if (p % ORDER_TO_SIZE_IN_BYTES(PMM_PAGEBLOCK_ORDER) != 0)
+                t->errors++;
+            tagBlocks(p, ORDER_TO_SIZE_IN_BYTES(PMM_PAGEBLOCK_ORDER), i);
+            t->errors += checkBlocks(p, ORDER_TO_SIZE_IN_BYTES(PMM_PAGEBLOCK_ORDER), i);
+            pmm_free_huge(p, PMM_PAGEBLOCK_ORDER);
+        }
+        else if (bench_rand(&rng) % 8 == 0)
+        {
+            if (movableCount < STRESS_MAX_MOVABLE && (movableCount == 0 || bench_rand(&rng) % 2))
+            {
+                uint32_t order = bench_rand(&rng) % (STRESS_MAX_ORDER + 1);
+                phys_addr_t p = pmm_alloc_type(ORDER_TO_SIZE_IN_BYTES(order), PMM_MOVABLE);
+                if (p == 0)
+                    continue;
+                movableOrders[movableCount] = order;
+                movable[movableCount++] = hosted_movable_add(p, order);
+            }
+            else
+            {
+                uint32_t j = bench_rand(&rng) % movableCount;
+                pmm_free(hosted_movable_remove(movable[j]), ORDER_TO_SIZE_IN_BYTES(movableOrders[j]));
+                movableCount--;
+                movable[j] = movable[movableCount];
+                movableOrders[j] = movableOrders[movableCount];
+            }
+        }
+        else if (bench_rand(&rng) % 8 == 0)
+        {
+            uint32_t order = bench_rand(&rng) % (STRESS_MAX_ORDER + 1);
+            uint32_t got = pmm_alloc_bulk(order, STRESS_BULK, batch);
+            uint64_t tag = ((uint64_t)t->cpu << 48) | i;
+            for (uint32_t j = 0; j < got; j++)
+                tagBlocks(batch[j], ORDER_TO_SIZE_IN_BYTES(order), tag);
+            for (uint32_t j = 0; j < got; j++)
+                t->errors += checkBlocks(batch[j], ORDER_TO_SIZE_IN_BYTES(order), tag);
+            pmm_free_bulk(order, batch, got);
+        }
+        else if (bench_rand(&rng) % 8 == 0)
+        {
+            uint32_t order = bench_rand(&rng) % (STRESS_MAX_ORDER + 1);
+            phys_addr_t p = pmm_alloc_dma(order);
+            if (p == 0)
+                continue;
+            tagBlocks(p, ORDER_TO_SIZE_IN_BYTES(order), i);
+            t->errors += checkBlocks(p, ORDER_TO_SIZE_IN_BYTES(order), i);
+            pmm_free_dma(p, order);
+        }
+        else if (bench_rand(&rng) % 8 == 0)
+        {
+            uint32_t order = bench_rand(&rng) % (STRESS_MAX_ORDER + 1);
+            phys_addr_t p = pmm_alloc_node(bench_rand(&rng) % STRESS_NODES, order);
+            if (p == 0)
+                continue;
+            tagBlocks(p, ORDER_TO_SIZE_IN_BYTES(order), i);
+            t->errors += checkBlocks(p, ORDER_TO_SIZE_IN_BYTES(order), i);
+            pmm_free(p, ORDER_TO_SIZE_IN_BYTES(order));
+        }
+        else if (count < STRESS_MAX_HELD && (count == 0 || bench_rand(&rng) % 2))
+        {
+            uint32_t size = (1 + bench_rand(&rng) % (1u << STRESS_MAX_ORDER)) * BLOCK_SIZE;
+            phys_addr_t p = pmm_alloc(size);
+            if (p == 0)
+                continue;
+            held[count] = p;
+            sizes[count] = size;
+            tags[count] = ((uint64_t)t->cpu << 48) | i;
+            tagBlocks(held[count], size, tags[count]);
+            count++;
+        }
+        else
+        {
+            uint32_t j = bench_rand(&rng) % count;
+            t->errors += checkBlocks(held[j], sizes[j], tags[j]);
+            if (sizes[j] > BLOCK_SIZE && bench_rand(&rng) % 64 == 0)
+            {
+                pmm_free(held[j] + BLOCK_SIZE, 0);
+                __atomic_fetch_add(&badFrees, 1, __ATOMIC_RELAXED);
+            }
+            pmm_free(held[j], (bench_rand(&rng) % 2) ? sizes[j] : 0);
+            count--;
+            held[j] = held[count];
+            sizes[j] = sizes[count];
+            tags[j] = tags[count];
+        }
+    }
+
+    for (uint32_t j = 0; j < count; j++)
+    {
+        t->errors += checkBlocks(held[j], sizes[j], tags[j]);
+        pmm_free(held[j], sizes[j]);
+    }
+    for (uint32_t j = 0; j < movableCount; j++)
+        pmm_free(hosted_movable_remove(movable[j]), ORDER_TO_SIZE_IN_BYTES(movableOrders[j]));
+    for (uint32_t j = 0; j < objectCount; j++)
+    {
+        t->errors += checkObject(objects[j], cacheSizes[objectCaches[j]]);
+        kmem_cache_free(caches[objectCaches[j]], objects[j]);
+    }
+    pmm_pcp_drain();
+    free(stats);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t threadCount = 8;
+    uint64_t ops = 100000, errors = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threadCount = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-n ops]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threadCount == 0 || threadCount > PMM_MAX_CPUS)
+        threadCount = PMM_MAX_CPUS;
+
+    struct hosted_region regions[HOSTED_MAX_REGIONS];
+    struct pmm_node_range ranges[STRESS_NODES];
+    uint32_t regionCount = hosted_map_pc(regions, 64ull << 20);
+    uint32_t rangeCount = hosted_numa_ranges(regions, regionCount, STRESS_NODES, ranges);
+    pmm_set_deferred_init(1); // one chunk per pool
+    pmm_set_huge_reserve(PMM_PAGEBLOCK_ORDER, STRESS_HUGE_RESERVE);
+    hosted_boot_numa(regions, regionCount, ranges, rangeCount);
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        pmm_set_cpu_node(cpu, cpu % STRESS_NODES);
+    pmm_set_migrate(hosted_migrate);
+
+    tuneCaches();
+
+    uint32_t initialFree = hosted_free_blocks(), initialDMA = hosted_free_dma_blocks();
+    pmm_set_reclaim(kmem_reclaim);
+    pmm_set_zero_pool(PMM_UNMOVABLE, STRESS_ZERO_POOL);
+    for (uint32_t c = 0; c < STRESS_CACHES; c++)
+        caches[c] = kmem_cache_create("stress", cacheSizes[c], 0, c == 0 ? SLAB_RECLAIMABLE : 0);
+    pthread_t threads[PMM_MAX_CPUS];
+    struct stressThread workers[PMM_MAX_CPUS];
+    pthread_barrier_t barrier;
+
+    pthread_barrier_init(&barrier, NULL, threadCount);
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        workers[i] = (struct stressThread){i, ops, 0, &barrier};
+        pthread_create(&threads[i], NULL, stressWorker, &workers[i]);
+    }
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        pthread_join(threads[i], NULL);
+        errors += workers[i].errors;
+    }
+    pthread_barrier_destroy(&barrier);
+    errors += hosted_movable_errors();
+
+    // every object is back, so every cache can go and take its slabs with it
+    for (uint32_t c = 0; c < STRESS_CACHES; c++)
+    {
+        if (mailbox[c] != NULL)
+        {
+            errors += checkObject(mailbox[c], cacheSizes[c]);
+            kmem_cache_free(caches[c], mailbox[c]);
+        }
+        if (!kmem_cache_destroy(caches[c]))
+            errors++;
+    }
+    kmem_reclaim(0);
+    pmm_set_zero_pool(PMM_UNMOVABLE, 0);
+    pmm_pcp_drain();
+
+    // the stats of the threads that have exited still count
+    struct pmm_stats *stats = malloc(sizeof(*stats));
+    pmm_get_stats(stats);
+    if (stats->badFrees + restartBadFrees != badFrees)
+    {
+        printf("pmm_stress: %llu bad frees counted, %llu made\n", (unsigned long long)(stats->badFrees + restartBadFrees),
+               (unsigned long long)badFrees);
+        errors++;
+    }
+    free(stats);
+
+    printf("pmm_stress: %u threads, %llu ops each, %llu corrupted blocks, %llu blocks migrated, free blocks %u -> %u, DMA %u -> %u\n",
+           threadCount, (unsigned long long)ops, (unsigned long long)errors, (unsigned long long)hosted_movable_moves(), initialFree,
+           hosted_free_blocks(), initialDMA, hosted_free_dma_blocks());
+    if (errors != 0 || hosted_free_blocks() != initialFree || hosted_free_dma_blocks() != initialDMA)
+    {
+        printf("pmm_stress: FAILED\n");
+        return 1;
+    }
+    printf("pmm_stress: ok\n");
+    return 0;
+}
@@ -0,0 +1,427 @@
+/*
+    Word at a time bitmap search and range kernels. See bitmap.h.
+*/
+
+#include <lumos/bitmap.h>
+#include <string.h>
+
+#if !defined(PMM_BITMAP_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#define BITMAP_SKIP_WORDS 8 // 32-bit words covered by one compare
+#elif !defined(PMM_BITMAP_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define BITMAP_SKIP_WORDS 4
+#else
+#define BITMAP_SKIP_WORDS 0
+#endif
+
+static void setBits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd);
+static void unsetBits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd);
+
+// Two consecutive 32-bit words as one 64-bit word, bit order preserved
+static inline uint64_t loadWord64(const uint32_t *map, uint32_t word)
+{
+    return (uint64_t)map[word] | ((uint64_t)map[word + 1] << 32);
+}
+
+// The word64-th 64 bits of a map of mapWords words, a missing upper half reads as reserved
+static inline uint64_t mapWord64(const uint32_t *map, uint32_t mapWords, uint32_t word64)
+{
+    if (word64 * 2 + 1 < mapWords)
+        return loadWord64(map, word64 * 2);
+    return (uint64_t)map[word64 * 2] | 0xFFFFFFFF00000000ull;
+}
+
+/*
+    Return the first word at or after word whose SIMD sized group isn't fully
+    reserved. Words past the last full group are left to the caller.
+*/
+static inline uint32_t skipReserved(const uint32_t *map, uint32_t word, uint32_t maxWords)
+{
+#if BITMAP_SKIP_WORDS == 8
+    const __m256i ones = _mm256_set1_epi32(-1);
+    for (; word + 8 <= maxWords; word += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + word));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, ones)) != 0xFFFFFFFF)
+            break;
+    }
+#elif BITMAP_SKIP_WORDS == 4
+    const __m128i ones = _mm_set1_epi32(-1);
+    for (; word + 4 <= maxWords; word += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(map + word));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, ones)) != 0xFFFF)
+            break;
+    }
+#else
+    (void)map;
+    (void)maxWords;
+#endif
+    return word;
+}
+
+/* -------------------- SUMMARY ----------------------- */
+
+uint32_t summaryWords(uint32_t mapWords)
+{
+    uint32_t bits = (mapWords + 1) / 2, total = 0;
+    for (uint32_t l = 0; l < SUMMARY_MAX_LEVELS && bits > 0; l++)
+    {
+        bits = (bits + 63) / 64;
+        total += bits;
+        if (bits == 1)
+            break;
+    }
+    return total;
+}
+
+void summaryInit(struct bitmap_summary *summary, uint64_t *storage, uint32_t *map, uint32_t mapWords)
+{
+    uint32_t bits = (mapWords + 1) / 2;
+
+    summary->mapWords = mapWords;
+    summary->levels = 0;
+    while (summary->levels < SUMMARY_MAX_LEVELS && bits > 0)
+    {
+        bits = (bits + 63) / 64;
+        summary->level[summary->levels] = storage;
+        summary->levelWords[summary->levels] = bits;
+        memset(storage, 0, bits * sizeof(uint64_t));
+        storage += bits;
+        summary->levels++;
+        if (bits == 1)
+            break;
+    }
+
+    if (map == NULL)
+        return;
+
+    for (uint32_t i = 0; i < (mapWords + 1) / 2; i++)
+        if (~mapWord64(map, mapWords, i))
+            summary->level[0][i / 64] |= 1ull << (i % 64);
+
+    for (uint32_t l = 1; l < summary->levels; l++)
+        for (uint32_t i = 0; i < summary->levelWords[l - 1]; i++)
+            if (summary->level[l - 1][i])
+                summary->level[l][i / 64] |= 1ull << (i % 64);
+}
+
+// Clear the bit of 64 map bits, and the bits above it that are left with nothing under them
+static void summaryClear(struct bitmap_summary *summary, uint32_t word64)
+{
+    for (uint32_t l = 0; l < summary->levels; l++)
+    {
+        uint64_t *word = &summary->level[l][word64 / 64];
+        *word &= ~(1ull << (word64 % 64));
+        if (*word != 0)
+            return;
+        word64 /= 64;
+    }
+}
+
+void summaryMarkFull(struct bitmap_summary *summary, uint32_t *map, uint32_t word64)
+{
+    if (~mapWord64(map, summary->mapWords, word64))
+        return;
+    summaryClear(summary, word64);
+}
+
+void summaryMarkFree(struct bitmap_summary *summary, uint32_t word64)
+{
+    for (uint32_t l = 0; l < summary->levels; l++)
+    {
+        uint64_t *word = &summary->level[l][word64 / 64];
+        uint64_t bit = 1ull << (word64 % 64);
+        bool wasEmpty = (*word == 0);
+        if (*word & bit)
+            return;
+        *word |= bit;
+        if (!wasEmpty)
+            return;
+        word64 /= 64;
+    }
+}
+
+/*
+    Several summaries can share a map, each covering its own part of it.
+    Hand 64 map bits over from one to the other, if they have an unset bit.
+*/
+void summaryMove(struct bitmap_summary *from, struct bitmap_summary *to, uint32_t word64)
+{
+    if (!(from->level[0][word64 / 64] & (1ull << (word64 % 64))))
+        return;
+    summaryClear(from, word64);
+    summaryMarkFree(to, word64);
+}
+
+// Recompute the summary over the 64-bit map words [first, last]
+static void summaryRefresh(struct bitmap_summary *summary, uint32_t *map, uint32_t first, uint32_t last)
+{
+    for (uint32_t i = first; i <= last; i++)
+    {
+        if (~mapWord64(map, summary->mapWords, i))
+            summary->level[0][i / 64] |= 1ull << (i % 64);
+        else
+            summary->level[0][i / 64] &= ~(1ull << (i % 64));
+    }
+
+    for (uint32_t l = 1; l < summary->levels; l++)
+    {
+        first /= 64;
+        last /= 64;
+        for (uint32_t i = first; i <= last; i++)
+        {
+            if (summary->level[l - 1][i])
+                summary->level[l][i / 64] |= 1ull << (i % 64);
+            else
+                summary->level[l][i / 64] &= ~(1ull << (i % 64));
+        }
+    }
+}
+
+/*
+    Index of the first 64-bit map word at or after word64 that has an unset
+    bit, or -1. Climbs until a set summary bit at or after the position is
+    found, then descends taking the lowest set bit at every level.
+*/
+static intmax_t summaryNext(struct bitmap_summary *summary, uint32_t word64)
+{
+    uint64_t pos = word64, bits = 0;
+    uint32_t l = 0;
+
+    for (;;)
+    {
+        if (l >= summary->levels || pos / 64 >= summary->levelWords[l])
+            return -1;
+
+        bits = summary->level[l][pos / 64] & (~0ull << (pos % 64));
+        if (bits)
+            break;
+
+        // the top level may have more than one word when SUMMARY_MAX_LEVELS is hit
+        if (l == summary->levels - 1)
+        {
+            for (pos = pos / 64 + 1; pos < summary->levelWords[l]; pos++)
+                if (summary->level[l][pos])
+                    break;
+            if (pos == summary->levelWords[l])
+                return -1;
+            bits = summary->level[l][pos];
+            pos *= 64;
+            break;
+        }
+
+        pos = pos / 64 + 1;
+        l++;
+    }
+
+    pos = (pos & ~63ull) + __builtin_ctzll(bits);
+    while (l-- > 0)
+        pos = pos * 64 + __builtin_ctzll(summary->level[l][pos]);
+    return pos;
+}
+
+/* -------------------- KERNELS ----------------------- */
+
+void set_bits(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t offsetStart, uint32_t offsetEnd)
+{
+    if (offsetStart > offsetEnd)
+        return;
+
+    setBits(mapStart, offsetStart, offsetEnd);
+    if (summary != NULL)
+        summaryRefresh(summary, mapStart, offsetStart / 64, offsetEnd / 64);
+}
+
+void unset_bits(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t offsetStart, uint32_t offsetEnd)
+{
+    if (offsetStart > offsetEnd)
+        return;
+
+    unsetBits(mapStart, offsetStart, offsetEnd);
+    if (summary != NULL)
+        summaryRefresh(summary, mapStart, offsetStart / 64, offsetEnd / 64);
+}
+
+static void setBits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd)
+{
+
+    uint32_t first = offsetStart / 32, last = offsetEnd / 32;
+    uint32_t startMask = 0xFFFFFFFFu << (offsetStart % 32);
+    uint32_t endMask = 0xFFFFFFFFu >> (31 - offsetEnd % 32);
+
+    if (first == last)
+    {
+        mapStart[first] |= startMask & endMask;
+        return;
+    }
+    mapStart[first] |= startMask;
+    memset(mapStart + first + 1, 0xFF, (last - first - 1) * 4);
+    mapStart[last] |= endMask;
+}
+
+static void unsetBits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd)
+{
+
+    uint32_t first = offsetStart / 32, last = offsetEnd / 32;
+    uint32_t startMask = 0xFFFFFFFFu << (offsetStart % 32);
+    uint32_t endMask = 0xFFFFFFFFu >> (31 - offsetEnd % 32);
+
+    if (first == last)
+    {
+        mapStart[first] &= ~(startMask & endMask);
+        return;
+    }
+    mapStart[first] &= ~startMask;
+    memset(mapStart + first + 1, 0, (last - first - 1) * 4);
+    mapStart[last] &= ~endMask;
+}
+
+intmax_t findFirstFreeBit(uint32_t *map, struct bitmap_summary *summary, uint32_t maxWords)
+{
+    uint32_t word = 0;
+    uint64_t free;
+    intmax_t word64;
+
+    if (summary != NULL)
+    {
+        word64 = summaryNext(summary, 0);
+        if (word64 < 0)
+            return -1;
+        return word64 * 64 + __builtin_ctzll(~mapWord64(map, summary->mapWords, word64));
+    }
+
+    while (word + 2 <= maxWords)
+    {
+        word = skipReserved(map, word, maxWords);
+        if (word + 2 > maxWords)
+            break;
+        free = ~loadWord64(map, word);
+        if (free != 0)
+            return (intmax_t)word * 32 + __builtin_ctzll(free);
+        word += 2;
+    }
+
+    if (word < maxWords && map[word] != 0xFFFFFFFF)
+        return (intmax_t)word * 32 + __builtin_ctz(~map[word]);
+    return -1;
+}
+
+// findFirstFreeBit for the bits from an offset on, for searches that skip part of the map
+intmax_t findFreeBitFrom(uint32_t *map, struct bitmap_summary *summary, uint32_t maxWords, uint32_t from)
+{
+    uint64_t free;
+    intmax_t word64;
+
+    if (summary != NULL)
+    {
+        for (word64 = summaryNext(summary, from / 64); word64 >= 0; word64 = summaryNext(summary, word64 + 1))
+        {
+            free = ~mapWord64(map, summary->mapWords, word64);
+            if ((uint64_t)word64 == from / 64)
+                free &= ~0ull << (from % 64);
+            if (free != 0)
+                return word64 * 64 + __builtin_ctzll(free);
+        }
+        return -1;
+    }
+
+    for (uint32_t word = from / 32; word < maxWords; word++)
+    {
+        uint32_t freeBits = ~map[word] & ((word == from / 32) ? ~0u << (from % 32) : ~0u);
+        if (freeBits != 0)
+            return (intmax_t)word * 32 + __builtin_ctz(freeBits);
+    }
+    return -1;
+}
+
+/*
+    First fit search for length unset bits. Fully available 64-bit words
+    extend the current run in one step, fully reserved stretches are skipped
+    through the summary or by skipReserved, and mixed words are walked run by
+    run with ctz.
+*/
+intmax_t findFreeRun(uint32_t *map, struct bitmap_summary *summary, uint32_t maxBits, uint32_t length)
+{
+    uint32_t maxWords = (maxBits + 31) / 32;
+    uint32_t word = 0, pos, count;
+    uint64_t run = 0, runStart = 0;
+    uint64_t free, validBits;
+
+    if (length == 0 || length > maxBits)
+        return -1;
+
+    while (word < maxWords)
+    {
+        // group of two words, or the last odd word
+        validBits = (word + 2 <= maxWords) ? 64 : 32;
+        free = (validBits == 64) ? ~loadWord64(map, word) : (uint64_t)(uint32_t)~map[word];
+        if ((uint64_t)word * 32 + validBits > maxBits)
+            validBits = maxBits - word * 32;
+        if (validBits < 64)
+            free &= (1ull << validBits) - 1;
+
+        if (free == 0)
+        {
+            run = 0;
+            word += (uint32_t)((validBits + 31) / 32);
+            if (word >= maxWords)
+                break; // a summary would send an odd last word back to the 64-bit word free bits past maxBits keep marked
+            if (summary != NULL)
+            {
+                intmax_t next = summaryNext(summary, word / 2);
+                word = (next < 0) ? maxWords : (uint32_t)next * 2;
+            }
+            else
+                word = skipReserved(map, word, maxWords);
+            continue;
+        }
+
+        if (validBits == 64 && free == ~0ull)
+        {
+            if (run == 0)
+                runStart = (uint64_t)word * 32;
+            run += 64;
+            if (run >= length)
+                return runStart;
+            word += 2;
+            continue;
+        }
+
+        // mixed word - walk alternating runs of reserved and available bits
+        pos = 0;
+        while (pos < validBits)
+        {
+            if (!((free >> pos) & 1))
+            {
+                run = 0;
+                pos += (free >> pos) ? __builtin_ctzll(free >> pos) : 64 - pos;
+                continue;
+            }
+
+            count = (~free >> pos) ? __builtin_ctzll(~free >> pos) : 64 - pos;
+            if (count > validBits - pos)
+                count = validBits - pos;
+            if (run == 0)
+                runStart = (uint64_t)word * 32 + pos;
+            run += count;
+            if (run >= length)
+                return runStart;
+            pos += count;
+        }
+        word += (uint32_t)((validBits + 31) / 32);
+    }
+    return -1;
+}
+
+const char *bitmapKernelName(void)
+{
+#if BITMAP_SKIP_WORDS == 8
+    return "avx2";
+#elif BITMAP_SKIP_WORDS == 4
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
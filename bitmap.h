@@ -0,0 +1,75 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+/*
+    Bitmap kernels used by the pmm. Bit n of a map is bit (n % 32) of word
+    (n / 32); a set bit is reserved and an unset bit is available. Searches
+    work on 64 bits at a time with __builtin_ctz, and skip fully reserved
+    stretches 128 (SSE2) or 256 (AVX2) bits at a time when the compiler 
+    targets those instruction sets. Define PMM_BITMAP_SCALAR to force the
+    portable path.
+
+    A map can optionally carry a summary: a small tree of 64-bit words where
+    each bit of level 0 is set if the corresponding 64 bits of the map have
+    at least one unset bit, and each bit of level n + 1 is set if the
+    corresponding word of level n is non zero. The mutators keep it up to
+    date when given one, and the searches descend through it instead of 
+    scanning the map. Pass NULL for a plain map.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SUMMARY_MAX_LEVELS 4 // enough for 2^36 bits
+
+struct bitmap_summary
+{
+    uint64_t *level[SUMMARY_MAX_LEVELS];     // level[0] has one bit per 64 bits of the map
+    uint32_t levelWords[SUMMARY_MAX_LEVELS]; // number of 64-bit words in each level
+    uint32_t mapWords;                       // number of 32-bit words in the summarized map
+    uint8_t levels;
+};
+
+void summaryMarkFull(struct bitmap_summary *summary, uint32_t *map, uint32_t word64); // 64 map bits may have become fully reserved
+void summaryMarkFree(struct bitmap_summary *summary, uint32_t word64);                // 64 map bits have at least one unset bit
+void summaryMove(struct bitmap_summary *from, struct bitmap_summary *to, uint32_t word64); // 64 map bits now belong to another summary of the same map
+
+static inline void set_bit(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t offset)
+{
+    mapStart[offset / 32] |= 1u << (offset % 32);
+    if (summary != NULL && mapStart[offset / 32] == 0xFFFFFFFF)
+        summaryMarkFull(summary, mapStart, offset / 64);
+}
+
+static inline void unset_bit(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t offset)
+{
+    mapStart[offset / 32] &= ~(1u << (offset % 32));
+    if (summary != NULL)
+        summaryMarkFree(summary, offset / 64);
+}
+
+// set the bits of mask in one word of the map
+static inline void set_mask(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t word, uint32_t mask)
+{
+    mapStart[word] |= mask;
+    if (summary != NULL && mapStart[word] == 0xFFFFFFFF)
+        summaryMarkFull(summary, mapStart, word / 2);
+}
+
+static inline bool test_bit(uint32_t *mapStart, uint32_t offset)
+{
+    return (mapStart[offset / 32] >> (offset % 32)) & 1;
+}
+
+void set_bits(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t offsetStart, uint32_t offsetEnd);   // set a section of bits, inclusive
+void unset_bits(uint32_t *mapStart, struct bitmap_summary *summary, uint32_t offsetStart, uint32_t offsetEnd); // unset a section of bits, inclusive
+intmax_t findFirstFreeBit(uint32_t *map, struct bitmap_summary *summary, uint32_t maxWords);                   // return the offset of the first unset bit. -1 if no such bit
+intmax_t findFreeBitFrom(uint32_t *map, struct bitmap_summary *summary, uint32_t maxWords, uint32_t from);    // return the offset of the first unset bit at or after from. -1 if no such bit
+intmax_t findFreeRun(uint32_t *map, struct bitmap_summary *summary, uint32_t maxBits, uint32_t length);        // offset of the first run of length unset bits below maxBits. -1 if none
+const char *bitmapKernelName(void);                                                                           // which search kernel was compiled in
+
+uint32_t summaryWords(uint32_t mapWords);                                                          // 64-bit words of storage a summary of the map needs
+void summaryInit(struct bitmap_summary *summary, uint64_t *storage, uint32_t *map, uint32_t mapWords); // lay out a summary in storage and build it from the map, or empty if map is NULL
+
+#endif
@@ -0,0 +1,331 @@
+#ifndef BUDDY_ARENA_HPP
+#define BUDDY_ARENA_HPP
+
+/*
+    The buddy allocator of the pmm as a header-only C++17 template, for
+    arenas in user space: BuddyArena<BlockSize, MaxOrder, Policy> manages a
+    region the caller hands it, or one it maps itself, in blocks of
+    BlockSize bytes, and serves requests of up to 2^MaxOrder blocks. Like
+    the pmm, every order has a bitmap where a set bit means the block is
+    not free at that order, and a doubly linked free list. The free lists
+    are threaded through the free blocks themselves, so the only metadata
+    is the bitmaps, about two bits per block, carved from the front of the
+    region. The order math and the bitmap sizes are constexpr.
+
+    It can be used on its own through alloc and free, which take the size
+    like pmm_free does, or as a std::pmr::memory_resource for the pmr
+    containers. Policy is the lock around the free lists: NullLock for an
+    arena owned by one thread, SpinLock or std::mutex to share one.
+
+    Blocks are aligned to their size relative to the start of the blocks,
+    which is aligned to the page, or to max_bytes if that is less, so a
+    block is aligned to its size up to there. A memory_resource request
+    for more alignment than that gives std::bad_alloc.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <sys/mman.h>
+
+namespace lumos
+{
+
+// Lock policies for BuddyArena
+struct NullLock
+{
+    void lock() noexcept {}
+    void unlock() noexcept {}
+};
+
+class SpinLock
+{
+  public:
+    void lock() noexcept
+    {
+        while (flag.test_and_set(std::memory_order_acquire))
+            ;
+    }
+    void unlock() noexcept { flag.clear(std::memory_order_release); }
+
+  private:
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+
+template <std::size_t BlockSize, unsigned MaxOrder, class Policy = NullLock>
+class BuddyArena : public std::pmr::memory_resource
+{
+    static_assert(BlockSize >= 2 * sizeof(std::uint32_t) && (BlockSize & (BlockSize - 1)) == 0,
+                  "BlockSize must be a power of two that holds a free list link");
+    static_assert(MaxOrder < 32, "block indexes are 32-bit");
+
+  public:
+    static constexpr std::size_t block_size = BlockSize;
+    static constexpr unsigned max_order = MaxOrder;
+    static constexpr std::size_t max_bytes = BlockSize << MaxOrder; // largest request that can be served
+    static constexpr std::size_t base_align = (max_bytes < 4096) ? max_bytes : 4096; // of the first block
+
+    // Smallest order whose blocks hold bytes, MaxOrder + 1 if there is none
+    static constexpr unsigned order_for(std::size_t bytes) noexcept
+    {
+        unsigned order = 0;
+        while (order <= MaxOrder && (BlockSize << order) < bytes)
+            order++;
+        return order;
+    }
+
+    // Bytes of bitmaps for an arena of blocks blocks, every order starting on a 64-bit word
+    static constexpr std::size_t metadata_bytes(std::size_t blocks) noexcept
+    {
+        std::size_t bytes = 0;
+        for (unsigned order = 0; order <= MaxOrder; order++)
+            bytes += mapWords(blocks >> order) * sizeof(std::uint64_t);
+        return bytes;
+    }
+
+    // Manage bytes of memory at region, which must outlive the arena
+    BuddyArena(void *region, std::size_t bytes) noexcept
+    {
+        init(static_cast<unsigned char *>(region), bytes);
+    }
+
+    // Manage bytes of anonymous memory mapped for the arena. Throws std::bad_alloc if the mapping fails
+    explicit BuddyArena(std::size_t bytes)
+    {
+        void *region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+            throw std::bad_alloc();
+        mapping = region;
+        mappingBytes = bytes;
+        init(static_cast<unsigned char *>(region), bytes);
+    }
+
+    ~BuddyArena()
+    {
+        if (mapping != nullptr)
+            munmap(mapping, mappingBytes);
+    }
+
+    BuddyArena(const BuddyArena &) = delete;
+    BuddyArena &operator=(const BuddyArena &) = delete;
+
+    /*
+        Allocate a block of at least bytes bytes, rounded up to the
+        smallest order that holds it. The lowest order with a free block is
+        found from a mask of the non-empty orders and split down to size.
+        Returns nullptr if there is no large enough free block.
+    */
+    void *alloc(std::size_t bytes) noexcept
+    {
+        unsigned order = order_for(bytes), level;
+        std::uint32_t block;
+
+        if (order > MaxOrder)
+            return nullptr;
+
+        lock.lock();
+        std::uint64_t candidates = nonEmpty >> order;
+        if (candidates == 0)
+        {
+            lock.unlock();
+            return nullptr;
+        }
+        level = order + __builtin_ctzll(candidates);
+        block = levels[level].freeListHead;
+        removeFreeBlock(level, block);
+
+        // hand out the lower half at every split, the upper one goes on the free list of the order below
+        while (level > order)
+        {
+            level--;
+            block <<= 1;
+            pushFreeBlock(level, block + 1);
+        }
+        freeBlocks -= std::uint32_t(1) << order;
+        lock.unlock();
+        return blockAddress(order, block);
+    }
+
+    // Release a block of alloc, bytes being the size it was asked for, merging it with its buddies
+    void free(void *address, std::size_t bytes) noexcept
+    {
+        unsigned order = order_for(bytes);
+        std::uint32_t block, buddyBlock;
+
+        if (address == nullptr || order > MaxOrder)
+            return;
+        block = static_cast<std::uint32_t>((static_cast<unsigned char *>(address) - blocks) / BlockSize) >> order;
+
+        lock.lock();
+        freeBlocks += std::uint32_t(1) << order;
+        while (order < MaxOrder)
+        {
+            buddyBlock = block ^ 1;
+            if (buddyBlock >= levels[order].maxFreeBlocks || testBit(order, buddyBlock))
+                break;
+            removeFreeBlock(order, buddyBlock);
+            block >>= 1;
+            order++;
+        }
+        pushFreeBlock(order, block);
+        lock.unlock();
+    }
+
+    std::size_t total_bytes() const noexcept { return std::size_t(totalBlocks) * BlockSize; }
+    std::size_t free_bytes() const noexcept { return std::size_t(freeBlocks) * BlockSize; } // without locking, a snapshot
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *address = alloc(requestBytes(bytes, alignment));
+        if (address == nullptr)
+            throw std::bad_alloc();
+        if (reinterpret_cast<std::uintptr_t>(address) % alignment != 0)
+        {
+            free(address, requestBytes(bytes, alignment));
+            throw std::bad_alloc();
+        }
+        return address;
+    }
+
+    void do_deallocate(void *address, std::size_t bytes, std::size_t alignment) override
+    {
+        free(address, requestBytes(bytes, alignment));
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+  private:
+    static constexpr std::uint32_t NO_FREE_BLOCK = 0xFFFFFFFF; // end of a free list
+
+    // The link of a free block, kept in its first bytes
+    struct FreeLink
+    {
+        std::uint32_t prev;
+        std::uint32_t next;
+    };
+
+    struct Level
+    {
+        std::uint64_t *bitMap;
+        std::uint32_t freeListHead;
+        std::uint32_t maxFreeBlocks; // blocks of this order that fit in the arena
+    };
+
+    static constexpr std::size_t mapWords(std::size_t bits) noexcept
+    {
+        return (bits + 63) / 64;
+    }
+
+    // A block aligned to more than BlockSize is taken as one of that size
+    static constexpr std::size_t requestBytes(std::size_t bytes, std::size_t alignment) noexcept
+    {
+        return (alignment > BlockSize && alignment > bytes) ? alignment : bytes;
+    }
+
+    /*
+        Lay out the bitmaps at the start of the region and release the
+        blocks after them as the largest aligned buddies that fit, the way
+        freeRange does in the pmm.
+    */
+    void init(unsigned char *region, std::size_t bytes) noexcept
+    {
+        std::uintptr_t start = reinterpret_cast<std::uintptr_t>(region);
+        std::uintptr_t end = start + bytes;
+        std::uintptr_t first;
+        std::size_t count = bytes / BlockSize;
+        std::uint64_t *map = reinterpret_cast<std::uint64_t *>((start + 7) & ~std::uintptr_t(7));
+
+        // the bitmaps of as many blocks as the region holds are an upper bound for the ones of what is left
+        first = (reinterpret_cast<std::uintptr_t>(map) + metadata_bytes(count) + base_align - 1) & ~std::uintptr_t(base_align - 1);
+        count = (first < end) ? (end - first) / BlockSize : 0;
+        if (count > NO_FREE_BLOCK - 1)
+            count = NO_FREE_BLOCK - 1;
+
+        blocks = reinterpret_cast<unsigned char *>(first);
+        totalBlocks = static_cast<std::uint32_t>(count);
+        freeBlocks = totalBlocks;
+        for (unsigned order = 0; order <= MaxOrder; order++)
+        {
+            levels[order].bitMap = map;
+            levels[order].freeListHead = NO_FREE_BLOCK;
+            levels[order].maxFreeBlocks = totalBlocks >> order;
+            std::memset(map, 0xFF, mapWords(levels[order].maxFreeBlocks) * sizeof(std::uint64_t)); // nothing is free yet
+            map += mapWords(levels[order].maxFreeBlocks);
+        }
+
+        for (std::uint32_t block = 0; block < totalBlocks;)
+        {
+            unsigned order = 0;
+            while (order < MaxOrder && block % (std::uint32_t(2) << order) == 0 && block + (std::uint32_t(2) << order) <= totalBlocks)
+                order++;
+            pushFreeBlock(order, block >> order);
+            block += std::uint32_t(1) << order;
+        }
+    }
+
+    unsigned char *blockAddress(unsigned order, std::uint32_t block) const noexcept
+    {
+        return blocks + ((std::size_t(block) << order) * BlockSize);
+    }
+
+    FreeLink *linkOf(unsigned order, std::uint32_t block) const noexcept
+    {
+        return reinterpret_cast<FreeLink *>(blockAddress(order, block));
+    }
+
+    bool testBit(unsigned order, std::uint32_t block) const noexcept
+    {
+        return (levels[order].bitMap[block / 64] >> (block % 64)) & 1;
+    }
+
+    // Free list operations, which keep the bitmaps and the mask of non-empty orders with them
+    void pushFreeBlock(unsigned order, std::uint32_t block) noexcept
+    {
+        Level &level = levels[order];
+        FreeLink *link = linkOf(order, block);
+
+        link->prev = NO_FREE_BLOCK;
+        link->next = level.freeListHead;
+        if (level.freeListHead != NO_FREE_BLOCK)
+            linkOf(order, level.freeListHead)->prev = block;
+        level.freeListHead = block;
+        level.bitMap[block / 64] &= ~(std::uint64_t(1) << (block % 64));
+        nonEmpty |= std::uint64_t(1) << order;
+    }
+
+    void removeFreeBlock(unsigned order, std::uint32_t block) noexcept
+    {
+        Level &level = levels[order];
+        FreeLink *link = linkOf(order, block);
+
+        if (link->prev != NO_FREE_BLOCK)
+            linkOf(order, link->prev)->next = link->next;
+        else
+            level.freeListHead = link->next;
+        if (link->next != NO_FREE_BLOCK)
+            linkOf(order, link->next)->prev = link->prev;
+        level.bitMap[block / 64] |= std::uint64_t(1) << (block % 64);
+        if (level.freeListHead == NO_FREE_BLOCK)
+            nonEmpty &= ~(std::uint64_t(1) << order);
+    }
+
+    Level levels[MaxOrder + 1]; // by order
+    std::uint64_t nonEmpty = 0; // bit per order with a free block
+    unsigned char *blocks = nullptr;
+    std::uint32_t totalBlocks = 0;
+    std::uint32_t freeBlocks = 0;
+    Policy lock;
+    void *mapping = nullptr; // the region when the arena mapped it
+    std::size_t mappingBytes = 0;
+};
+
+} // namespace lumos
+
+#endif
@@ -0,0 +1,424 @@
+/*
+    Hosted environment for running the pmm as an ordinary Linux process.
+    See hosted.h for the address space layout.
+*/
+
+#include "hosted.h"
+#include <lumos/pmm.h>
+#include <lumos/percpu.h>
+#include <lumos/state.h>
+#include <lumos/trace.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOVABLE_BUCKETS 65536 // hash buckets of the fake migrate client, a power of two
+#define MOVABLE_NONE 0xFFFFFFFF
+#define MOVABLE_PATTERN(slot, word) ((((uint64_t)(slot) << 32) | (word)) * 0x9E3779B97F4A7C15ull)
+
+bool hosted_verbose = false;
+
+extern struct zone *zone_DMA;
+extern struct pmm_node pmm_nodes[PMM_MAX_NODES];
+
+static void *arena = NULL;
+static uint64_t arenaSize = 0;
+static __thread uint32_t hostedCpu = 0;
+
+// file mapping of the state adopted by hosted_restore_state, NULL if none
+static void *stateImage = NULL;
+static size_t stateBytes = 0;
+
+// blocks of the fake migrate client, hashed by address, with a free list of slots
+struct movable
+{
+    phys_addr_t address; // 0 while the slot is free
+    uint32_t order;
+    uint32_t next; // next slot of the bucket, or of the free list
+};
+
+static pthread_mutex_t movableLock = PTHREAD_MUTEX_INITIALIZER;
+static struct movable *movables = NULL;
+static uint32_t movableCount = 0, movableFree = MOVABLE_NONE;
+static uint32_t movableBuckets[MOVABLE_BUCKETS];
+static uint64_t movableMoves = 0, movableErrors = 0;
+
+uint32_t pmm_cpu_id(void)
+{
+    return hostedCpu;
+}
+
+void hosted_set_cpu(uint32_t cpu)
+{
+    hostedCpu = cpu % PMM_MAX_CPUS;
+}
+
+uint64_t pmm_trace_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void logf(const char *format, ...)
+{
+    va_list args;
+
+    if (!hosted_verbose)
+        return;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+uint32_t hosted_map_pc(struct hosted_region *regions, uint64_t ramBytes)
+{
+    regions[0] = (struct hosted_region){0x0, 0x9FC00, 1};         // conventional memory
+    regions[1] = (struct hosted_region){0x9FC00, 0x400, 2};       // EBDA
+    regions[2] = (struct hosted_region){0xF0000, 0x10000, 2};     // BIOS ROM
+    if (ramBytes <= HOSTED_PCI_HOLE)
+    {
+        regions[3] = (struct hosted_region){0x100000, ramBytes - 0x100000, 1};
+        return 4;
+    }
+
+    // memory that would overlap the PCI hole is remapped above 4 GB
+    regions[3] = (struct hosted_region){0x100000, HOSTED_PCI_HOLE - 0x100000, 1};
+    regions[4] = (struct hosted_region){HOSTED_PCI_HOLE, 0x100000000ull - HOSTED_PCI_HOLE, 2};
+    regions[5] = (struct hosted_region){0x100000000ull, ramBytes - HOSTED_PCI_HOLE, 1};
+    return 6;
+}
+
+/*
+    Map a fresh arena covering every region of the memory map and write the
+    multiboot info and memory map into the fake kernel image. Can be called
+    repeatedly to start over with a new map.
+*/
+multiboot_info_t *hosted_prepare(const struct hosted_region *regions, uint32_t count)
+{
+    uint64_t top = HOSTED_KERNEL_START + HOSTED_KERNEL_SIZE;
+    for (uint32_t i = 0; i < count; i++)
+        if (regions[i].base + regions[i].length > top)
+            top = regions[i].base + regions[i].length;
+
+    if (arena != NULL)
+        munmap(arena, arenaSize);
+    if (stateImage != NULL)
+        munmap(stateImage, stateBytes);
+    stateImage = NULL;
+
+    arenaSize = top;
+    arena = mmap((void *)HOSTED_KERNEL_OFFSET, arenaSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (arena != (void *)HOSTED_KERNEL_OFFSET)
+    {
+        perror("[hosted] : mmap arena");
+        abort();
+    }
+
+    // multiboot info at the start of the kernel image, memory map right after it
+    multiboot_info_t *mbt = HOSTED_PHYS_TO_VIRT(HOSTED_KERNEL_START);
+    struct mmap_entry_t *entry = (struct mmap_entry_t *)(mbt + 1);
+    memset(mbt, 0, sizeof(*mbt));
+    mbt->flags = MBT_FLAG_IS_MMAP;
+    mbt->mmap_addr = HOSTED_KERNEL_START + sizeof(*mbt);
+    mbt->mmap_length = count * sizeof(struct mmap_entry_t);
+
+    for (uint32_t i = 0; i < count; i++, entry++)
+    {
+        entry->size = sizeof(struct mmap_entry_t) - sizeof(entry->size);
+        entry->base_low = (uint32_t)regions[i].base;
+        entry->base_high = (uint32_t)(regions[i].base >> 32);
+        entry->length_low = (uint32_t)regions[i].length;
+        entry->length_high = (uint32_t)(regions[i].length >> 32);
+        entry->type = regions[i].type;
+    }
+
+    zone_DMA = NULL;
+    return mbt;
+}
+
+void hosted_boot(const struct hosted_region *regions, uint32_t count)
+{
+    init_pmm(hosted_prepare(regions, count));
+}
+
+// Save the state of the pmm into a file, through a buffer outside the arena
+bool hosted_save_state(const char *path)
+{
+    size_t bytes = pmm_state_size();
+    void *image = aligned_alloc(64, (bytes + 63) & ~(size_t)63);
+    bool saved = false;
+    FILE *file;
+
+    if (image == NULL)
+        return false;
+    if (pmm_save_state(image, bytes) && (file = fopen(path, "wb")) != NULL)
+    {
+        saved = fwrite(image, 1, bytes, file) == bytes;
+        saved &= fclose(file) == 0;
+    }
+    free(image);
+    return saved;
+}
+
+/*
+    Start the pmm on the state saved in a file instead of init_pmm, after
+    hosted_prepare. The file is mapped privately and adopted where it lies,
+    so only the pages the pmm touches are read. The arena is a new one, so
+    the allocations of the saved state are still allocated but what they
+    held is gone; adopting an image in the arena keeps that too.
+*/
+bool hosted_restore_state(const char *path, uint32_t flags)
+{
+    struct stat info;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return false;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    stateBytes = info.st_size;
+    stateImage = mmap(NULL, stateBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (stateImage == MAP_FAILED)
+    {
+        stateImage = NULL;
+        return false;
+    }
+    return pmm_adopt_state(stateImage, stateBytes, flags);
+}
+
+/*
+    Cut the address space of a map into nodes ranges holding the same amount
+    of RAM each, on boundaries of the largest block. The last range runs to
+    the end of the map. Returns the number of ranges.
+*/
+uint32_t hosted_numa_ranges(const struct hosted_region *regions, uint32_t count, uint32_t nodes, struct pmm_node_range *ranges)
+{
+    uint64_t ram = 0, seen = 0, top = 0, cut, base = 0;
+    uint32_t node = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (regions[i].type == 1)
+            ram += regions[i].length;
+        if (regions[i].base + regions[i].length > top)
+            top = regions[i].base + regions[i].length;
+    }
+
+    for (uint32_t i = 0; i < count && node + 1 < nodes; i++)
+    {
+        if (regions[i].type != 1)
+            continue;
+        // every node boundary that falls inside this region
+        while (node + 1 < nodes && seen + regions[i].length > ram / nodes * (node + 1))
+        {
+            cut = regions[i].base + (ram / nodes * (node + 1) - seen);
+            cut &= ~((uint64_t)PMM_PAGEBLOCK_BLOCKS * BLOCK_SIZE - 1);
+            ranges[node] = (struct pmm_node_range){base, cut - base, node};
+            base = cut;
+            node++;
+        }
+        seen += regions[i].length;
+    }
+    ranges[node] = (struct pmm_node_range){base, top - base, node};
+    return node + 1;
+}
+
+void hosted_boot_numa(const struct hosted_region *regions, uint32_t count, const struct pmm_node_range *ranges, uint32_t rangeCount)
+{
+    init_pmm_numa(hosted_prepare(regions, count), ranges, rangeCount);
+}
+
+uint32_t hosted_node_free_blocks(uint32_t node)
+{
+    return COUNTER_READ(pmm_nodes[node].normal->freeBlocks) + COUNTER_READ(pmm_nodes[node].high->freeBlocks);
+}
+
+uint32_t hosted_free_blocks(void)
+{
+    uint32_t freeBlocks = 0;
+
+    if (zone_DMA == NULL)
+        return 0;
+    for (uint32_t node = 0; node < pmm_node_count(); node++)
+        freeBlocks += hosted_node_free_blocks(node);
+    return freeBlocks;
+}
+
+uint32_t hosted_free_dma_blocks(void)
+{
+    return COUNTER_READ(zone_DMA->freeBlocks);
+}
+
+uint32_t hosted_largest_free(void)
+{
+    uint32_t largest = 0;
+
+    for (uint32_t i = 0; i < 2 * pmm_node_count(); i++)
+        for (struct pool *p = (i % 2 ? pmm_nodes[i / 2].high : pmm_nodes[i / 2].normal)->poolStart; p != NULL; p = p->nextPool)
+            for (struct buddy *b = p->poolBuddiesTop; b != NULL; b = b->nextBuddy)
+                if (b->freeListHead != NO_FREE_BLOCK)
+                {
+                    if (b->size > largest)
+                        largest = b->size;
+                    break;
+                }
+    return largest;
+}
+
+double hosted_fragmentation(void)
+{
+    uint32_t freeBlocks = hosted_free_blocks();
+    uint32_t largeFree = 0;
+    if (freeBlocks == 0)
+        return 0.0;
+
+    for (uint32_t i = 0; i < 2 * pmm_node_count(); i++)
+        for (struct pool *p = (i % 2 ? pmm_nodes[i / 2].high : pmm_nodes[i / 2].normal)->poolStart; p != NULL; p = p->nextPool)
+            for (struct buddy *b = p->poolBuddiesTop; b != NULL && b->order >= HOSTED_FRAGMENTATION_ORDER; b = b->nextBuddy)
+                largeFree += b->freeBlocks * b->size;
+    return 1.0 - (double)largeFree / freeBlocks;
+}
+
+static uint32_t movableBucket(phys_addr_t address)
+{
+    return (uint32_t)((address / BLOCK_SIZE) * 0x9E3779B97F4A7C15ull >> 48) & (MOVABLE_BUCKETS - 1);
+}
+
+// Slot of a tracked block, MOVABLE_NONE if there is none at address. movableLock held
+static uint32_t movableFind(phys_addr_t address)
+{
+    uint32_t slot;
+
+    for (slot = movableBuckets[movableBucket(address)]; slot != MOVABLE_NONE; slot = movables[slot].next)
+        if (movables[slot].address == address)
+            break;
+    return slot;
+}
+
+static void movableLink(uint32_t slot)
+{
+    uint32_t *bucket = &movableBuckets[movableBucket(movables[slot].address)];
+
+    movables[slot].next = *bucket;
+    *bucket = slot;
+}
+
+static void movableUnlink(uint32_t slot)
+{
+    uint32_t *link = &movableBuckets[movableBucket(movables[slot].address)];
+
+    while (*link != slot)
+        link = &movables[*link].next;
+    *link = movables[slot].next;
+}
+
+// Count the words of a block that don't hold the pattern of slot. movableLock held
+static uint64_t movableCheck(phys_addr_t address, uint32_t order, uint32_t slot)
+{
+    uint64_t *words = HOSTED_PHYS_TO_VIRT(address), errors = 0;
+
+    for (uint32_t i = 0; i < (BLOCK_SIZE << order) / sizeof(uint64_t); i++)
+        if (words[i] != MOVABLE_PATTERN(slot, i))
+            errors++;
+    return errors;
+}
+
+uint32_t hosted_movable_add(phys_addr_t address, uint32_t order)
+{
+    uint64_t *words = HOSTED_PHYS_TO_VIRT(address);
+    uint32_t slot;
+
+    pthread_mutex_lock(&movableLock);
+    if (movables == NULL)
+        memset(movableBuckets, 0xFF, sizeof(movableBuckets));
+    if (movableFree != MOVABLE_NONE)
+    {
+        slot = movableFree;
+        movableFree = movables[slot].next;
+    }
+    else
+    {
+        if ((movableCount & (movableCount - 1)) == 0)
+            movables = realloc(movables, (movableCount ? 2 * movableCount : 64) * sizeof(*movables));
+        slot = movableCount++;
+    }
+
+    movables[slot] = (struct movable){address, order, MOVABLE_NONE};
+    movableLink(slot);
+    for (uint32_t i = 0; i < (BLOCK_SIZE << order) / sizeof(uint64_t); i++)
+        words[i] = MOVABLE_PATTERN(slot, i);
+    pthread_mutex_unlock(&movableLock);
+    return slot;
+}
+
+phys_addr_t hosted_movable_remove(uint32_t slot)
+{
+    phys_addr_t address;
+
+    pthread_mutex_lock(&movableLock);
+    address = movables[slot].address;
+    movableErrors += movableCheck(address, movables[slot].order, slot) != 0;
+    movableUnlink(slot);
+    movables[slot].address = 0;
+    movables[slot].next = movableFree;
+    movableFree = slot;
+    pthread_mutex_unlock(&movableLock);
+    return address;
+}
+
+bool hosted_migrate(phys_addr_t from, phys_addr_t to, uint32_t order)
+{
+    uint32_t slot;
+
+    pthread_mutex_lock(&movableLock);
+    slot = (movables != NULL) ? movableFind(from) : MOVABLE_NONE;
+    if (slot == MOVABLE_NONE || movables[slot].order != order)
+    {
+        pthread_mutex_unlock(&movableLock);
+        return false;
+    }
+
+    movableErrors += movableCheck(from, order, slot) != 0;
+    memcpy(HOSTED_PHYS_TO_VIRT(to), HOSTED_PHYS_TO_VIRT(from), BLOCK_SIZE << order);
+    memset(HOSTED_PHYS_TO_VIRT(from), 0xA5, BLOCK_SIZE << order); // a stale reference to the old block shows up as an error
+    movableErrors += movableCheck(to, order, slot) != 0;
+
+    movableUnlink(slot);
+    movables[slot].address = to;
+    movableLink(slot);
+    movableMoves++;
+    pthread_mutex_unlock(&movableLock);
+    return true;
+}
+
+uint64_t hosted_movable_moves(void)
+{
+    pthread_mutex_lock(&movableLock);
+    uint64_t moves = movableMoves;
+    pthread_mutex_unlock(&movableLock);
+    return moves;
+}
+
+uint64_t hosted_movable_errors(void)
+{
+    pthread_mutex_lock(&movableLock);
+    uint64_t errors = movableErrors;
+    pthread_mutex_unlock(&movableLock);
+    return errors;
+}
@@ -0,0 +1,76 @@
+#ifndef HOSTED_H
+#define HOSTED_H
+
+/*
+    Hosted (Linux userspace) environment for the pmm. The "physical" address
+    space is an mmap'd arena mapped at HOSTED_KERNEL_OFFSET, exactly the way
+    LumOS maps physical memory above VIRTUAL_KERNEL_OFFSET. The linker symbols
+    _kernel_start, _kernel_end and VIRTUAL_KERNEL_OFFSET_LD are defined by the
+    Makefile from the same constants, so the pmm places its structures inside
+    the arena right after a fake kernel image.
+*/
+
+#include <lumos/multiboot.h>
+#include <lumos/pmm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef HOSTED_KERNEL_OFFSET
+#define HOSTED_KERNEL_OFFSET 0x200000000000 // virtual address of physical address 0
+#endif
+#ifndef HOSTED_KERNEL_START
+#define HOSTED_KERNEL_START 0x100000 // physical address of the fake kernel image (1 MB, like LumOS)
+#endif
+#ifndef HOSTED_KERNEL_SIZE
+#define HOSTED_KERNEL_SIZE 0x10000 // 64 KB fake kernel image, holds the multiboot info and memory map
+#endif
+
+#define HOSTED_MAX_REGIONS 32
+#define HOSTED_PCI_HOLE 0xC0000000 // hosted_map_pc reserves 3 GB - 4 GB like a PC chipset
+#define HOSTED_FRAGMENTATION_ORDER 3 // hosted_fragmentation counts free blocks of 32 KB or more as unfragmented
+
+// A single entry of a synthetic memory map. type 1 is available RAM.
+struct hosted_region
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+};
+
+// Convert a physical address handed out by the pmm into a usable pointer
+#define HOSTED_PHYS_TO_VIRT(phys) ((void *)((uintptr_t)(phys) + HOSTED_KERNEL_OFFSET))
+
+uint32_t hosted_map_pc(struct hosted_region *regions, uint64_t ramBytes); // PC-like map with a low memory hole; returns entry count
+multiboot_info_t *hosted_prepare(const struct hosted_region *regions, uint32_t count); // (re)map the arena and write the multiboot info
+void hosted_boot(const struct hosted_region *regions, uint32_t count);    // hosted_prepare, then init_pmm on the given map
+uint32_t hosted_numa_ranges(const struct hosted_region *regions, uint32_t count, uint32_t nodes,
+                            struct pmm_node_range *ranges); // SRAT-like table splitting the RAM of a map evenly between nodes by address
+void hosted_boot_numa(const struct hosted_region *regions, uint32_t count, const struct pmm_node_range *ranges, uint32_t rangeCount);
+bool hosted_save_state(const char *path); // pmm_save_state into a file
+bool hosted_restore_state(const char *path, uint32_t flags); // after hosted_prepare: pmm_adopt_state on the file, mapped. Page contents don't survive
+void hosted_set_cpu(uint32_t cpu);                                        // CPU id pmm_cpu_id reports for the calling thread
+
+// Introspection helpers used by the benchmarks
+uint32_t hosted_free_blocks(void);    // free blocks in the NORMAL and HIGH zones of every node
+uint32_t hosted_node_free_blocks(uint32_t node); // free blocks in the NORMAL and HIGH zones of a node
+uint32_t hosted_free_dma_blocks(void); // free blocks in the DMA zone
+uint32_t hosted_largest_free(void);   // largest free block in the NORMAL and HIGH zones of every node, in blocks
+double hosted_fragmentation(void);    // share of the free NORMAL and HIGH blocks not in blocks of HOSTED_FRAGMENTATION_ORDER or more
+
+/*
+    Fake migrate client for compaction. A block handed to 
+    hosted_movable_add gets a slot and is filled with a pattern of that 
+    slot. hosted_migrate, the pmm_migrate_t to register, moves the blocks it
+    tracks: it checks the pattern, copies the block, checks the copy and 
+    points the slot at the new address, and turns down every other block.
+    The owner keeps the slot rather than the address, and gets the address
+    back from hosted_movable_remove when it is done with the block. All of
+    it is serialised by one lock.
+*/
+uint32_t hosted_movable_add(phys_addr_t address, uint32_t order); // fill and track a block of 2^order pages, returns its slot
+phys_addr_t hosted_movable_remove(uint32_t slot);                 // check and stop tracking a block, returns where it is now
+bool hosted_migrate(phys_addr_t from, phys_addr_t to, uint32_t order);
+uint64_t hosted_movable_moves(void);  // blocks hosted_migrate moved
+uint64_t hosted_movable_errors(void); // patterns that didn't match, on a move or a remove
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+/*
+    Hosted stand-in for <lumos/multiboot.h>. Only the fields of the
+    multiboot info structure that the pmm reads are meaningful, but the
+    layout matches the one GRUB hands to LumOS.
+*/
+
+#include <stdint.h>
+
+typedef struct multiboot_info
+{
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length; // length of the memory map in bytes
+    uint32_t mmap_addr;   // physical address of the first mmap_entry_t
+} multiboot_info_t;
+
+#endif
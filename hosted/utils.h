@@ -0,0 +1,16 @@
+#ifndef UTILS_H
+#define UTILS_H
+
+/*
+    Hosted stand-in for the LumOS <utils.h>. logf goes to stderr when
+    hosted_verbose is set and is otherwise a no-op, so that the
+    benchmarks measure the allocator and not the terminal.
+*/
+
+#include <stdbool.h>
+
+extern bool hosted_verbose;
+
+void logf(const char *format, ...);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+    Per-CPU block caches. See percpu.h.
+*/
+
+#include <lumos/pmm.h>
+#include <lumos/percpu.h>
+#include <string.h>
+#include <utils.h>
+
+static struct pcp pcpCaches[PMM_MAX_CPUS];
+
+static inline struct pcp_cache *cacheFor(uint32_t blocks, uint32_t type)
+{
+    return &pcpCaches[pmm_cpu_id()].caches[type][__builtin_ctz(blocks)];
+}
+
+// give every block cached by one CPU back to the zones
+static void drainCpu(struct pcp *pcp)
+{
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+        for (uint32_t i = 0; i < PCP_ORDERS; i++)
+        {
+            if (pcp->caches[type][i].count == 0)
+                continue;
+            freeToZones(pcp->caches[type][i].blocks, pcp->caches[type][i].count, 1 << i);
+            pcp->caches[type][i].count = 0;
+        }
+}
+
+void pcpInit(void)
+{
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+            for (uint32_t i = 0; i < PCP_ORDERS; i++)
+            {
+                struct pcp_cache *cache = &pcpCaches[cpu].caches[type][i];
+                cache->count = 0;
+                cache->low = PCP_DEFAULT_LOW;
+                cache->high = PCP_DEFAULT_HIGH;
+                cache->batch = PCP_DEFAULT_BATCH;
+            }
+}
+
+bool pmm_pcp_tune(uint32_t blocks, uint32_t low, uint32_t high, uint32_t batch)
+{
+    if (blocks == 0 || blocks > PCP_MAX_BLOCKS || (blocks & (blocks - 1)) != 0)
+        return false;
+    if (low > high || high >= PCP_CAPACITY || batch > PCP_CAPACITY)
+        return false;
+
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+        {
+            struct pcp_cache *cache = &pcpCaches[cpu].caches[type][__builtin_ctz(blocks)];
+
+            // blocks above the new limits go back to the zone
+            if (cache->count > (batch ? high : 0))
+            {
+                uint32_t keep = batch ? low : 0;
+                freeToZones(cache->blocks + keep, cache->count - keep, blocks);
+                cache->count = keep;
+            }
+            cache->low = low;
+            cache->high = high;
+            cache->batch = batch;
+        }
+    return true;
+}
+
+void pmm_pcp_drain(void)
+{
+    drainCpu(&pcpCaches[pmm_cpu_id()]);
+}
+
+void pcpDrainAll(void)
+{
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        drainCpu(&pcpCaches[cpu]);
+}
+
+phys_addr_t pcpAlloc(uint32_t blocks, uint32_t type)
+{
+    struct pcp_cache *cache = cacheFor(blocks, type);
+
+    if (cache->batch == 0)
+        return 0;
+
+    if (cache->count == 0)
+    {
+        cache->count = allocFromZones(blocks, cache->blocks, cache->batch, type);
+        if (cache->count == 0)
+            return 0;
+        markCached(cache->blocks, cache->count, true);
+    }
+    markCached(&cache->blocks[cache->count - 1], 1, false);
+    return cache->blocks[--cache->count];
+}
+
+bool pcpFree(phys_addr_t address, uint32_t blocks, uint32_t type)
+{
+    struct pcp_cache *cache = cacheFor(blocks, type);
+
+    if (cache->batch == 0)
+        return false;
+
+    cache->blocks[cache->count++] = address;
+    if (cache->count > cache->high)
+    {
+        // the oldest blocks are the coldest, give those back
+        uint32_t drain = cache->count - cache->low;
+        freeToZones(cache->blocks, drain, blocks);
+        memmove(cache->blocks, cache->blocks + drain, cache->low * sizeof(phys_addr_t));
+        cache->count = cache->low;
+    }
+    return true;
+}
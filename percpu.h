@@ -0,0 +1,60 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+/*
+    Per-CPU caches of small blocks in front of the buddies.
+    Every CPU has a stack of free blocks for each of the smallest orders
+    and each mobility type, so that cached blocks go back to pageblocks of
+    their own type.
+    pmm_alloc and pmm_free push and pop on the stack of the calling CPU
+    without taking any lock, and only go to the zone - in batches - when a
+    stack runs empty or grows past its high watermark. The platform must 
+    guarantee that a CPU id is only used by one thread of execution at a 
+    time (in the kernel, by disabling preemption around pmm calls).
+*/
+
+#include <lumos/pmm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PMM_MAX_CPUS 16
+#define PCP_ORDERS 3                          // caches for 1, 2 and 4 block requests
+#define PCP_MAX_BLOCKS (1 << (PCP_ORDERS - 1)) // largest request served from the caches, in blocks
+#define PCP_CAPACITY 256                      // most blocks a single cache can hold
+
+// default watermarks, see pmm_pcp_tune
+#define PCP_DEFAULT_LOW 32
+#define PCP_DEFAULT_HIGH 128
+#define PCP_DEFAULT_BATCH 32
+
+struct pcp_cache
+{
+    uint32_t count; // blocks currently cached
+    uint32_t low;   // a drain stops at this many blocks
+    uint32_t high;  // a free that leaves more than this many blocks drains the cache
+    uint32_t batch; // blocks taken from the zone when the cache runs empty. 0 disables the cache
+    phys_addr_t blocks[PCP_CAPACITY];
+};
+
+struct pcp
+{
+    struct pcp_cache caches[PMM_MOBILITY_TYPES][PCP_ORDERS];
+} __attribute__((aligned(64)));
+
+uint32_t pmm_cpu_id(void); // provided by the platform, in [0, PMM_MAX_CPUS)
+
+/*
+    Set the watermarks of the caches for requests of the given number of
+    blocks on every CPU, for every mobility type. batch 0 turns those caches off. Only call this
+    while no other CPU is inside the pmm.
+*/
+bool pmm_pcp_tune(uint32_t blocks, uint32_t low, uint32_t high, uint32_t batch);
+void pmm_pcp_drain(void); // give every block cached by the calling CPU back to the zone
+
+// internal, used by pmm.c
+void pcpInit(void);
+void pcpDrainAll(void); // pmm_pcp_drain for every CPU, with no other CPU inside the pmm
+phys_addr_t pcpAlloc(uint32_t blocks, uint32_t type);              // blocks is a power of two <= PCP_MAX_BLOCKS. 0 if the cache is off or the zones are empty
+bool pcpFree(phys_addr_t address, uint32_t blocks, uint32_t type); // type is the one of the block's pageblock. false if the cache is off
+
+#endif
@@ -1,9 +1,14 @@
 /* 
-    BitMap based Physcial Memoru Manager. Uses a first fit allocator for 
-    Normal zone memory and a buddy allocator for DMA zone allocation
+    BitMap based Physcial Memoru Manager. Uses a buddy allocator with per
+    order free lists for the DMA, the Normal and the High zone
 */
 
 #include <lumos/pmm.h>
+#include <lumos/bitmap.h>
+#include <lumos/percpu.h>
+#include <lumos/trace.h>
+#include <lumos/zero.h>
+#include <lumos/state.h>
 #include <lumos/multiboot.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,459 +18,2428 @@
 #include <stdbool.h>
 #include <utils.h>
 
-#define getBitOffset(start, target, blockSize) ((uint32_t)target - (uint32_t)start) / blockSize
+#define getBitOffset(start, target, blockSize) (uint32_t)(((target) - (start)) / (blockSize))
 #define CEIL(x, y) ((x / y) + ((x % y) != 0))
+#define ALIGN_UP(x, y) (((x) + (y)-1) & ~((uintptr_t)(y)-1))
+#define ALIGN_UP_PHYS(x, y) (((x) + (y)-1) & ~((phys_addr_t)(y)-1))
+#define SECTION_BASE(section) (((phys_addr_t)(section)->base_high << 32) | (section)->base_low)
+#define SECTION_LENGTH(section) (((phys_addr_t)(section)->length_high << 32) | (section)->length_low)
+#define PHYS_HALVES(address) (uint32_t)((address) >> 32), (uint32_t)(address) // for logging with %x:%x
+#define STAT_ADD(stat, n) __atomic_store_n(&(stat), COUNTER_READ(stat) + (n), __ATOMIC_RELAXED) // counters only their own CPU writes
+#define ROUND_UP_POW2(x) ((x) <= 1 ? 1 : 1u << (32 - __builtin_clz((x)-1)))
+#define LEVEL_INDEX(level) ((level)->order) // index of a buddy in per level arrays
+#define POOL_CONTAINS(pool, address) ((address) >= (pool)->start + ((phys_addr_t)(pool)->firstBlock * BLOCK_SIZE) && \
+                                      (address) < (pool)->start + ((phys_addr_t)(pool)->totalBlocks * BLOCK_SIZE))
+#define TYPED_ORDERS (PMM_PAGEBLOCK_ORDER - 5) // orders whose summary bits (64 blocks) never straddle two pageblocks, these get a summary per mobility type
+#define CHUNK_ORDERS (__builtin_ctz(PMM_INIT_CHUNK) - 5) // orders whose 64-bit bitmap words never straddle two chunks, see buildBlocks
+#define PAGEBLOCK_TYPES(pool) ((uint8_t *)((pool)->freeLinks + (pool)->totalBlocks)) // mobility type of each pageblock, after the free links
+#define PAGEBLOCK_OF(level, block) (((block) << (level)->order) >> PMM_PAGEBLOCK_ORDER) // pageblock a block of a buddy starts in
+#define SUMMARY_FOR(pool, level, block) ((level)->order < TYPED_ORDERS ? (level)->summary + PAGEBLOCK_TYPES(pool)[PAGEBLOCK_OF(level, block)] \
+                                                                        : (level)->summary) // summary a block is tracked by, pool locked
+#define ALLOC_ORDERS(pool) (PAGEBLOCK_TYPES(pool) + CEIL((pool)->totalBlocks, PMM_PAGEBLOCK_BLOCKS)) // order + 1 of the block handed out at each block, 0 if none
+#define ORDER_MOVABLE 0x80 // in ALLOC_ORDERS, the block was handed out as PMM_MOVABLE
+#define ORDER_CACHED 0x40  // in ALLOC_ORDERS, the block sits in a per-CPU cache or the huge page reserve, or is being freed
+#define ORDER_OF(entry) (((entry) & (ORDER_CACHED - 1)) - 1) // order of a non-zero ALLOC_ORDERS entry
+#define STATE_SUM_SEED 0xCBF29CE484222325ull // FNV-1a offset basis
+#define STATE_SUMMED(header) ((uint8_t *)&(header)->imageSum + sizeof((header)->imageSum)) // the part of a state header after its checksums
+#define STATE_SUMMED_BYTES (sizeof(struct pmm_state) - offsetof(struct pmm_state, imageSum) - sizeof(uint64_t))
+#define STATE_FITS(header, offset, bytes) ((offset) >= (header)->metadataOffset && (offset) <= (header)->imageBytes && \
+                                           (bytes) <= (header)->imageBytes - (offset)) // an offset of an image is followed by bytes of it
+#define STATE_AT(image, offset) ((uint8_t *)(image) + (offset)) // address of an offset of an image
+
+// where a mobility type takes pageblocks from once it has none left, in order
+static const uint8_t fallbackTypes[PMM_MOBILITY_TYPES][PMM_MOBILITY_TYPES - 1] = {
+    [PMM_UNMOVABLE] = {PMM_RECLAIMABLE, PMM_MOVABLE},
+    [PMM_RECLAIMABLE] = {PMM_UNMOVABLE, PMM_MOVABLE},
+    [PMM_MOVABLE] = {PMM_RECLAIMABLE, PMM_UNMOVABLE},
+};
 
 uintptr_t kernel_end = (uintptr_t)&_kernel_end;
 uintptr_t kernel_start = (uintptr_t)&_kernel_start;
 uintptr_t VIRTUAL_KERNEL_OFFSET = (uintptr_t)&VIRTUAL_KERNEL_OFFSET_LD;
 
 /*
-    The available physical memory is divided into two
+    The available physical memory is divided into three
     types of zones. DMA zone handles a maximum of 256K 
     of the available physical memory space, upto a max address
-    of 16M. Normal zone contains the rest 
+    of 16M. High zone has everything from 4G up, which only
+    PAE or 64-bit page tables can map. Normal zone contains the rest.
+    Every NUMA node has a Normal and a High zone of its own
 */
-struct zone *zone_DMA = (struct zone *)&_kernel_end;
-struct zone *zone_normal = NULL;
+struct zone *zone_DMA = NULL;
+struct pmm_node pmm_nodes[PMM_MAX_NODES];
 
-// debugging
+// every zone, DMA first, in the order init_pmm created them
+static struct zone *zones[1 + 2 * PMM_MAX_NODES];
+static uint32_t zoneCount = 0;
+
+/*
+    The memory of every pool, sorted by address, so that a free finds the
+    pool and zone of a block in a binary search rather than walking the 
+    pools of every zone. Laid out after the last pool.
+*/
+struct pool_range
+{
+    phys_addr_t start; // the first byte of memory of the pool, at firstBlock
+    phys_addr_t end;
+    struct pool *pool;
+    struct zone *zone;
+};
+static struct pool_range *poolRanges;
+static uint32_t poolRangeCount = 0;
+
+// the node table passed to init_pmm_numa
+static struct pmm_node_range nodeRanges[PMM_MAX_NODE_RANGES];
+static uint32_t nodeRangeCount = 0, nodeCount = 1;
+
+static struct pmm_cpu_node cpuNodes[PMM_MAX_CPUS];
+
+// end of the zone headers and pools laid out so far, in kernel virtual memory
+static uintptr_t metadataEnd;
+
+// NORMAL allocations may only take DMA blocks while more than this many are free. Set at any time, so accessed with __atomic
+static uint32_t dmaReserve = DMA_DEFAULT_RESERVE;
+
+// blocks of each pool built at boot, 0 for all of them. See pmm_set_deferred_init
+static uint32_t bootBlocks = 0;
+
+// the memory map init_pmm was given, for recordings. See pmm_record_start
+static struct pmm_record_region bootMap[PMM_RECORD_MAX_MAP];
+static uint32_t bootMapCount = 0;
+
+// physical range of the kernel and the pmm structures, never released
+static phys_addr_t reservedStart, reservedEnd;
+
+// the client compaction moves movable blocks with, NULL if there is none. See pmm_set_migrate
+static pmm_migrate_t migrateBlock = NULL;
+
+// the client asked to give back memory cached above the pmm, NULL if there is none. See pmm_set_reclaim
+static pmm_reclaim_t reclaimMemory = NULL;
+
+// blocks set aside at boot for pmm_alloc_huge, per order. See pmm_set_huge_reserve
+struct huge_reserve
+{
+    phys_addr_t *blocks; // the free ones first, laid out after the last pool
+    uint32_t count;      // blocks the reserve holds when nothing is taken from it
+    uint32_t free;
+};
+static struct huge_reserve hugeReserve[BUDDY_LEVELS];
+static spinlock_t hugeLock = SPINLOCK_INIT;
+
+// debugging, build with PMM_DEBUG to have init_pmm dump every zone
+#ifdef PMM_DEBUG
 void printZoneInfo(struct zone *zone);
 void printBuddyBitMap(uint32_t *map, uint32_t mapWordCount);
+#endif
 
 // utils
+phys_addr_t allocPages(struct pmm_cpu_node *cpu, uint32_t blocks, uint32_t type);  // the body of pmm_alloc, for a power of two number of blocks
+uint32_t zoneAllocBlocks(struct zone *zone, uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t type); // take up to count blocks of a power of two size from a zone
+void zoneFreeBlocks(struct zone *zone, phys_addr_t *addresses, uint32_t count, uint32_t blocks); // give blocks of a power of two size back to a zone
+struct zone *zoneForAddress(phys_addr_t address);                                 // zone whose pools manage an address, NULL if none
+const struct pool_range *rangeForAddress(phys_addr_t address);                    // pool and zone that manage an address, NULL if none
+void buildPoolRanges(void);                                                        // lay out and sort poolRanges once every pool is there
+void keepBootMap(multiboot_info_t *mbtStructure);                                  // copy the memory map before init_pmm starts taking sections apart
+void badFree(struct pmm_cpu_node *cpu, phys_addr_t address, uint32_t blocks);      // log and count a free that is dropped
+#ifdef PMM_CHECK_FREE
+bool checkFree(const struct pool_range *range, phys_addr_t address, uint32_t blocks); // whether a free is of a block handed out at that size, and claim it
+#endif
+uint32_t nodeForRange(phys_addr_t base, phys_addr_t *bytes);                       // node of base, and how many of the bytes from there stay on it
+uint32_t nodeAllocBlocks(uint32_t node, uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t type); // take up to count blocks from the zones of one node
+uint32_t allocFromNode(struct pmm_cpu_node *cpu, uint32_t node, uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t policy, uint32_t type); // a node, then its fallback order
+struct zone *newZone(uint8_t type, uint8_t node);                                  // empty zone header placed after the metadata laid out so far
+struct pool *newPool(struct zone *zone, phys_addr_t start, uint32_t blocks);       // pool placed after the metadata laid out so far, added to a zone
+void advanceSection(struct mmap_entry_t *section, phys_addr_t bytes);               // drop bytes from the start of a memory map section
 void makeBuddies(struct pool *pool);
-void set_bit(uint32_t *mapStart, uint32_t offset);                             // set a single bit
-void set_bits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd);   // set a section of bits
-void unset_bit(uint32_t *mapStart, uint32_t offset);                           // unset a single bit
-void unset_bits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd); // unset a section of bits
-bool test_bit(uint32_t *mapStart, uint32_t offset);                            // return the value of a bit
+void freeRange(struct pool *pool, uint32_t firstBlock, uint32_t lastBlock, int32_t *levelFree); // free a range of blocks as the largest aligned buddies
+uint32_t releaseUsable(struct pool *pool, uint32_t firstBlock, uint32_t lastBlock, int32_t *levelFree); // free the usable blocks of a range, or just count them
+uint32_t buildBlocks(struct pool *pool, uint32_t endBlock);                   // build the buddy state of a pool up to endBlock, returns the blocks released
+struct buddy *buddyForBlocks(struct pool *pool, uint32_t blocks);              // smallest buddy whose blocks hold the given number of blocks
+intmax_t findFreeBlock(struct pool *pool, struct buddy *level, uint32_t type); // first free block of a buddy that type can take, -1 if none
+bool claimFreePageblocks(struct pool *pool, uint32_t first, uint32_t end, uint32_t type); // hand the pageblocks of free blocks [first, end) to type
+void fillHugeReserve(void);                                                    // take the blocks of the huge page reserve from the zones
+struct pool *poolForAddress(struct zone *zone, phys_addr_t address);           // pool of a zone that manages an address, NULL if none
+uint32_t mobilityOf(struct zone *zone, phys_addr_t address);                 // mobility type of the pageblock an address of a zone is in
+void pushFreeBlock(struct pool *pool, struct buddy *level, uint32_t block);     // mark a block free and put it on its free list
+void unlinkFreeBlock(struct pool *pool, struct buddy *level, uint32_t block);   // take a block off its free list, leaving the bitmap alone
+void removeFreeBlock(struct pool *pool, struct buddy *level, uint32_t block);   // take a block off its free list and mark it reserved
+uint32_t allocBlocks(struct pool *pool, struct buddy *target, phys_addr_t *out, uint32_t count, uint32_t type); // take up to count blocks of a buddy, returns how many
+void putBackRest(struct pool *pool, struct buddy *level, struct buddy *target, uint32_t rest, uint32_t end, int32_t *levelFree); // free the tail of a block being split
+uint32_t compactNodes(struct pmm_cpu_node *cpu, uint32_t blocks);              // compact the nodes the CPU allocates from until a block that size is free
+uint32_t compactPool(struct zone *zone, struct pool *pool, struct buddy *goal, struct pmm_cpu_node *cpu); // move movable blocks of a pool down, returns how many
+uint32_t takeMovableBelow(struct pool *pool, struct buddy *target, uint32_t limit, int32_t *levelFree); // lowest free movable block of a buddy below a block
+bool stealPageblock(struct pool *pool, struct buddy *target, uint32_t type);    // hand the pageblock of another mobility type with the largest free block over to type
+void claimPageblock(struct pool *pool, uint32_t pageblock, uint32_t type);      // move a pageblock and its free blocks to a mobility type
+void freeBlock(struct pool *pool, struct buddy *level, uint32_t block, int32_t *levelFree); // return a block and coalesce it with its buddies
+void applyLevelFree(struct pool *pool, int32_t *levelFree);                    // add the per level changes of a batch to the buddy counters
 void reserve_kernel();                                                         // Mark the space used by the kernel and the pmm structures as reserved
-intmax_t findFirstFreeBit(uint32_t *map, uint32_t maxWords);                   // return the offset of the first unset bit. -1 if no such bit
+uint64_t stateSum(uint64_t sum, const void *data, size_t bytes);             // fold bytes into a checksum of a state image
+uint64_t relocateField(void *field, intptr_t delta, bool toPointers);       // move a pointer field of an image by delta, returns its offset
+bool walkState(uint8_t *image, intptr_t delta, bool toPointers, uint64_t *sum); // relocate the pointers of the metadata of an image and sum its headers
 
 /* -------------------- API FUNCTION DEFINITIONS ----------------------- */
 
 /* 
-    This is the allocator for the NORMAL zone. This uses a basic first fit 
-    allocator. Returns a pointer to the 
+    This is the allocator for the HIGH and NORMAL zones. The request is 
+    rounded up to the smallest buddy that can hold it. The nodes it is 
+    taken from depend on the policy of the calling CPU, see pmm_set_policy.
+    Within a node it comes from the first pool whose free lists can serve 
+    it, HIGH pools first so that memory below 4 GB lasts for whoever can't
+    address more. Under the local policy small requests are served from the
+    per-CPU cache of the calling CPU. When the nodes are out of memory the
+    block is taken from the DMA zone instead, as long as that leaves the 
+    DMA reserve untouched and the CPU isn't bound to a node. Returns the 
+    physical address of the block, or 0 if no pool has a large enough free
+    block.
+*/
+phys_addr_t pmm_alloc(uint32_t request)
+{
+    return pmm_alloc_type(request, PMM_UNMOVABLE);
+}
+
+/*
+    pmm_alloc for memory of a given mobility type. Blocks come from 
+    pageblocks of that type or entirely free ones, and only once there are
+    none left in a pool is a pageblock of another type taken over. Unknown
+    types are treated as PMM_UNMOVABLE.
 */
-void *pmm_alloc(uint32_t request)
+phys_addr_t pmm_alloc_type(uint32_t request, uint32_t type)
 {
-    logf("\n[pmm_alloc] : Received request for %d bytes\n", request);
+    PMM_TRACE_START(start);
+    phys_addr_t address;
+
+    if (type >= PMM_MOBILITY_TYPES)
+        type = PMM_UNMOVABLE;
+    address = allocRequest(request, type);
+
+    if (address == 0)
+        PMM_TRACE_EVENT(PMM_EVENT_ALLOC_FAIL, 0, PMM_ALLOC_ARG(CEIL(request, BLOCK_SIZE), type), start);
+    else
+        PMM_TRACE_EVENT(PMM_EVENT_ALLOC, address, PMM_ALLOC_ARG(CEIL(request, BLOCK_SIZE), type), start);
+    return address;
+}
 
-    if (request == 0)
+/*
+    Release a block returned by pmm_alloc. size is the size that was 
+    requested from pmm_alloc, or 0 for the size the block was handed out
+    at, which its pool keeps a byte for. Small blocks of the calling CPU's
+    node go to its per-CPU cache, others are merged with their buddy for as
+    long as the buddy is free. Addresses the pmm doesn't manage are dropped,
+    and so are size 0 frees of blocks that aren't handed out. With 
+    PMM_CHECK_FREE every free checkFree turns down is dropped too.
+*/
+void pmm_free(phys_addr_t address, uint32_t size)
+{
+    PMM_TRACE_START(start);
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    const struct pool_range *range = rangeForAddress(address);
+    uint32_t blocks = 0;
+    uint8_t *entry = NULL, seen = 0;
+
+    STAT_ADD(cpu->freeCalls, 1);
+    if (range != NULL)
     {
-        logf("Returning NULL because NULL request\n");
-        return NULL;
+        entry = &ALLOC_ORDERS(range->pool)[getBitOffset(range->pool->start, address, BLOCK_SIZE)];
+        seen = __atomic_load_n(entry, __ATOMIC_RELAXED);
+        if (size != 0)
+            blocks = ROUND_UP_POW2(CEIL(size, BLOCK_SIZE));
+        else if (seen != 0 && (seen & ORDER_CACHED) == 0 && address % BLOCK_SIZE == 0)
+            blocks = 1u << ORDER_OF(seen);
     }
-
-    request = CEIL(request, BLOCK_SIZE);
-    logf("[pmm_alloc] : Rounded request upto %d blocks\n", request);
-
-    if (zone_normal->freeBlocks < request)
+#ifdef PMM_CHECK_FREE
+    if (!checkFree(range, address, blocks))
+        blocks = 0;
+#else
+    // flag the block as on its way back like checkFree does, so that a size 0 free of it fails from here on
+    if (blocks != 0 && size == 0 && !__atomic_compare_exchange_n(entry, &seen, seen | ORDER_CACHED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        blocks = 0;
+    else if (blocks != 0 && size != 0 && seen != 0)
+        __atomic_fetch_or(entry, ORDER_CACHED, __ATOMIC_RELAXED);
+#endif
+    if (blocks == 0)
     {
-        // TODO : Try and allocate from the DMA zone instead
-        logf("Returning NULL because insufficient blocks.\n");
-        return NULL;
+        badFree(cpu, address, blocks);
+        return;
     }
 
-    struct pool *currentPool;
-    currentPool = zone_normal->poolStart;
-    uint32_t *bitMap = NULL;
-    uint32_t offset = 0;
-    uint32_t maxBlocks = 0;
-    uint32_t startIndex = 0;
-    bool isSet = 0;
-    while (currentPool != NULL)
-    {
-        if (currentPool->freeBlocks >= request)
-        {
-            logf("[pmm_alloc] | Chose pool : Start: %x\tFree Blocks: %d\tMax Free Blocks: %d\n", currentPool->start, currentPool->freeBlocks, currentPool->poolBuddiesTop->maxFreeBlocks);
-            bitMap = currentPool->poolBuddiesBottom->bitMap;
-            maxBlocks = currentPool->poolBuddiesBottom->maxFreeBlocks;
-
-            while (offset < maxBlocks)
-            {
-                // Start checking where the entire word isn't reserved
-                if (bitMap[offset / 32] != 0xFFFFFFFF)
-                {
-                    // find the first available bit
-                    startIndex = offset;
-                    while (test_bit(bitMap, startIndex) == 1)
-                        startIndex++;
-
-                    // loop until we get through n bits (available ones)
-                    while ((offset < startIndex + request) && (offset < maxBlocks))
-                    {
-                        // if any of these bits is set, we break
-                        if (test_bit(bitMap, offset) == 1)
-                        {
-                            isSet = 1;
-                            break;
-                        }
-                        offset++;
-                    }
-
-                    // if this is not set, we found n available bits
-                    if (!isSet)
-                    {
-                        // todo: gotta return address starting at startIndex
-                    }
-                    else
-                    {
-                        // if continuous n bits weren't found, move to the next bit and start checking again
-                        offset++;
-                        continue;
-                    }
+    // a block pmm_alloc had to take from the DMA zone goes straight back there
+    if (range->zone == zone_DMA || blocks > PCP_MAX_BLOCKS || range->zone->node != cpu->node ||
+        !pcpFree(address, blocks, mobilityOf(range->zone, address)))
+        zoneFreeBlocks(range->zone, &address, 1, blocks);
 
-                    if (offset >= maxBlocks)
-                    {
-                        logf("Returning null because internal loop ran too long");
-                        return NULL;
-                    }
+    PMM_TRACE_EVENT(PMM_EVENT_FREE, address, blocks, start);
+}
 
-                    // find the first index here that is available
-                    // keep looping until n available bits are found or a reserved bit is encountered
-                    // if there were n available bits, return starting position of bits
-                    // else set offset to the next bit and continue;
+/*
+    Take up to count blocks of 2^order pages from the HIGH and NORMAL zones
+    of the nodes the calling CPU's policy picks in one go, 
+    storing their physical addresses in out. Each pool is locked once for 
+    all the blocks it hands out and the free counters are updated once per 
+    pool, so this is much cheaper per page than calling pmm_alloc in a loop.
+    The per-CPU caches are bypassed, except that they are drained if the 
+    zone runs short. Returns the number of blocks taken, which is less than 
+    count if memory ran out.
+*/
+uint32_t pmm_alloc_bulk(uint32_t order, uint32_t count, phys_addr_t *out)
+{
+    PMM_TRACE_START(start);
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    uint32_t taken = 0;
 
-                    // temporary return
-                }
-                offset += 32;
-            }
+    if (count == 0)
+        return 0;
 
-            logf("[pmm_alloc] : Couldn't find an unset bit\n");
-            return NULL;
+    if (order < 32 && (1u << order) <= MAX_ALLOC_BLOCKS)
+    {
+        taken = allocFromZones(1u << order, out, count, PMM_UNMOVABLE);
+        if (taken < count)
+        {
+            pmm_pcp_drain();
+            taken += allocFromZones(1u << order, out + taken, count - taken, PMM_UNMOVABLE);
         }
-        currentPool = currentPool->nextPool;
     }
 
-    logf("[pmm_alloc] : Returning null because no NORMAL free pools\n");
-    return NULL;
+    STAT_ADD(cpu->allocCalls, 1);
+    if (taken < count)
+        STAT_ADD(cpu->allocFails, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_ALLOC_BULK, (taken > 0) ? out[0] : 0, taken, start);
+    return taken;
 }
 
-void init_pmm(multiboot_info_t *mbtStructure)
+/*
+    Release count blocks of 2^order pages. The blocks go straight back to
+    their pools, which are locked once for each run of addresses that 
+    belong to the same pool.
+*/
+void pmm_free_bulk(uint32_t order, phys_addr_t *addresses, uint32_t count)
 {
-    // temp pointers to work with pools inside loops
-    struct pool *currentPool;
-    struct pool *previousPool = NULL;
-    struct buddy *currentBuddy;
+    PMM_TRACE_START(start);
 
-    // make sure we have a valid memory map - 6th bit of flags indicates whether the mmap_addr & mmp_length fields are valid
-    if (!(mbtStructure->flags & MBT_FLAG_IS_MMAP))
+    if (count == 0 || order >= 32 || (1u << order) > MAX_ALLOC_BLOCKS)
+        return;
+
+#ifdef PMM_CHECK_FREE
+    // free the runs of blocks that pass, dropping the ones in between
+    for (uint32_t i = 0, end; i < count; i = end + 1)
     {
-        logf("[PMM] : No memory map available\n");
-        abort();
+        for (end = i; end < count && claimFree(addresses[end], 1u << order); end++)
+            ;
+        freeToZones(addresses + i, end - i, 1u << order);
     }
+#else
+    freeToZones(addresses, count, 1u << order);
+#endif
+    STAT_ADD(cpuNodes[pmm_cpu_id()].freeCalls, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_FREE_BULK, addresses[0], count, start);
+}
+
+/*
+    Allocator for the DMA zone, for drivers that need physically contiguous
+    memory below DMA_MAX_ADDRESS. Returns the physical address of a block 
+    of 2^order pages, aligned to its size, or 0 if the DMA zone has no 
+    large enough free block. The DMA reserve only applies to NORMAL 
+    allocations, this can use the whole zone.
+*/
+phys_addr_t pmm_alloc_dma(uint32_t order)
+{
+    PMM_TRACE_START(start);
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    phys_addr_t address = 0;
+
+    if (order < 32 && (1u << order) <= MAX_ALLOC_BLOCKS)
+        zoneAllocBlocks(zone_DMA, 1u << order, &address, 1, PMM_UNMOVABLE);
+
+    STAT_ADD(cpu->allocCalls, 1);
+    if (address == 0)
+        STAT_ADD(cpu->allocFails, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_ALLOC_DMA, address, order, start);
+    return address;
+}
 
-    // Initialize the DMA zone descriptor
-    zone_DMA->zoneType = 0;
-    zone_DMA->freeBlocks = 0;
-    zone_DMA->poolStart = NULL;
-    zone_DMA->zonePhysicalSize = sizeof(struct zone);
+// Release a block returned by pmm_alloc_dma, merging it with its buddies
+void pmm_free_dma(phys_addr_t address, uint32_t order)
+{
+    PMM_TRACE_START(start);
+
+    if (order >= 32 || (1u << order) > MAX_ALLOC_BLOCKS)
+        return;
+#ifdef PMM_CHECK_FREE
+    if (!claimFree(address, 1u << order))
+        return;
+#endif
+
+    zoneFreeBlocks(zone_DMA, &address, 1, 1u << order);
+    STAT_ADD(cpuNodes[pmm_cpu_id()].freeCalls, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_FREE_DMA, address, order, start);
+}
 
-    // go through the memory map from the multiboot info structure
-    struct mmap_entry_t *section = (struct mmap_entry_t *)(mbtStructure->mmap_addr + VIRTUAL_KERNEL_OFFSET);
-    while (section < (struct mmap_entry_t *)(mbtStructure->mmap_addr + mbtStructure->mmap_length + VIRTUAL_KERNEL_OFFSET))
-    {
-        // Skip reserved sections and sections >4G
-        if (section->base_high || section->type != 1)
-        {
-            section = (struct mmap_entry_t *)((uint32_t)section + (uint32_t)section->size + sizeof(section->size));
-            continue;
-        }
+/*
+    Set how many DMA blocks NORMAL allocations must leave free when they 
+    fall back to the DMA zone. DMA_TOTAL_BLOCKS or more turns the fallback
+    off. The check is made without locking, so concurrent fallbacks can dip 
+    into the reserve by a block or two each.
+*/
+void pmm_set_dma_reserve(uint32_t blocks)
+{
+    __atomic_store_n(&dmaReserve, blocks, __ATOMIC_RELAXED);
+}
 
-        // If we're done with the DMA, add the entire section as a NORMAL zone pool
-        if (section->base_low > DMA_MAX_ADDRESS || zone_DMA->freeBlocks >= DMA_TOTAL_BLOCKS)
+/*
+    Choose how much of each pool init_pmm builds. With blocks set to 0 (the
+    default) every bitmap and free list is built at boot. Otherwise only the
+    first blocks blocks of each pool are, rounded up to PMM_INIT_CHUNK, 
+    which keeps boot time flat no matter how much memory there is. The rest
+    of a pool is counted as free right away and built a chunk at a time, 
+    when an allocation finds nothing in the part that is already built or
+    from pmm_init_deferred. Must be called before init_pmm.
+*/
+void pmm_set_deferred_init(uint32_t blocks)
+{
+    bootBlocks = blocks;
+}
+
+/*
+    Build up to blocks blocks of the memory init_pmm left for later, for an
+    idle loop or a background thread. Returns true while there is more left.
+*/
+bool pmm_init_deferred(uint32_t blocks)
+{
+    struct pool *currentPool;
+    uint32_t end;
+    bool more = false;
+
+    for (uint32_t i = 0; i < zoneCount; i++)
+        for (currentPool = zones[i]->poolStart; currentPool != NULL; currentPool = currentPool->nextPool)
         {
-            // Initialize the Zone descriptor if this is the first addition to the normal zone
-            if (zone_normal == NULL)
+            spin_lock(&currentPool->lock);
+            while (blocks > 0 && currentPool->initBlocks < currentPool->totalBlocks)
             {
-                zone_normal = (struct zone *)((uint32_t)zone_DMA + zone_DMA->zonePhysicalSize); // put the normal zone structure right after all the DMA zone - related data
-                zone_normal->zoneType = 1;
-                zone_normal->freeBlocks = 0;
-                zone_normal->poolStart = NULL;
-                zone_normal->zonePhysicalSize = sizeof(struct zone);
+                end = currentPool->initBlocks + PMM_INIT_CHUNK;
+                if (end > currentPool->totalBlocks)
+                    end = currentPool->totalBlocks;
+                blocks -= (end - currentPool->initBlocks < blocks) ? end - currentPool->initBlocks : blocks;
+                buildBlocks(currentPool, end);
             }
+            more |= currentPool->initBlocks < currentPool->totalBlocks;
+            spin_unlock(&currentPool->lock);
+        }
+    return more;
+}
+
+/*
+    Allocate a block of 2^order pages from a given node, or when it is out 
+    of memory from the nodes of its fallback order, whatever the policy of
+    the calling CPU. The per-CPU caches are bypassed, as they only hold 
+    memory of the local node. Returns the physical address of the block, or
+    0 if none of the nodes has a large enough free block.
+*/
+phys_addr_t pmm_alloc_node(uint32_t node, uint32_t order)
+{
+    PMM_TRACE_START(start);
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    phys_addr_t address = 0;
 
-            // Create a new pool and add it to the existing list of NORMAL pools
-            currentPool = (struct pool *)((uint32_t)zone_normal + zone_normal->zonePhysicalSize);
-            currentPool->start = section->base_low;
-            currentPool->freeBlocks = (section->length_low / BLOCK_SIZE);
-            currentPool->nextPool = NULL;
-            currentPool->poolPhysicalSize = sizeof(struct pool);
+    if (node < nodeCount && order < 32 && (1u << order) <= MAX_ALLOC_BLOCKS &&
+        allocFromNode(cpu, node, 1u << order, &address, 1, PMM_POLICY_LOCAL, PMM_UNMOVABLE) == 0)
+    {
+        pmm_pcp_drain();
+        allocFromNode(cpu, node, 1u << order, &address, 1, PMM_POLICY_LOCAL, PMM_UNMOVABLE);
+    }
 
-            zone_normal->freeBlocks += (section->length_low / BLOCK_SIZE);
+    STAT_ADD(cpu->allocCalls, 1);
+    if (address == 0)
+        STAT_ADD(cpu->allocFails, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_ALLOC_NODE, address, (node << 8) | order, start);
+    return address;
+}
 
-            // create a new bitmap descriptor and bitmap for the pool
-            currentBuddy = (struct buddy *)((uint32_t)currentPool + currentPool->poolPhysicalSize);
-            currentBuddy->buddyOrder = 1;
-            currentBuddy->freeBlocks = currentPool->freeBlocks;
-            currentBuddy->maxFreeBlocks = currentPool->freeBlocks;
-            currentBuddy->mapWordCount = (currentBuddy->freeBlocks / 32) + (currentBuddy->freeBlocks % 32 != 0);
-            currentBuddy->bitMap = (uint32_t *)((uint32_t)currentPool + currentPool->poolPhysicalSize + sizeof(struct buddy));
-            currentBuddy->nextBuddy = NULL;
-            currentBuddy->prevBuddy = NULL;
+uint32_t pmm_node_count(void)
+{
+    return nodeCount;
+}
 
-            currentPool->poolBuddiesTop = currentPool->poolBuddiesBottom = currentBuddy;
-            currentPool->poolPhysicalSize += sizeof(struct buddy) + (currentBuddy->mapWordCount * 4);
+/*
+    Tell the pmm which node a CPU is local to, from the processor affinity
+    entries of the SRAT. Must be called before the CPU allocates, as its 
+    per-CPU cache only holds memory of its node.
+*/
+void pmm_set_cpu_node(uint32_t cpu, uint32_t node)
+{
+    if (cpu >= PMM_MAX_CPUS || node >= nodeCount)
+        return;
+    cpuNodes[cpu].node = node;
+    cpuNodes[cpu].nextInterleave = node;
+}
 
-            zone_normal->zonePhysicalSize += currentPool->poolPhysicalSize;
+/*
+    Set the policy of the calling CPU: PMM_POLICY_LOCAL (the default) takes
+    memory from its own node first, PMM_POLICY_INTERLEAVE spreads blocks 
+    over all the nodes one after the other and PMM_POLICY_BIND only takes 
+    memory from the given node. node is ignored unless binding.
+*/
+void pmm_set_policy(uint32_t policy, uint32_t node)
+{
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
 
-            // set the bits for available and reserved
-            unset_bits(currentBuddy->bitMap, 0, currentBuddy->freeBlocks - 1);
-            set_bits(currentBuddy->bitMap, currentBuddy->freeBlocks, (currentBuddy->mapWordCount * 32) - 1);
+    if (policy > PMM_POLICY_BIND || (policy == PMM_POLICY_BIND && node >= nodeCount))
+        return;
+    cpu->policy = policy;
+    cpu->bindNode = node;
+}
 
-            if (zone_normal->poolStart == NULL)
-                zone_normal->poolStart = currentPool; // this is the first NORMAL pool
-            else
-                previousPool->nextPool = currentPool; // update link from previous pool
+/*
+    Set the nodes an allocation falls back to, in order, once node is out of
+    memory. Nodes left out are never tried, an empty order keeps everything
+    on node. The default is every other node by increasing number, as there
+    is no distance table. Meant for boot, the order is read without locking.
+    Returns false if the order names node itself or a node that doesn't 
+    exist.
+*/
+bool pmm_set_fallback(uint32_t node, const uint32_t *order, uint32_t count)
+{
+    if (node >= nodeCount || count > nodeCount - 1)
+        return false;
+    for (uint32_t i = 0; i < count; i++)
+        if (order[i] >= nodeCount || order[i] == node)
+            return false;
+
+    memcpy(pmm_nodes[node].fallback, order, count * sizeof(uint32_t));
+    pmm_nodes[node].fallbackCount = count;
+    return true;
+}
 
-            previousPool = currentPool;
+// Counters of a node, summed over the CPUs. They are read without stopping the CPUs, so they are only roughly consistent
+void pmm_get_node_stats(uint32_t node, struct pmm_node_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (node >= PMM_MAX_NODES)
+        return;
 
-            section = (struct mmap_entry_t *)((uint32_t)section + (uint32_t)section->size + sizeof(section->size));
-        }
-        // else, add the current section as a DMA pool either entirely or partially
-        else
-        {
-            // create and init a new DMA pool
-            currentPool = (struct pool *)((uint32_t)zone_DMA + zone_DMA->zonePhysicalSize);
-            currentPool->start = section->base_low;
-            currentPool->nextPool = NULL;
-            currentPool->poolBuddiesTop = NULL;
-            currentPool->poolPhysicalSize = sizeof(struct pool);
-
-            // add to the existing linked list
-            if (zone_DMA->poolStart == NULL)
-                zone_DMA->poolStart = currentPool; // this is the first DMA pool
-            else
-                previousPool->nextPool = currentPool; // Add pool to the list
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+    {
+        stats->hit += COUNTER_READ(cpuNodes[cpu].stats[node].hit);
+        stats->miss += COUNTER_READ(cpuNodes[cpu].stats[node].miss);
+        stats->foreign += COUNTER_READ(cpuNodes[cpu].stats[node].foreign);
+        stats->interleave += COUNTER_READ(cpuNodes[cpu].stats[node].interleave);
+    }
+}
 
-            // Make a decision on how much of the current section is to be added as DMA pool
-            if (section->length_low < (DMA_TOTAL_BLOCKS - zone_DMA->freeBlocks) && (currentPool->start + section->length_low - 1) <= DMA_MAX_ADDRESS)
-            {
-                // Adding the entire section as a pool
-                currentPool->freeBlocks = (section->length_low / BLOCK_SIZE);
-                zone_DMA->freeBlocks += (section->length_low / BLOCK_SIZE);
+/*
+    Snapshot of the counters of every zone, pool and order, the API call
+    counters of every CPU and, with PMM_TRACE, the latency histograms. 
+    Nothing is locked, so the numbers are only roughly consistent with each
+    other while other CPUs are allocating.
+*/
+void pmm_get_stats(struct pmm_stats *stats)
+{
+    struct pmm_zone_stats *zoneStats;
+    struct pmm_pool_stats *poolStats;
+    struct pool *currentPool;
+    struct pmm_order_stats order, *total;
 
-                makeBuddies(currentPool);
-                zone_DMA->zonePhysicalSize += currentPool->poolPhysicalSize;
+    memset(stats, 0, sizeof(*stats));
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+    {
+        stats->allocs += COUNTER_READ(cpuNodes[cpu].allocCalls);
+        stats->frees += COUNTER_READ(cpuNodes[cpu].freeCalls);
+        stats->allocFails += COUNTER_READ(cpuNodes[cpu].allocFails);
+        stats->badFrees += COUNTER_READ(cpuNodes[cpu].badFrees);
+        stats->poolScans += COUNTER_READ(cpuNodes[cpu].poolScans);
+        stats->compactions += COUNTER_READ(cpuNodes[cpu].compactions);
+        stats->migrated += COUNTER_READ(cpuNodes[cpu].migrated);
+        stats->migrateFails += COUNTER_READ(cpuNodes[cpu].migrateFails);
+        stats->reclaimed += COUNTER_READ(cpuNodes[cpu].reclaimed);
+    }
 
-                previousPool = currentPool;
+    for (uint32_t i = 0; i < zoneCount; i++)
+    {
+        zoneStats = &stats->zones[stats->zoneCount++];
+        zoneStats->type = zones[i]->zoneType;
+        zoneStats->node = zones[i]->node;
+        zoneStats->freeBlocks = COUNTER_READ(zones[i]->freeBlocks);
+        zoneStats->fails = COUNTER_READ(zones[i]->fails);
 
-                section = (struct mmap_entry_t *)((uint32_t)section + section->size + sizeof(section->size));
-                continue;
-            }
-            else if ((DMA_MAX_ADDRESS - currentPool->start + 1) < (DMA_TOTAL_BLOCKS - zone_DMA->freeBlocks))
+        for (currentPool = zones[i]->poolStart; currentPool != NULL; currentPool = currentPool->nextPool, stats->poolCount++)
+        {
+            zoneStats->poolCount++;
+            poolStats = (stats->poolCount < PMM_STATS_MAX_POOLS) ? &stats->pools[stats->poolCount] : NULL;
+            if (poolStats != NULL)
             {
-                // Adding a partial section because of the 16MB condition
-                currentPool->freeBlocks = (DMA_MAX_ADDRESS - currentPool->start + 1) / BLOCK_SIZE;
-                section->base_low += (DMA_MAX_ADDRESS - currentPool->start + 1);   // Advance start of current section
-                section->length_low -= (DMA_MAX_ADDRESS - currentPool->start + 1); // Reduce size of current section
+                poolStats->start = currentPool->start;
+                poolStats->firstBlock = currentPool->firstBlock;
+                poolStats->zone = i;
+                poolStats->totalBlocks = currentPool->totalBlocks;
+                poolStats->freeBlocks = COUNTER_READ(currentPool->freeBlocks);
+                poolStats->initBlocks = __atomic_load_n(&currentPool->initBlocks, __ATOMIC_RELAXED);
             }
-            else
+
+            for (struct buddy *level = currentPool->poolBuddiesTop; level != NULL; level = level->nextBuddy)
             {
-                // Adding a partial section because the 256KB condition
-                currentPool->freeBlocks = DMA_TOTAL_BLOCKS - zone_DMA->freeBlocks;
-                section->base_low += DMA_TOTAL_BYTES - (zone_DMA->freeBlocks * BLOCK_SIZE);   // Advance start of current section
-                section->length_low -= DMA_TOTAL_BYTES - (zone_DMA->freeBlocks * BLOCK_SIZE); // Reduce size of current section
+                order.allocs = COUNTER_READ(level->stats.allocs);
+                order.frees = COUNTER_READ(level->stats.frees);
+                order.splits = COUNTER_READ(level->stats.splits);
+                order.merges = COUNTER_READ(level->stats.merges);
+                order.searches = COUNTER_READ(level->stats.searches);
+                order.steals = COUNTER_READ(level->stats.steals);
+                if (poolStats != NULL)
+                    poolStats->orders[LEVEL_INDEX(level)] = order;
+
+                total = &zoneStats->orders[LEVEL_INDEX(level)];
+                total->allocs += order.allocs;
+                total->frees += order.frees;
+                total->splits += order.splits;
+                total->merges += order.merges;
+                total->searches += order.searches;
+                total->steals += order.steals;
             }
-
-            zone_DMA->freeBlocks += currentPool->freeBlocks;
-
-            makeBuddies(currentPool);
-
-            zone_DMA->zonePhysicalSize += currentPool->poolPhysicalSize;
-
-            previousPool = currentPool;
         }
     }
 
-    // Mark kernel and pmm spaces as reserved
-    reserve_kernel();
+    spin_lock(&hugeLock);
+    for (uint32_t i = 0; i < BUDDY_LEVELS; i++)
+    {
+        stats->hugeReserve[i] = hugeReserve[i].count;
+        stats->hugeFree[i] = hugeReserve[i].free;
+    }
+    spin_unlock(&hugeLock);
 
-    // log pmm structures
-    logf("DMA ");
-    printZoneInfo(zone_DMA);
-    logf("Normal");
-    printZoneInfo(zone_normal);
+    zeroStats(stats);
+    traceLatency(stats->latency);
 }
 
-/* -------------------- UTIL FUNCTION DEFINITIONS ----------------------- */
+/*
+    Register the client that moves movable blocks for compaction, or turn
+    compaction off with NULL. See pmm_migrate_t.
+*/
+void pmm_set_migrate(pmm_migrate_t migrate)
+{
+    __atomic_store_n(&migrateBlock, migrate, __ATOMIC_RELEASE);
+}
 
-/* 
-    Mark the space used by the kernel and the pmm structures as reserved.
-    This creates some free blocks. Mark them and add the count of free 
-    blocks to their respective buddies.
+/*
+    Register the client that gives back memory cached above the pmm when an
+    allocation is about to fail, or remove it with NULL. See pmm_reclaim_t.
 */
-void reserve_kernel()
+void pmm_set_reclaim(pmm_reclaim_t reclaim)
 {
-    logf("Reserving kernel\n-----------------\n");
+    __atomic_store_n(&reclaimMemory, reclaim, __ATOMIC_RELEASE);
+}
 
-    uint32_t resStart = (uint32_t)kernel_start - VIRTUAL_KERNEL_OFFSET;
-    uint32_t resEnd = (uint32_t)kernel_end + zone_DMA->zonePhysicalSize + zone_normal->zonePhysicalSize - 1 - VIRTUAL_KERNEL_OFFSET;
-    uint32_t startOffset = 0, endOffSet = 0;
+/*
+    Compact every NORMAL and HIGH pool of every node: blocks of movable 
+    pageblocks are moved from the top of each pool into free blocks at the
+    bottom, for as long as there is a free block below the one to move, so
+    that the free memory gathers at the top in large blocks. This CPU's 
+    caches are drained first, blocks cached by other CPUs look allocated 
+    and are left to the client to turn down. Returns the number of blocks
+    moved, 0 without a migrate client.
+*/
+uint32_t pmm_compact(void)
+{
+    PMM_TRACE_START(start);
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    uint32_t moved = 0;
 
-    struct buddy *currentBuddy;
-    struct pool *currentPool;
-    currentPool = zone_normal->poolStart;
+    if (__atomic_load_n(&migrateBlock, __ATOMIC_ACQUIRE) == NULL)
+        return 0;
 
-    logf("Kernel start: %x\tKernel End: %x\n", resStart, resEnd);
-    while (currentPool != NULL)
-    {
-        // identify the pool that contains the kernel and pmm structures
-        if (currentPool->start <= resStart && resStart < (uint32_t)currentPool->start + (currentPool->freeBlocks * BLOCK_SIZE))
+    pmm_pcp_drain();
+    for (uint32_t node = 0; node < nodeCount; node++)
+        for (uint32_t i = 0; i < 2; i++)
         {
-            logf("Pool @ %x\tStart : %x\tSize:%x\n", currentPool, currentPool->start, (currentPool->freeBlocks * BLOCK_SIZE));
-
-            // Reserve the coresponding blocks in the highest order buddy
-            currentBuddy = currentPool->poolBuddiesTop;
-            startOffset = getBitOffset(currentPool->start, resStart, (currentBuddy->buddyOrder * BLOCK_SIZE));
-            endOffSet = getBitOffset(currentPool->start, resEnd, (currentBuddy->buddyOrder * BLOCK_SIZE));
-            logf("Order: %d\tFreeBlocks: %x\tMaxFree: %x\n", currentBuddy->buddyOrder, currentBuddy->freeBlocks, currentBuddy->maxFreeBlocks);
-            logf("\tStart Block: %d\tEnd Block: %d\n", startOffset, endOffSet);
-            set_bits(currentBuddy->bitMap, startOffset, endOffSet);
-            currentBuddy->freeBlocks -= (endOffSet - startOffset + 1); // reduce the number of free blocks
-            logf("\n------------------------------------------------------\n\n");
-            return;
+            struct zone *zone = (i == 0) ? pmm_nodes[node].high : pmm_nodes[node].normal;
+            for (struct pool *currentPool = zone->poolStart; currentPool != NULL; currentPool = currentPool->nextPool)
+                moved += compactPool(zone, currentPool, NULL, cpu);
         }
-        currentPool = currentPool->nextPool;
-    }
-
-    logf("\n------------------------------------------------------\n\n");
-}
 
-void set_bit(uint32_t *mapStart, uint32_t offset)
-{
-    mapStart[offset / 32] |= 1 << (offset % 32);
+    STAT_ADD(cpu->compactions, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_COMPACT, 0, moved, start);
+    return moved;
 }
 
-void set_bits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd)
+/*
+    Allocate a block of 2^order pages, aligned to its size, for a huge 
+    page mapping: 2 MB at order 9, 4 MB at order 10, 1 GB at order 18. The
+    block comes from the reserve set aside at boot for that order while it
+    has any, and from the zones like a PMM_UNMOVABLE pmm_alloc after that,
+    compacting for it if need be. Returns 0 if there is no such block.
+*/
+phys_addr_t pmm_alloc_huge(uint32_t order)
 {
-    uint32_t i;
-    // set bit by bit until we reach the start of a word
-    for (i = offsetStart; i <= offsetEnd && i % 32 != 0; i++)
-        set_bit(mapStart, i);
+    PMM_TRACE_START(start);
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    struct huge_reserve *reserve;
+    phys_addr_t address = 0;
 
-    // set word by word, until a word would be too big for offsetEnd
-    for (; i + 32 <= offsetEnd; i = i + 32)
-        mapStart[i / 32] = 0xFFFFFFFF;
+    if (order <= PMM_MAX_ORDER)
+    {
+        reserve = &hugeReserve[order];
+        spin_lock(&hugeLock);
+        if (reserve->free > 0)
+            address = reserve->blocks[--reserve->free];
+        spin_unlock(&hugeLock);
+        if (address != 0)
+            markCached(&address, 1, false);
+
+        if (address == 0)
+            address = allocPages(cpu, 1u << order, PMM_UNMOVABLE);
+    }
 
-    // set bit by bit until the end
-    for (; i <= offsetEnd; i++)
-        set_bit(mapStart, i);
+    STAT_ADD(cpu->allocCalls, 1);
+    if (address == 0)
+        STAT_ADD(cpu->allocFails, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_ALLOC_HUGE, address, order, start);
+    return address;
 }
 
-void unset_bit(uint32_t *mapStart, uint32_t offset)
+/*
+    Release a block of pmm_alloc_huge. It refills the reserve of its order
+    if that is short of what it was set to, else it goes back to its zone.
+*/
+void pmm_free_huge(phys_addr_t address, uint32_t order)
 {
-    mapStart[offset / 32] &= ~(1 << (offset % 32));
+    PMM_TRACE_START(start);
+    struct huge_reserve *reserve;
+    bool kept = false;
+
+    if (order > PMM_MAX_ORDER)
+        return;
+    if (!claimFree(address, 1u << order))
+        return;
+
+    reserve = &hugeReserve[order];
+    spin_lock(&hugeLock);
+    if (reserve->free < reserve->count)
+    {
+        reserve->blocks[reserve->free++] = address;
+        kept = true;
+    }
+    spin_unlock(&hugeLock);
+
+    if (!kept)
+        freeToZones(&address, 1, 1u << order);
+    STAT_ADD(cpuNodes[pmm_cpu_id()].freeCalls, 1);
+    PMM_TRACE_EVENT(PMM_EVENT_FREE_HUGE, address, order, start);
 }
 
-void unset_bits(uint32_t *mapStart, uint32_t offsetStart, uint32_t offsetEnd)
+/*
+    Set aside count blocks of 2^order pages at boot for pmm_alloc_huge, 
+    before memory gets too fragmented to find them. They are taken after 
+    the kernel is reserved, larger orders first, and stay allocated as far
+    as the zones are concerned. Must be called before init_pmm; returns 
+    false for an order above PMM_MAX_ORDER.
+*/
+bool pmm_set_huge_reserve(uint32_t order, uint32_t count)
 {
-    uint32_t i;
-    // unset bit by bit until we reach the start of a word
-    for (i = offsetStart; i <= offsetEnd && i % 32 != 0; i++)
-        unset_bit(mapStart, i);
-
-    // set word by word, until a word would be too big for offsetEnd
-    for (; i + 32 <= offsetEnd; i = i + 32)
-        mapStart[i / 32] = 0;
-
-    // set bit by bit until the end
-    for (; i <= offsetEnd; i++)
-        unset_bit(mapStart, i);
+    if (order > PMM_MAX_ORDER)
+        return false;
+    hugeReserve[order].count = count;
+    return true;
 }
 
-bool test_bit(uint32_t *mapStart, uint32_t offset)
+void init_pmm(multiboot_info_t *mbtStructure)
 {
-    return (mapStart[offset / 32] & (1 << (offset % 32)));
+    init_pmm_numa(mbtStructure, NULL, 0);
 }
 
 /*
-    Creates structures and initializes bitmaps for the buddies of a given pool.  
-    The blocks of the highest order are all set to available, while the lower 
-    order ones have all their blocks set to reserved (but the ones that do not 
-    belong to a larger parent block are set to available).
+    Build the zones from the memory map, with a NORMAL and a HIGH zone for
+    every node of the node table. Pools are split where the table moves to
+    another node, so that each pool belongs to exactly one node.
 */
-void makeBuddies(struct pool *pool)
+void init_pmm_numa(multiboot_info_t *mbtStructure, const struct pmm_node_range *ranges, uint32_t rangeCount)
 {
-    struct buddy *currentBuddy;
-    struct buddy *previousBuddy = NULL;
-    for (uint8_t i = MAX_BLOCK_ORDER; i > 0; i = i >> 1)
+    struct mmap_entry_t *section;
+    struct zone *zone;
+    phys_addr_t base, length, skip, poolBytes;
+    uint32_t node;
+
+    // make sure we have a valid memory map - 6th bit of flags indicates whether the mmap_addr & mmp_length fields are valid
+    if (!(mbtStructure->flags & MBT_FLAG_IS_MMAP))
     {
-        currentBuddy = (struct buddy *)((uint32_t)pool + pool->poolPhysicalSize); // put the current buddy right after the previous structures
-        currentBuddy->buddyOrder = i;                                             // buddy order in terms of powers of 2
-        currentBuddy->maxFreeBlocks = pool->freeBlocks / i;                       // max possible allocations for this order
-        currentBuddy->freeBlocks = (previousBuddy == NULL) ? currentBuddy->maxFreeBlocks : currentBuddy->maxFreeBlocks - (previousBuddy->maxFreeBlocks * 2);
-        currentBuddy->mapWordCount = (currentBuddy->maxFreeBlocks / 32) + (currentBuddy->maxFreeBlocks % 32 != 0);
-        currentBuddy->bitMap = (uint32_t *)((uint32_t)pool + pool->poolPhysicalSize + sizeof(struct buddy));
-        currentBuddy->nextBuddy = NULL;
+        logf("[PMM] : No memory map available\n");
+        abort();
+    }
+
+    keepBootMap(mbtStructure);
+
+    // keep a copy of the node table, pools are split along it
+    nodeRangeCount = 0;
+    nodeCount = 1;
+    for (uint32_t i = 0; i < rangeCount; i++)
+    {
+        if (ranges[i].node >= PMM_MAX_NODES || nodeRangeCount == PMM_MAX_NODE_RANGES)
+        {
+            logf("[PMM] : Dropping node table entry %d, its memory goes to node 0\n", i);
+            continue;
+        }
+        nodeRanges[nodeRangeCount++] = ranges[i];
+        if (ranges[i].node >= nodeCount)
+            nodeCount = ranges[i].node + 1;
+    }
 
-        pool->poolPhysicalSize += sizeof(struct buddy) + (currentBuddy->mapWordCount * 4);
+    // Zone headers go right after the kernel: DMA, then NORMAL and HIGH of every node
+    metadataEnd = kernel_end;
+    zoneCount = 0;
+    zone_DMA = newZone(0, 0);
+    for (node = 0; node < nodeCount; node++)
+    {
+        pmm_nodes[node].normal = newZone(1, node);
+        pmm_nodes[node].high = newZone(2, node);
+        pmm_nodes[node].fallbackCount = nodeCount - 1;
+        for (uint32_t i = 0; i < nodeCount - 1; i++)
+            pmm_nodes[node].fallback[i] = (node + 1 + i) % nodeCount;
+    }
 
-        // if maxFreeBlocks is equal to the actual number of free blocks, this is the highest order buddy
-        if (currentBuddy->maxFreeBlocks == currentBuddy->freeBlocks)
-            memset(currentBuddy->bitMap, 0, currentBuddy->mapWordCount * 4); // set entire region to available
+    // every CPU starts local to node 0, see pmm_set_cpu_node
+    memset(cpuNodes, 0, sizeof(cpuNodes));
 
-        // else, this is a lower order buddy - an extra block at the end might be available
-        else
+    // go through the memory map from the multiboot info structure
+    section = (struct mmap_entry_t *)(mbtStructure->mmap_addr + VIRTUAL_KERNEL_OFFSET);
+    while (section < (struct mmap_entry_t *)(mbtStructure->mmap_addr + mbtStructure->mmap_length + VIRTUAL_KERNEL_OFFSET))
+    {
+        // Skip reserved sections
+        if (section->type != 1)
+        {
+            section = (struct mmap_entry_t *)((uintptr_t)section + (uint32_t)section->size + sizeof(section->size));
+            continue;
+        }
+
+        // Start every pool on a page, newPool aligns its blocks
+        base = SECTION_BASE(section);
+        length = SECTION_LENGTH(section);
+        skip = ALIGN_UP_PHYS(base, BLOCK_SIZE) - base;
+        if (skip + BLOCK_SIZE > length)
         {
-            memset(currentBuddy->bitMap, 0xFF, currentBuddy->mapWordCount * 4); // set entire region to reserved
-            // check if a block at the end is actually available
-            if (currentBuddy->freeBlocks > 0)
-                unset_bit(currentBuddy->bitMap, (currentBuddy->maxFreeBlocks - currentBuddy->freeBlocks)); // set that one last directly usable block to 0
+            section = (struct mmap_entry_t *)((uintptr_t)section + (uint32_t)section->size + sizeof(section->size));
+            continue;
         }
+        advanceSection(section, skip);
+        base += skip;
+        length -= skip;
 
-        // linked list stuff
-        if (pool->poolBuddiesTop == NULL)
+        // If we're done with the DMA, add the section as a NORMAL zone pool of its node, or a HIGH one from 4G up
+        if (base > DMA_MAX_ADDRESS || zone_DMA->freeBlocks >= DMA_TOTAL_BLOCKS)
         {
-            pool->poolBuddiesTop = currentBuddy;
-            currentBuddy->prevBuddy = NULL;
+            // A pool can't span two nodes or both sides of 4G, the rest of the section is added on the next pass
+            poolBytes = length;
+            node = nodeForRange(base, &poolBytes);
+            if (base < HIGH_MEMORY_START && base + poolBytes > HIGH_MEMORY_START)
+                poolBytes = HIGH_MEMORY_START - base;
+
+            zone = (base >= HIGH_MEMORY_START) ? pmm_nodes[node].high : pmm_nodes[node].normal;
+            if (poolBytes >= BLOCK_SIZE)
+                newPool(zone, base, poolBytes / BLOCK_SIZE);
+
+            if (poolBytes < length)
+                advanceSection(section, poolBytes);
+            else
+                section = (struct mmap_entry_t *)((uintptr_t)section + (uint32_t)section->size + sizeof(section->size));
         }
+        // else, add the current section as a DMA pool either entirely or partially
         else
         {
-            previousBuddy->nextBuddy = currentBuddy;
-            currentBuddy->prevBuddy = previousBuddy;
+            // Make a decision on how much of the current section is to be added as DMA pool
+            if ((length / BLOCK_SIZE) <= (DMA_TOTAL_BLOCKS - zone_DMA->freeBlocks) && (base + length - 1) <= DMA_MAX_ADDRESS)
+            {
+                // Adding the entire section as a pool
+                newPool(zone_DMA, base, length / BLOCK_SIZE);
+                section = (struct mmap_entry_t *)((uintptr_t)section + section->size + sizeof(section->size));
+            }
+            else if ((DMA_MAX_ADDRESS - base + 1) / BLOCK_SIZE < (DMA_TOTAL_BLOCKS - zone_DMA->freeBlocks))
+            {
+                // Adding a partial section because of the 16MB condition
+                newPool(zone_DMA, base, (DMA_MAX_ADDRESS - base + 1) / BLOCK_SIZE);
+                advanceSection(section, DMA_MAX_ADDRESS - base + 1);
+            }
+            else
+            {
+                // Adding a partial section because the 256KB condition
+                advanceSection(section, DMA_TOTAL_BYTES - (zone_DMA->freeBlocks * BLOCK_SIZE));
+                newPool(zone_DMA, base, DMA_TOTAL_BLOCKS - zone_DMA->freeBlocks);
+            }
         }
-        previousBuddy = currentBuddy;
     }
-    pool->poolBuddiesBottom = currentBuddy;
+
+    // so are the pool ranges and the huge page reserve
+    buildPoolRanges();
+    for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+    {
+        hugeReserve[order].blocks = (phys_addr_t *)ALIGN_UP(metadataEnd, 8);
+        hugeReserve[order].free = 0;
+        metadataEnd = (uintptr_t)(hugeReserve[order].blocks + hugeReserve[order].count);
+    }
+
+    // Mark kernel and pmm spaces as reserved and hand everything else to the buddies
+    reserve_kernel();
+    pcpInit();
+    zeroInit();
+    fillHugeReserve();
+
+#ifdef PMM_DEBUG
+    // log pmm structures
+    for (uint32_t i = 0; i < zoneCount; i++)
+    {
+        logf("%s (node %d) ", (zones[i]->zoneType == 0) ? "DMA" : (zones[i]->zoneType == 1) ? "Normal" : "High", zones[i]->node);
+        printZoneInfo(zones[i]);
+    }
+#endif
 }
 
-intmax_t findFirstFreeBit(uint32_t *map, uint32_t maxWords)
+// The bytes from the first zone header to the end of the metadata, behind the header of the image
+size_t pmm_state_size(void)
+{
+    return ALIGN_UP(sizeof(struct pmm_state), 64) + (metadataEnd - (uintptr_t)zones[0]);
+}
+
+/*
+    Write the state of the pmm into an image, see state.h. The blocks of 
+    the per-CPU caches and the zero pools are freed first, so only memory
+    that is handed out is allocated in the image. Nothing else may run in
+    the pmm until this returns; the pmm keeps running as before afterwards.
+*/
+bool pmm_save_state(void *image, size_t bytes)
 {
-    uint32_t offset = 0;
-    maxWords *= 32;
-    logf("\n-------------------\nMax offset : %d\n", maxWords);
-    while (offset < maxWords)
+    struct pmm_state *header = image;
+    uintptr_t region = (uintptr_t)zones[0];
+    uint64_t metadataOffset = ALIGN_UP(sizeof(struct pmm_state), 64);
+    intptr_t delta = (intptr_t)(metadataOffset - region); // from an address of the metadata to its offset in the image
+    uint64_t sum = STATE_SUM_SEED;
+
+    if (bytes < pmm_state_size() || ((uintptr_t)image & 63) != 0)
+        return false;
+    pcpDrainAll();
+    zeroRelease();
+
+    memset(header, 0, sizeof(*header));
+    header->magic = PMM_STATE_MAGIC;
+    header->version = PMM_STATE_VERSION;
+    header->headerBytes = sizeof(struct pmm_state);
+    header->imageBytes = pmm_state_size();
+    header->metadataOffset = metadataOffset;
+    header->blockSize = BLOCK_SIZE;
+    header->maxOrder = PMM_MAX_ORDER;
+    header->pageblockOrder = PMM_PAGEBLOCK_ORDER;
+    header->mobilityTypes = PMM_MOBILITY_TYPES;
+    header->maxNodes = PMM_MAX_NODES;
+    header->pointerBytes = sizeof(void *);
+
+    header->reservedStart = reservedStart;
+    header->reservedEnd = reservedEnd;
+    header->dmaReserve = __atomic_load_n(&dmaReserve, __ATOMIC_RELAXED);
+    header->bootBlocks = bootBlocks;
+    header->zoneCount = zoneCount;
+    header->nodeCount = nodeCount;
+    header->nodeRangeCount = nodeRangeCount;
+    header->poolRangeCount = poolRangeCount;
+    header->poolRanges = (uintptr_t)poolRanges + delta;
+    for (uint32_t i = 0; i < zoneCount; i++)
+        header->zones[i] = (uintptr_t)zones[i] + delta;
+    for (uint32_t node = 0; node < nodeCount; node++)
     {
-        logf("Offset : %d\n", offset);
-        // find the first non zero word
-        if (map[offset / 32] != 0xFFFFFFFF)
-        {
-            for (; offset < maxWords; offset++)
-            {
-                logf("\tOffset : %d\n", offset);
-                if (test_bit(map, offset) == 0)
-                {
-                    logf("-------------------------\n\n");
-                    return offset;
-                }
-            }
+        header->nodes[node].normal = (uintptr_t)pmm_nodes[node].normal + delta;
+        header->nodes[node].high = (uintptr_t)pmm_nodes[node].high + delta;
+        memcpy(header->nodes[node].fallback, pmm_nodes[node].fallback, sizeof(pmm_nodes[node].fallback));
+        header->nodes[node].fallbackCount = pmm_nodes[node].fallbackCount;
+    }
+    memcpy(header->nodeRanges, nodeRanges, sizeof(nodeRanges));
+    for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+    {
+        header->huge[order].blocks = (uintptr_t)hugeReserve[order].blocks + delta;
+        header->huge[order].count = hugeReserve[order].count;
+        header->huge[order].free = hugeReserve[order].free;
+    }
 
-            printf("Returning -1 : internal\n");
-            logf("-------------------------\n\n");
-            return -1;
-        }
-        offset += 32;
+    // the copy is walked through the pointers of the live metadata, which it still holds until they are relocated
+    memcpy((uint8_t *)image + metadataOffset, (void *)region, metadataEnd - region);
+    walkState(image, delta, false, &sum);
+    header->controlSum = stateSum(sum, STATE_SUMMED(header), STATE_SUMMED_BYTES);
+    header->imageSum = stateSum(STATE_SUM_SEED, (uint8_t *)image + metadataOffset, header->imageBytes - metadataOffset);
+    return true;
+}
+
+/*
+    Start the pmm on an image of pmm_save_state instead of building it from
+    the memory map, see state.h. The image is checked before anything is 
+    changed: the header, the build parameters, the offsets it holds and its
+    control checksum, and with PMM_ADOPT_VERIFY the checksum of all of it.
+    Returns false, with the image and the pmm untouched, if any of them is 
+    off; the caller can fall back to init_pmm then. The counters of the 
+    CPUs, the per-CPU caches and the zero pools start over.
+*/
+bool pmm_adopt_state(void *image, size_t bytes, uint32_t flags)
+{
+    struct pmm_state *header = image;
+    uint64_t sum = STATE_SUM_SEED;
+
+    if (((uintptr_t)image & 63) != 0 || bytes < sizeof(struct pmm_state) || header->magic != PMM_STATE_MAGIC)
+    {
+        logf("[PMM] : No pmm state to adopt\n");
+        return false;
+    }
+    if (header->version != PMM_STATE_VERSION || header->headerBytes != sizeof(struct pmm_state) ||
+        header->blockSize != BLOCK_SIZE || header->maxOrder != PMM_MAX_ORDER || header->pageblockOrder != PMM_PAGEBLOCK_ORDER ||
+        header->mobilityTypes != PMM_MOBILITY_TYPES || header->maxNodes != PMM_MAX_NODES || header->pointerBytes != sizeof(void *))
+    {
+        logf("[PMM] : State of version %d doesn't fit this pmm\n", header->version);
+        return false;
+    }
+    if (header->imageBytes > bytes || header->metadataOffset < sizeof(struct pmm_state) || (header->metadataOffset & 63) != 0 ||
+        header->zoneCount == 0 || header->zoneCount > 1 + 2 * PMM_MAX_NODES || header->nodeCount == 0 || header->nodeCount > PMM_MAX_NODES ||
+        header->nodeRangeCount > PMM_MAX_NODE_RANGES || !STATE_FITS(header, header->poolRanges, header->poolRangeCount * sizeof(struct pool_range)) ||
+        !walkState(image, 0, false, &sum) || stateSum(sum, STATE_SUMMED(header), STATE_SUMMED_BYTES) != header->controlSum)
+    {
+        logf("[PMM] : Pmm state is corrupt\n");
+        return false;
+    }
+    if ((flags & PMM_ADOPT_VERIFY) &&
+        stateSum(STATE_SUM_SEED, (uint8_t *)image + header->metadataOffset, header->imageBytes - header->metadataOffset) != header->imageSum)
+    {
+        logf("[PMM] : Pmm state doesn't match its checksum\n");
+        return false;
+    }
+    if (kernel_start - VIRTUAL_KERNEL_OFFSET < header->reservedStart || kernel_end - 1 - VIRTUAL_KERNEL_OFFSET > header->reservedEnd)
+    {
+        logf("[PMM] : Kernel lies outside the memory the pmm state reserves\n");
+        return false;
+    }
+
+    walkState(image, (intptr_t)image, true, &sum);
+    reservedStart = header->reservedStart;
+    reservedEnd = header->reservedEnd;
+    __atomic_store_n(&dmaReserve, header->dmaReserve, __ATOMIC_RELAXED);
+    bootBlocks = header->bootBlocks;
+    zoneCount = header->zoneCount;
+    for (uint32_t i = 0; i < zoneCount; i++)
+        zones[i] = (struct zone *)STATE_AT(image, header->zones[i]);
+    zone_DMA = zones[0];
+    nodeCount = header->nodeCount;
+    for (uint32_t node = 0; node < nodeCount; node++)
+    {
+        pmm_nodes[node].normal = (struct zone *)STATE_AT(image, header->nodes[node].normal);
+        pmm_nodes[node].high = (struct zone *)STATE_AT(image, header->nodes[node].high);
+        memcpy(pmm_nodes[node].fallback, header->nodes[node].fallback, sizeof(pmm_nodes[node].fallback));
+        pmm_nodes[node].fallbackCount = header->nodes[node].fallbackCount;
+    }
+    nodeRangeCount = header->nodeRangeCount;
+    memcpy(nodeRanges, header->nodeRanges, sizeof(nodeRanges));
+    poolRangeCount = header->poolRangeCount;
+    poolRanges = (struct pool_range *)STATE_AT(image, header->poolRanges);
+    spin_lock_init(&hugeLock);
+    for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+    {
+        hugeReserve[order].blocks = (phys_addr_t *)STATE_AT(image, header->huge[order].blocks);
+        hugeReserve[order].count = header->huge[order].count;
+        hugeReserve[order].free = header->huge[order].free;
+    }
+    metadataEnd = (uintptr_t)image + header->imageBytes;
+    bootMapCount = 0; // recordings describe the memory of the pools instead
+
+    memset(cpuNodes, 0, sizeof(cpuNodes));
+    pcpInit();
+    zeroInit();
+    return true;
+}
+
+/* -------------------- UTIL FUNCTION DEFINITIONS ----------------------- */
+
+// Take the blocks of the huge page reserve, largest first so that the small orders don't break them up
+void fillHugeReserve(void)
+{
+    struct huge_reserve *reserve;
+
+    for (uint32_t order = PMM_MAX_ORDER + 1; order-- > 0;)
+    {
+        reserve = &hugeReserve[order];
+        if (reserve->count == 0)
+            continue;
+        reserve->free = allocFromZones(1u << order, reserve->blocks, reserve->count, PMM_UNMOVABLE);
+        markCached(reserve->blocks, reserve->free, true);
+        if (reserve->free < reserve->count)
+            logf("[PMM] : Huge page reserve of order %d is %d blocks short\n", order, reserve->count - reserve->free);
+    }
+}
+
+/*
+    Take up to count blocks of the given size (a power of two) from the 
+    pools of a zone. Pools are picked by their free counters without 
+    locking, and each pool is locked only while blocks are taken from it.
+    Returns how many were taken; their physical addresses are stored in out.
+    Takes that fall short count as a failure of the zone.
+*/
+uint32_t zoneAllocBlocks(struct zone *zone, uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t type)
+{
+    struct pool *currentPool;
+    struct buddy *target;
+    uint32_t taken = 0, poolTaken, scanned = 0;
+
+    // a zone without any memory, like the HIGH zone below 4 GB, isn't failing
+    if (COUNTER_READ(zone->freeBlocks) < blocks)
+    {
+        if (zone->poolStart != NULL)
+            COUNTER_ADD(zone->fails, 1);
+        return 0;
+    }
+
+    currentPool = zone->poolStart;
+    while (currentPool != NULL && taken < count)
+    {
+        // pools too small for a block of that order are skipped
+        if (COUNTER_READ(currentPool->freeBlocks) >= blocks && currentPool->poolBuddiesTop->size >= blocks)
+        {
+            target = buddyForBlocks(currentPool, blocks);
+            scanned++;
+
+            spin_lock(&currentPool->lock);
+            poolTaken = allocBlocks(currentPool, target, out + taken, count - taken, type);
+            spin_unlock(&currentPool->lock);
+
+            if (poolTaken)
+            {
+                COUNTER_SUB(zone->freeBlocks, poolTaken * target->size);
+                taken += poolTaken;
+            }
+        }
+        currentPool = currentPool->nextPool;
+    }
+
+    STAT_ADD(cpuNodes[pmm_cpu_id()].poolScans, scanned);
+    if (taken < count)
+        COUNTER_ADD(zone->fails, 1);
+    return taken;
+}
+
+// Allocate a block of blocks pages (a power of two) for pmm_alloc, 0 if there is none
+phys_addr_t allocPages(struct pmm_cpu_node *cpu, uint32_t blocks, uint32_t type)
+{
+    pmm_reclaim_t reclaim = __atomic_load_n(&reclaimMemory, __ATOMIC_ACQUIRE);
+    uint32_t reclaimed;
+    phys_addr_t address;
+
+    // the per-CPU caches are filled from the local node
+    if (blocks <= PCP_MAX_BLOCKS && cpu->policy == PMM_POLICY_LOCAL && (address = pcpAlloc(blocks, type)) != 0)
+        return address;
+
+    if (allocFromZones(blocks, &address, 1, type) == 1)
+        return address;
+
+    // blocks sitting in this CPU's caches and the zero pools can't merge - give them back and try again
+    pmm_pcp_drain();
+    zeroRelease();
+    if (allocFromZones(blocks, &address, 1, type) == 1)
+        return address;
+
+    // the same goes for free memory held above the pmm, like empty slabs
+    if (reclaim != NULL && (reclaimed = reclaim(blocks)) > 0)
+    {
+        STAT_ADD(cpu->reclaimed, reclaimed);
+        pmm_pcp_drain();
+        if (allocFromZones(blocks, &address, 1, type) == 1)
+            return address;
+    }
+
+    // the memory may be there, just in pieces: move movable blocks out of the way
+    if (blocks > 1 && compactNodes(cpu, blocks) > 0 && allocFromZones(blocks, &address, 1, type) == 1)
+        return address;
+
+    // keep the DMA zone for the drivers that need it, only spill into what is above the reserve
+    if (cpu->policy != PMM_POLICY_BIND && COUNTER_READ(zone_DMA->freeBlocks) >= __atomic_load_n(&dmaReserve, __ATOMIC_RELAXED) + blocks &&
+        zoneAllocBlocks(zone_DMA, blocks, &address, 1, type) == 1)
+        return address;
+
+    return 0;
+}
+
+/*
+    The body of pmm_alloc_type for a known mobility type, counted in the 
+    stats but not traced, for pmm_alloc_zeroed to call on a miss and trace
+    the call itself.
+*/
+phys_addr_t allocRequest(uint32_t request, uint32_t type)
+{
+    uint32_t pages = CEIL(request, BLOCK_SIZE);
+    phys_addr_t address = 0;
+
+    if (request != 0 && pages <= MAX_ALLOC_BLOCKS)
+        address = allocPages(&cpuNodes[pmm_cpu_id()], ROUND_UP_POW2(pages), type);
+    countAlloc(address);
+    return address;
+}
+
+// Count an allocation call of the calling CPU, failed if address is 0
+void countAlloc(phys_addr_t address)
+{
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+
+    STAT_ADD(cpu->allocCalls, 1);
+    if (address == 0)
+        STAT_ADD(cpu->allocFails, 1);
+}
+
+void countFree(void)
+{
+    STAT_ADD(cpuNodes[pmm_cpu_id()].freeCalls, 1);
+}
+
+/*
+    Take up to count blocks of the given size (a power of two) from the 
+    nodes the policy of the calling CPU picks, which is what every 
+    allocation that doesn't ask for DMA memory or a node is served from. 
+    Interleaving moves to the next node after every block. Returns how 
+    many were taken.
+*/
+uint32_t allocFromZones(uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t type)
+{
+    struct pmm_cpu_node *cpu = &cpuNodes[pmm_cpu_id()];
+    uint32_t taken, node;
+
+    if (cpu->policy == PMM_POLICY_INTERLEAVE)
+    {
+        for (taken = 0; taken < count; taken++)
+        {
+            node = cpu->nextInterleave;
+            cpu->nextInterleave = (node + 1 < nodeCount) ? node + 1 : 0;
+            if (allocFromNode(cpu, node, blocks, out + taken, 1, PMM_POLICY_INTERLEAVE, type) == 0)
+                break;
+        }
+        return taken;
+    }
+
+    node = (cpu->policy == PMM_POLICY_BIND) ? cpu->bindNode : cpu->node;
+    return allocFromNode(cpu, node, blocks, out, count, cpu->policy, type);
+}
+
+/*
+    Take up to count blocks from a node and, unless the policy is 
+    PMM_POLICY_BIND, from the nodes of its fallback order once it runs out.
+    The blocks are counted in the stats of the calling CPU.
+*/
+uint32_t allocFromNode(struct pmm_cpu_node *cpu, uint32_t node, uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t policy, uint32_t type)
+{
+    uint32_t tries = (policy == PMM_POLICY_BIND) ? 1 : pmm_nodes[node].fallbackCount + 1;
+    uint32_t taken = 0, got, from;
+
+    for (uint32_t i = 0; i < tries && taken < count; i++)
+    {
+        from = (i == 0) ? node : pmm_nodes[node].fallback[i - 1];
+        got = nodeAllocBlocks(from, blocks, out + taken, count - taken, type);
+        if (got == 0)
+            continue;
+
+        if (from == node)
+            STAT_ADD(cpu->stats[node].hit, got * blocks);
+        else
+        {
+            STAT_ADD(cpu->stats[from].miss, got * blocks);
+            STAT_ADD(cpu->stats[node].foreign, got * blocks);
+        }
+        if (policy == PMM_POLICY_INTERLEAVE)
+            STAT_ADD(cpu->stats[from].interleave, got * blocks);
+        taken += got;
+    }
+    return taken;
+}
+
+// Take up to count blocks from the HIGH and then the NORMAL zone of a node
+uint32_t nodeAllocBlocks(uint32_t node, uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t type)
+{
+    uint32_t taken = zoneAllocBlocks(pmm_nodes[node].high, blocks, out, count, type);
+    if (taken < count)
+        taken += zoneAllocBlocks(pmm_nodes[node].normal, blocks, out + taken, count - taken, type);
+    return taken;
+}
+
+/*
+    Give count blocks of the given size back to the zones they belong to.
+    Each run of addresses from the same zone is handed to zoneFreeBlocks in
+    one go.
+*/
+void freeToZones(phys_addr_t *addresses, uint32_t count, uint32_t blocks)
+{
+    struct zone *zone;
+    uint32_t run;
+
+    for (uint32_t i = 0; i < count; i += run)
+    {
+        zone = zoneForAddress(addresses[i]);
+        for (run = 1; i + run < count && zoneForAddress(addresses[i + run]) == zone; run++)
+            ;
+        if (zone != NULL)
+            zoneFreeBlocks(zone, addresses + i, run, blocks);
+        else
+            badFree(&cpuNodes[pmm_cpu_id()], addresses[i], blocks);
+    }
+}
+
+// Zone whose pools manage the given physical address, NULL if none
+struct zone *zoneForAddress(phys_addr_t address)
+{
+    const struct pool_range *range = rangeForAddress(address);
+    return (range != NULL) ? range->zone : NULL;
+}
+
+// Pool range that holds the given physical address, a binary search of poolRanges
+const struct pool_range *rangeForAddress(phys_addr_t address)
+{
+    uint32_t low = 0, high = poolRangeCount, middle;
+
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (address < poolRanges[middle].start)
+            high = middle;
+        else if (address >= poolRanges[middle].end)
+            low = middle + 1;
+        else
+            return &poolRanges[middle];
+    }
+    return NULL;
+}
+
+/*
+    Node of the memory at base, and in bytes how much of the memory from 
+    there stays on that node: up to the end of its range, or up to where 
+    the next range starts if base isn't covered by any.
+*/
+uint32_t nodeForRange(phys_addr_t base, phys_addr_t *bytes)
+{
+    phys_addr_t end = base + *bytes, rangeEnd;
+    uint32_t node = 0;
+
+    for (uint32_t i = 0; i < nodeRangeCount; i++)
+    {
+        rangeEnd = nodeRanges[i].base + nodeRanges[i].length;
+        if (nodeRanges[i].base <= base && base < rangeEnd)
+        {
+            node = nodeRanges[i].node;
+            if (rangeEnd < end)
+                end = rangeEnd;
+        }
+        else if (nodeRanges[i].base > base && nodeRanges[i].base < end)
+            end = nodeRanges[i].base;
+    }
+    *bytes = end - base;
+    return node;
+}
+
+/*
+    Mobility type of the pageblock an address is in, for pmm_free to pick 
+    the per-CPU cache the block goes to. Read without locking, a block freed
+    while its pageblock changes hands may end up with the old type.
+*/
+uint32_t mobilityOf(struct zone *zone, phys_addr_t address)
+{
+    struct pool *pool = poolForAddress(zone, address);
+
+    if (pool == NULL)
+        return PMM_UNMOVABLE;
+    return __atomic_load_n(&PAGEBLOCK_TYPES(pool)[getBitOffset(pool->start, address, BLOCK_SIZE) / PMM_PAGEBLOCK_BLOCKS], __ATOMIC_RELAXED);
+}
+
+uint32_t blockMobility(phys_addr_t address)
+{
+    const struct pool_range *range = rangeForAddress(address);
+
+    if (range == NULL)
+        return PMM_MOBILITY_TYPES;
+    return __atomic_load_n(&PAGEBLOCK_TYPES(range->pool)[getBitOffset(range->pool->start, address, BLOCK_SIZE) / PMM_PAGEBLOCK_BLOCKS], __ATOMIC_RELAXED);
+}
+
+// Pool of a zone that manages the given physical address, NULL if none
+struct pool *poolForAddress(struct zone *zone, phys_addr_t address)
+{
+    const struct pool_range *range = rangeForAddress(address);
+    return (range != NULL && range->zone == zone) ? range->pool : NULL;
+}
+
+/*
+    Lay out an entry per pool after the metadata so far and sort them by
+    address. The real ranges of the pools, from firstBlock on, never 
+    overlap.
+*/
+void buildPoolRanges(void)
+{
+    struct pool_range range;
+    uint32_t i;
+
+    poolRanges = (struct pool_range *)ALIGN_UP(metadataEnd, 8);
+    poolRangeCount = 0;
+    for (uint32_t z = 0; z < zoneCount; z++)
+        for (struct pool *pool = zones[z]->poolStart; pool != NULL; pool = pool->nextPool)
+        {
+            range.start = pool->start + ((phys_addr_t)pool->firstBlock * BLOCK_SIZE);
+            range.end = pool->start + ((phys_addr_t)pool->totalBlocks * BLOCK_SIZE);
+            range.pool = pool;
+            range.zone = zones[z];
+            for (i = poolRangeCount++; i > 0 && poolRanges[i - 1].start > range.start; i--)
+                poolRanges[i] = poolRanges[i - 1];
+            poolRanges[i] = range;
+        }
+    metadataEnd = (uintptr_t)(poolRanges + poolRangeCount);
+}
+
+void badFree(struct pmm_cpu_node *cpu, phys_addr_t address, uint32_t blocks)
+{
+    logf("[PMM] : Dropping a free of %d blocks at %x:%x, not a block the pmm handed out\n", blocks, PHYS_HALVES(address));
+    STAT_ADD(cpu->badFrees, 1);
+}
+
+#ifdef PMM_CHECK_FREE
+/*
+    Check a block being freed against the byte its pool keeps for it in 
+    ALLOC_ORDERS, and flag it as on its way back, so that a second free of
+    it fails even when the two race. blocks is the size it is freed at. 
+    Turns down addresses the pmm doesn't manage, that aren't the start of a
+    block that is handed out right now (never allocated, in the middle of 
+    a block, freed already or sitting in a cache) and blocks handed out at
+    another size. A load, a few compares and a compare-and-swap of a byte
+    that the free touches anyway.
+*/
+bool checkFree(const struct pool_range *range, phys_addr_t address, uint32_t blocks)
+{
+    uint8_t *entry, seen;
+
+    if (range == NULL || address % BLOCK_SIZE != 0)
+        return false;
+    entry = &ALLOC_ORDERS(range->pool)[getBitOffset(range->pool->start, address, BLOCK_SIZE)];
+    seen = __atomic_load_n(entry, __ATOMIC_RELAXED);
+    if (seen == 0 || (seen & ORDER_CACHED) != 0 || blocks != 1u << ORDER_OF(seen))
+        return false;
+    return __atomic_compare_exchange_n(entry, &seen, seen | ORDER_CACHED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+#endif
+
+/*
+    Claim a block being freed, dropping and counting the free if it is 
+    bad. With PMM_CHECK_FREE that is checkFree, for every free. Otherwise
+    only pmm_free_huge and pmm_free_zeroed claim their blocks, since they
+    may keep them in a reserve or pool: the size is trusted, but the block
+    has to be handed out right now, and it is flagged with the same 
+    compare-and-swap as a size 0 pmm_free, so it can't go in twice.
+*/
+bool claimFree(phys_addr_t address, uint32_t blocks)
+{
+    const struct pool_range *range = rangeForAddress(address);
+#ifdef PMM_CHECK_FREE
+    if (checkFree(range, address, blocks))
+        return true;
+#else
+    uint8_t *entry, seen;
+
+    if (range != NULL && address % BLOCK_SIZE == 0)
+    {
+        entry = &ALLOC_ORDERS(range->pool)[getBitOffset(range->pool->start, address, BLOCK_SIZE)];
+        seen = __atomic_load_n(entry, __ATOMIC_RELAXED);
+        if (seen != 0 && (seen & ORDER_CACHED) == 0 &&
+            __atomic_compare_exchange_n(entry, &seen, seen | ORDER_CACHED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return true;
+    }
+#endif
+    badFree(&cpuNodes[pmm_cpu_id()], address, blocks);
+    return false;
+}
+
+// Set or clear ORDER_CACHED of blocks that go into a cache or out to a caller
+void markCached(phys_addr_t *addresses, uint32_t count, bool cached)
+{
+    const struct pool_range *range;
+    uint8_t *entry;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        range = rangeForAddress(addresses[i]);
+        entry = &ALLOC_ORDERS(range->pool)[getBitOffset(range->pool->start, addresses[i], BLOCK_SIZE)];
+        if (cached)
+            __atomic_fetch_or(entry, ORDER_CACHED, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(entry, (uint8_t)~ORDER_CACHED, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+    Give count blocks of the given size back to the pools of a zone. The 
+    owning pool stays locked for as long as consecutive addresses belong to
+    it, and its counters are updated once when it is let go. A run of 
+    adjacent addresses, like the ones pmm_alloc_bulk hands out, is freed as
+    the largest aligned blocks it covers instead of merging block by block.
+*/
+void zoneFreeBlocks(struct zone *zone, phys_addr_t *addresses, uint32_t count, uint32_t blocks)
+{
+    struct pool *currentPool = NULL;
+    struct buddy *level = NULL;
+    int32_t levelFree[BUDDY_LEVELS];
+    uint32_t poolFreed = 0, zoneFreed = 0, run, first;
+
+    for (uint32_t i = 0; i < count; i += run)
+    {
+        run = 1;
+        if (currentPool == NULL || !POOL_CONTAINS(currentPool, addresses[i]))
+        {
+            if (currentPool != NULL)
+            {
+                applyLevelFree(currentPool, levelFree);
+                COUNTER_ADD(currentPool->freeBlocks, poolFreed);
+                spin_unlock(&currentPool->lock);
+                zoneFreed += poolFreed;
+            }
+
+            currentPool = poolForAddress(zone, addresses[i]);
+            if (currentPool == NULL)
+            {
+                logf("[zoneFreeBlocks] : Address %x:%x doesn't belong to the zone\n", PHYS_HALVES(addresses[i]));
+                continue;
+            }
+
+            level = buddyForBlocks(currentPool, blocks);
+            memset(levelFree, 0, sizeof(levelFree));
+            poolFreed = 0;
+            spin_lock(&currentPool->lock);
+        }
+
+        while (i + run < count && addresses[i + run] == addresses[i] + ((phys_addr_t)run * blocks * BLOCK_SIZE) &&
+               addresses[i + run] < currentPool->start + ((phys_addr_t)currentPool->totalBlocks * BLOCK_SIZE))
+            run++;
+
+        first = getBitOffset(currentPool->start, addresses[i], BLOCK_SIZE);
+        for (uint32_t j = 0; j < run; j++)
+            ALLOC_ORDERS(currentPool)[first + j * blocks] = 0;
+        if (run == 1)
+            freeBlock(currentPool, level, first / level->size, levelFree);
+        else
+            freeRange(currentPool, first, first + (run * blocks) - 1, levelFree);
+        poolFreed += run * blocks;
+        STAT_ADD(level->stats.frees, run);
+    }
+
+    if (currentPool != NULL)
+    {
+        applyLevelFree(currentPool, levelFree);
+        COUNTER_ADD(currentPool->freeBlocks, poolFreed);
+        spin_unlock(&currentPool->lock);
+        zoneFreed += poolFreed;
+    }
+    COUNTER_ADD(zone->freeBlocks, zoneFreed);
+}
+
+/* 
+    Mark the space used by the kernel and the pmm structures as reserved.
+    Every other block of every pool is handed to the buddies, which is
+    where the free lists and the zone and pool free counts come from. With
+    deferred init only the first chunks of each pool are built here, the
+    rest is only counted.
+*/
+void reserve_kernel()
+{
+    logf("Reserving kernel\n-----------------\n");
+
+    reservedStart = (uintptr_t)kernel_start - VIRTUAL_KERNEL_OFFSET;
+    reservedEnd = metadataEnd - 1 - VIRTUAL_KERNEL_OFFSET;
+    logf("Kernel start: %x\tKernel End: %x\n", (uint32_t)reservedStart, (uint32_t)reservedEnd);
+
+    struct pool *currentPool;
+    uint32_t boot = (bootBlocks == 0) ? 0xFFFFFFFF : ALIGN_UP(bootBlocks, PMM_INIT_CHUNK);
+
+    for (uint32_t i = 0; i < zoneCount; i++)
+    {
+        zones[i]->freeBlocks = 0;
+        for (currentPool = zones[i]->poolStart; currentPool != NULL; currentPool = currentPool->nextPool)
+        {
+            currentPool->freeBlocks = buildBlocks(currentPool, (boot < currentPool->totalBlocks) ? boot : currentPool->totalBlocks);
+            if (currentPool->initBlocks < currentPool->totalBlocks)
+                currentPool->freeBlocks += releaseUsable(currentPool, currentPool->initBlocks, currentPool->totalBlocks - 1, NULL);
+
+            // the merges of building the pool aren't something it was asked to do
+            for (struct buddy *level = currentPool->poolBuddiesTop; level != NULL; level = level->nextBuddy)
+                memset(&level->stats, 0, sizeof(level->stats));
+
+            zones[i]->freeBlocks += currentPool->freeBlocks;
+        }
+    }
+
+    logf("\n------------------------------------------------------\n\n");
+}
+
+/*
+    Release the usable blocks in [firstBlock, lastBlock] of a pool, which is
+    all of them except for the kernel with the pmm structures and physical 
+    page 0. Page 0 holds the real mode IVT and BIOS data, and its address 
+    can't be told apart from NULL. With levelFree set to NULL the blocks are
+    only counted. Returns the number of usable blocks.
+*/
+uint32_t releaseUsable(struct pool *pool, uint32_t firstBlock, uint32_t lastBlock, int32_t *levelFree)
+{
+    phys_addr_t poolLast = pool->start + ((phys_addr_t)pool->totalBlocks * BLOCK_SIZE) - 1; // last byte of the pool
+    uint32_t holeFirst = lastBlock + 1, holeLast = lastBlock; // no hole in the range
+    uint32_t count = 0, end, begin;
+
+    if (firstBlock < pool->firstBlock)
+        firstBlock = pool->firstBlock;
+    if (pool->start == 0 && firstBlock == 0)
+        firstBlock = 1;
+    if (firstBlock > lastBlock)
+        return 0;
+
+    // blocks of the kernel and the pmm structures within the pool
+    if (reservedStart <= poolLast && reservedEnd >= pool->start)
+    {
+        holeFirst = (reservedStart <= pool->start) ? 0 : getBitOffset(pool->start, reservedStart, BLOCK_SIZE);
+        holeLast = (reservedEnd >= poolLast) ? pool->totalBlocks - 1 : getBitOffset(pool->start, reservedEnd, BLOCK_SIZE);
+        logf("Pool @ %x\tStart : %x:%x\tReserved blocks: %d - %d\n", pool, PHYS_HALVES(pool->start), holeFirst, holeLast);
+    }
+
+    // the blocks before the hole, then the ones after it
+    if (holeFirst > firstBlock)
+    {
+        end = (holeFirst - 1 < lastBlock) ? holeFirst - 1 : lastBlock;
+        count += end - firstBlock + 1;
+        if (levelFree != NULL)
+            freeRange(pool, firstBlock, end, levelFree);
+    }
+    if (holeLast < lastBlock)
+    {
+        begin = (holeLast + 1 > firstBlock) ? holeLast + 1 : firstBlock;
+        count += lastBlock - begin + 1;
+        if (levelFree != NULL)
+            freeRange(pool, begin, lastBlock, levelFree);
+    }
+    return count;
+}
+
+/*
+    Build the buddy state of a pool from where it was left up to endBlock
+    (exclusive), which must be a multiple of PMM_INIT_CHUNK or the end of 
+    the pool: set the bitmap words of the range to reserved and release the
+    usable blocks in it. Chunks cover whole 64-bit words of the orders below
+    CHUNK_ORDERS, the bitmaps of the larger ones are set by makeBuddies, so
+    merges never reach into memory that isn't built yet. The pool must be
+    locked once the pmm is running. Only the buddy counters are updated, 
+    the pool and zone count these blocks from the start. Returns the number
+    of blocks released.
+*/
+uint32_t buildBlocks(struct pool *pool, uint32_t endBlock)
+{
+    int32_t levelFree[BUDDY_LEVELS] = {0};
+    uint32_t firstWord, endWord, released;
+
+    if (endBlock <= pool->initBlocks)
+        return 0;
+
+    for (struct buddy *level = pool->poolBuddiesBottom; level != NULL && level->order < CHUNK_ORDERS; level = level->prevBuddy)
+    {
+        firstWord = (pool->initBlocks / level->size) / 32;
+        endWord = (endBlock == pool->totalBlocks) ? level->mapWordCount : (endBlock / level->size) / 32;
+        memset(level->bitMap + firstWord, 0xFF, (endWord - firstWord) * 4); // set the range to reserved
+    }
+
+    released = releaseUsable(pool, pool->initBlocks, endBlock - 1, levelFree);
+    applyLevelFree(pool, levelFree);
+    __atomic_store_n(&pool->initBlocks, endBlock, __ATOMIC_RELAXED); // pmm_get_stats reads it without the lock
+    return released;
+}
+
+// Copy the memory map for recordings, as much of it as fits
+void keepBootMap(multiboot_info_t *mbtStructure)
+{
+    struct mmap_entry_t *section = (struct mmap_entry_t *)(mbtStructure->mmap_addr + VIRTUAL_KERNEL_OFFSET);
+
+    for (bootMapCount = 0; bootMapCount < PMM_RECORD_MAX_MAP &&
+                           section < (struct mmap_entry_t *)(mbtStructure->mmap_addr + mbtStructure->mmap_length + VIRTUAL_KERNEL_OFFSET);
+         bootMapCount++)
+    {
+        bootMap[bootMapCount] = (struct pmm_record_region){SECTION_BASE(section), SECTION_LENGTH(section), section->type, 0};
+        section = (struct mmap_entry_t *)((uintptr_t)section + (uint32_t)section->size + sizeof(section->size));
+    }
+}
+
+/*
+    Describe the pmm in the header of a recording: the memory map it was 
+    booted with, or when it adopted a saved state and has none, the memory
+    of its pools as available RAM, and the node table and boot settings.
+*/
+void recordSetup(struct pmm_record_header *header)
+{
+    if (bootMapCount > 0)
+    {
+        header->mapCount = bootMapCount;
+        memcpy(header->map, bootMap, bootMapCount * sizeof(bootMap[0]));
+    }
+    else
+        for (uint32_t i = 0; i < poolRangeCount && header->mapCount < PMM_RECORD_MAX_MAP; i++)
+            header->map[header->mapCount++] = (struct pmm_record_region){poolRanges[i].start, poolRanges[i].end - poolRanges[i].start, 1, 0};
+
+    header->nodeRangeCount = nodeRangeCount;
+    memcpy(header->nodeRanges, nodeRanges, nodeRangeCount * sizeof(nodeRanges[0]));
+    header->bootBlocks = bootBlocks;
+    header->dmaReserve = __atomic_load_n(&dmaReserve, __ATOMIC_RELAXED);
+    for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+        header->hugeReserve[order] = hugeReserve[order].count;
+}
+
+// Index of the zone of an address in zones, which is the order pmm_get_stats lists them in
+uint32_t zoneIndex(phys_addr_t address)
+{
+    const struct pool_range *range = rangeForAddress(address);
+
+    for (uint32_t i = 0; range != NULL && i < zoneCount; i++)
+        if (zones[i] == range->zone)
+            return i;
+    return PMM_RECORD_NO_ZONE;
+}
+
+// Start an empty zone header after the metadata laid out so far
+struct zone *newZone(uint8_t type, uint8_t node)
+{
+    struct zone *zone = (struct zone *)ALIGN_UP(metadataEnd, 64);
+    zone->zoneType = type;
+    zone->node = node;
+    zone->freeBlocks = 0;
+    zone->fails = 0;
+    zone->poolStart = NULL;
+    zone->zonePhysicalSize = sizeof(struct zone);
+
+    metadataEnd = (uintptr_t)(zone + 1);
+    zones[zoneCount++] = zone;
+    return zone;
+}
+
+/*
+    Lay out a pool of blocks blocks from start after the metadata laid out 
+    so far and add it to the end of a zone. Block 0 of the pool is moved 
+    down to a boundary of the largest order that fits in it, so that every
+    block is naturally aligned; the blocks before start are never released.
+*/
+struct pool *newPool(struct zone *zone, phys_addr_t start, uint32_t blocks)
+{
+    struct pool *pool = (struct pool *)ALIGN_UP(metadataEnd, 64);
+    struct pool **link = &zone->poolStart;
+    uint32_t top = 31 - __builtin_clz(blocks);
+
+    if (top > PMM_MAX_ORDER)
+        top = PMM_MAX_ORDER;
+    pool->start = start & ~(((phys_addr_t)BLOCK_SIZE << top) - 1);
+    pool->firstBlock = (start - pool->start) / BLOCK_SIZE;
+    pool->totalBlocks = pool->firstBlock + blocks;
+    pool->nextPool = NULL;
+    pool->poolPhysicalSize = sizeof(struct pool);
+
+    // create the buddies for the pool - all blocks stay reserved until reserve_kernel releases them
+    makeBuddies(pool);
+    metadataEnd = (uintptr_t)pool + pool->poolPhysicalSize;
+    zone->zonePhysicalSize += pool->poolPhysicalSize;
+    zone->freeBlocks += blocks;
+
+    while (*link != NULL)
+        link = &(*link)->nextPool;
+    *link = pool;
+    return pool;
+}
+
+// Drop bytes from the start of a memory map section, once they are part of a pool or can't be
+void advanceSection(struct mmap_entry_t *section, phys_addr_t bytes)
+{
+    phys_addr_t base = SECTION_BASE(section) + bytes;
+    phys_addr_t length = SECTION_LENGTH(section) - bytes;
+
+    section->base_low = (uint32_t)base;
+    section->base_high = (uint32_t)(base >> 32);
+    section->length_low = (uint32_t)length;
+    section->length_high = (uint32_t)(length >> 32);
+}
+
+/*
+    Creates structures and initializes bitmaps and their summaries for the 
+    buddies of a given pool, followed by the free list links of the pool, 
+    as described in pmm.h. A set bit means the block is not free at that 
+    order - it is either allocated, split into smaller blocks or part of a 
+    larger free block. The orders go up to the largest that fits in the 
+    pool and that its start is aligned to. The bitmaps are filled in by 
+    buildBlocks, which releases the usable blocks to the buddies, except for
+    the ones of the orders whose words span chunks. Those are tiny and set
+    to reserved here, so that a merge never finds a free buddy in a chunk 
+    that isn't built yet.
+*/
+void makeBuddies(struct pool *pool)
+{
+    struct buddy *buddies = (struct buddy *)ALIGN_UP((uintptr_t)pool + pool->poolPhysicalSize, 64);
+    struct buddy *currentBuddy;
+    uint32_t top = 31 - __builtin_clz(pool->totalBlocks), levels, types;
+    uintptr_t next;
+    uint64_t *summaryStorage;
+
+    if (top > PMM_MAX_ORDER)
+        top = PMM_MAX_ORDER;
+    if (pool->start != 0 && __builtin_ctzll(pool->start / BLOCK_SIZE) < top)
+        top = __builtin_ctzll(pool->start / BLOCK_SIZE);
+    levels = top + 1;
+    next = (uintptr_t)(buddies + levels);
+
+    spin_lock_init(&pool->lock);
+    pool->freeBlocks = 0;
+    pool->initBlocks = 0;
+    pool->poolBuddiesTop = buddies;
+    pool->poolBuddiesBottom = &buddies[levels - 1];
+
+    // buddy headers and bitmaps, top order first
+    for (uint32_t level = 0; level < levels; level++)
+    {
+        currentBuddy = &buddies[level];
+        currentBuddy->order = top - level;
+        currentBuddy->size = 1u << currentBuddy->order;
+        currentBuddy->maxFreeBlocks = pool->totalBlocks / currentBuddy->size; // max possible allocations for this order
+        currentBuddy->freeBlocks = 0;
+        currentBuddy->freeListHead = NO_FREE_BLOCK;
+        memset(&currentBuddy->stats, 0, sizeof(currentBuddy->stats));
+        currentBuddy->mapWordCount = (currentBuddy->maxFreeBlocks / 32) + (currentBuddy->maxFreeBlocks % 32 != 0);
+        currentBuddy->prevBuddy = (level > 0) ? &buddies[level - 1] : NULL;
+        currentBuddy->nextBuddy = (level < levels - 1) ? &buddies[level + 1] : NULL;
+
+        currentBuddy->bitMap = (uint32_t *)next;
+        if (currentBuddy->order >= CHUNK_ORDERS)
+            memset(currentBuddy->bitMap, 0xFF, currentBuddy->mapWordCount * 4);
+        next = ALIGN_UP(next + (currentBuddy->mapWordCount * 4), 64);
+    }
+
+    // the summaries go after all the bitmaps, the headers of the mobility types of an order back to back
+    for (currentBuddy = buddies; currentBuddy != NULL; currentBuddy = currentBuddy->nextBuddy)
+    {
+        types = (currentBuddy->order < TYPED_ORDERS) ? PMM_MOBILITY_TYPES : 1;
+        currentBuddy->summary = (struct bitmap_summary *)next;
+        summaryStorage = (uint64_t *)ALIGN_UP(next + sizeof(struct bitmap_summary) * types, 8);
+        for (uint32_t type = 0; type < types; type++)
+        {
+            summaryInit(&currentBuddy->summary[type], summaryStorage, NULL, currentBuddy->mapWordCount); // nothing is free until buildBlocks
+            summaryStorage += summaryWords(currentBuddy->mapWordCount);
+        }
+        next = ALIGN_UP((uintptr_t)summaryStorage, 64);
+    }
+
+    // one free list link per block of the pool, then the type of every pageblock. Free memory starts out movable
+    pool->freeLinks = (struct free_link *)next;
+    next += pool->totalBlocks * sizeof(struct free_link);
+    memset((void *)next, PMM_MOVABLE, CEIL(pool->totalBlocks, PMM_PAGEBLOCK_BLOCKS));
+    next += CEIL(pool->totalBlocks, PMM_PAGEBLOCK_BLOCKS);
+
+    // and the order of the block handed out at every block, for compaction
+    memset((void *)next, 0, pool->totalBlocks);
+    next += pool->totalBlocks;
+
+    pool->poolPhysicalSize = next - (uintptr_t)pool;
+}
+
+/*
+    Free the blocks [firstBlock, lastBlock] of a locked pool, using the 
+    largest naturally aligned buddies that fit in the range. Changes to the
+    buddy counters are added to levelFree.
+*/
+void freeRange(struct pool *pool, uint32_t firstBlock, uint32_t lastBlock, int32_t *levelFree)
+{
+    struct buddy *level;
+    while (firstBlock <= lastBlock)
+    {
+        level = pool->poolBuddiesTop;
+        while (level->nextBuddy != NULL && (firstBlock % level->size != 0 || lastBlock - firstBlock + 1 < level->size))
+            level = level->nextBuddy;
+
+        freeBlock(pool, level, firstBlock / level->size, levelFree);
+        firstBlock += level->size;
+    }
+}
+
+// Smallest buddy of the pool whose blocks can hold the given number of blocks
+struct buddy *buddyForBlocks(struct pool *pool, uint32_t blocks)
+{
+    struct buddy *level = pool->poolBuddiesBottom;
+    while (level->size < blocks && level->prevBuddy != NULL)
+        level = level->prevBuddy;
+    return level;
+}
+
+/*
+    Lowest free block of a buddy of a locked pool that an allocation of a 
+    mobility type can take without stealing. The orders below TYPED_ORDERS
+    have a summary per type. A summary bit of the orders up to the 
+    pageblock order covers several pageblocks, so the ones of other types 
+    are skipped a pageblock at a time. A free block of a pageblock or more 
+    is of no type yet and any will do.
+*/
+intmax_t findFreeBlock(struct pool *pool, struct buddy *level, uint32_t type)
+{
+    uint8_t *types = PAGEBLOCK_TYPES(pool);
+    intmax_t found;
+
+    if (level->order < TYPED_ORDERS)
+        return findFirstFreeBit(level->bitMap, level->summary + type, level->mapWordCount);
+
+    found = findFirstFreeBit(level->bitMap, level->summary, level->mapWordCount);
+    if (level->order >= PMM_PAGEBLOCK_ORDER)
+        return found;
+    while (found >= 0 && types[PAGEBLOCK_OF(level, found)] != type)
+        found = findFreeBitFrom(level->bitMap, level->summary, level->mapWordCount,
+                                (PAGEBLOCK_OF(level, found) + 1) << (PMM_PAGEBLOCK_ORDER - level->order));
+    return found;
+}
+
+/*
+    Free list operations. Blocks are linked through the entry of their first
+    block. These leave the free counters to the caller, which adds up the 
+    changes of a whole batch in a per level array and applies them once.
+*/
+void pushFreeBlock(struct pool *pool, struct buddy *level, uint32_t block)
+{
+    struct free_link *link = &pool->freeLinks[block * level->size];
+    link->prev = NO_FREE_BLOCK;
+    link->next = level->freeListHead;
+    if (level->freeListHead != NO_FREE_BLOCK)
+        pool->freeLinks[level->freeListHead * level->size].prev = block;
+    level->freeListHead = block;
+
+    unset_bit(level->bitMap, SUMMARY_FOR(pool, level, block), block);
+}
+
+void unlinkFreeBlock(struct pool *pool, struct buddy *level, uint32_t block)
+{
+    struct free_link *link = &pool->freeLinks[block * level->size];
+    if (link->prev != NO_FREE_BLOCK)
+        pool->freeLinks[link->prev * level->size].next = link->next;
+    else
+        level->freeListHead = link->next;
+    if (link->next != NO_FREE_BLOCK)
+        pool->freeLinks[link->next * level->size].prev = link->prev;
+}
+
+void removeFreeBlock(struct pool *pool, struct buddy *level, uint32_t block)
+{
+    unlinkFreeBlock(pool, level, block);
+    set_bit(level->bitMap, SUMMARY_FOR(pool, level, block), block);
+}
+
+void applyLevelFree(struct pool *pool, int32_t *levelFree)
+{
+    for (struct buddy *level = pool->poolBuddiesTop; level != NULL; level = level->nextBuddy)
+        if (levelFree[LEVEL_INDEX(level)] != 0)
+            COUNTER_ADD(level->freeBlocks, levelFree[LEVEL_INDEX(level)]);
+}
+
+/*
+    Take up to count blocks of the target buddy from the pool, which must be
+    locked, and store their physical addresses in out. Free blocks are taken
+    from the smallest order at or above the target, lowest address first, 
+    which keeps allocations packed at the bottom of the pool and leaves the
+    top free for large blocks. Each order is walked a bitmap word at a time
+    through its summary, and all the free blocks of a word are taken with 
+    one bitmap update. A larger block that is used up entirely needs no work
+    on the orders in between, only the remainder of a partly used one is put
+    back, as the largest aligned blocks that fit. Below the pageblock order
+    only pageblocks of the given mobility type are searched, blocks of a 
+    pageblock or more are free pageblocks that go to whoever splits them.
+    When the type has nothing left at any order, the next chunk of the pool
+    is built, or as a last resort the pageblock of another type with the 
+    largest free block is claimed. Returns how many blocks were taken.
+*/
+uint32_t allocBlocks(struct pool *pool, struct buddy *target, phys_addr_t *out, uint32_t count, uint32_t type)
+{
+    int32_t levelFree[BUDDY_LEVELS] = {0};
+    uint8_t *orders = ALLOC_ORDERS(pool), movable = (type == PMM_MOVABLE) ? ORDER_MOVABLE : 0;
+    struct buddy *level;
+    intmax_t found;
+    uint32_t taken = 0, per, word, freeBits, used, bit, first, n, span;
+
+    level = target;
+    while (level != NULL && taken < count)
+    {
+        per = level->size / target->size; // target blocks in a block of this order
+        while (taken < count)
+        {
+            // most of the orders of a large pool are empty, those aren't worth a search
+            if ((int32_t)COUNTER_READ(level->freeBlocks) + levelFree[LEVEL_INDEX(level)] <= 0)
+                break;
+            STAT_ADD(level->stats.searches, 1);
+            if ((found = findFreeBlock(pool, level, type)) < 0)
+                break;
+
+            word = found / 32;
+            freeBits = ~level->bitMap[word]; // bits past maxFreeBlocks are always set
+            if (level->order >= TYPED_ORDERS && level->order < PMM_PAGEBLOCK_ORDER)
+            {
+                // a word of these orders spans pageblocks of other types, keep to the one found
+                span = 1u << (PMM_PAGEBLOCK_ORDER - level->order);
+                if (span < 32)
+                    freeBits &= ((1u << span) - 1) << ((found % 32) & ~(span - 1));
+            }
+            used = 0;
+            while (freeBits != 0 && taken < count)
+            {
+                bit = __builtin_ctz(freeBits);
+                freeBits &= freeBits - 1;
+                used |= 1u << bit;
+                unlinkFreeBlock(pool, level, (word * 32) + bit);
+
+                first = ((word * 32) + bit) * per;
+                n = (count - taken < per) ? count - taken : per;
+                if (level->order >= PMM_PAGEBLOCK_ORDER && claimFreePageblocks(pool, first * target->size, (first + n) * target->size, type))
+                    STAT_ADD(target->stats.steals, 1);
+                for (uint32_t i = 0; i < n; i++)
+                {
+                    out[taken++] = pool->start + ((phys_addr_t)(first + i) * target->size * BLOCK_SIZE);
+                    orders[(first + i) * target->size] = (LEVEL_INDEX(target) + 1) | movable;
+                }
+                if (level != target)
+                    STAT_ADD(level->stats.splits, 1);
+                putBackRest(pool, level, target, first + n, first + per, levelFree);
+            }
+            set_mask(level->bitMap, SUMMARY_FOR(pool, level, word * 32), word, used);
+            levelFree[LEVEL_INDEX(level)] -= __builtin_popcount(used);
+        }
+
+        if (taken == count)
+            break;
+        if (level->prevBuddy != NULL)
+            level = level->prevBuddy;
+        // out of this type at every order: build more of the pool or take over a pageblock before giving up
+        else if (pool->initBlocks < pool->totalBlocks)
+        {
+            buildBlocks(pool, (pool->initBlocks + PMM_INIT_CHUNK < pool->totalBlocks) ? pool->initBlocks + PMM_INIT_CHUNK : pool->totalBlocks);
+            level = target;
+        }
+        else if (stealPageblock(pool, target, type))
+        {
+            STAT_ADD(target->stats.steals, 1);
+            level = target;
+        }
+        else
+            level = NULL;
+    }
+
+    applyLevelFree(pool, levelFree);
+    COUNTER_SUB(pool->freeBlocks, taken * target->size);
+    STAT_ADD(target->stats.allocs, taken);
+    return taken;
+}
+
+/*
+    Put back what is left of a block of level taken to hand out blocks of
+    target, the target blocks [rest, end), as the largest aligned blocks 
+    that fit. The pool must be locked.
+*/
+void putBackRest(struct pool *pool, struct buddy *level, struct buddy *target, uint32_t rest, uint32_t end, int32_t *levelFree)
+{
+    struct buddy *piece = target;
+
+    // the pieces mostly grow from one to the next, so carry on from the last one rather than from target
+    for (; rest < end; rest += piece->size / target->size)
+    {
+        while (rest % (piece->size / target->size) != 0 || rest + (piece->size / target->size) > end)
+            piece = piece->nextBuddy;
+        while (piece->prevBuddy != level && rest % ((piece->size * 2) / target->size) == 0 &&
+               rest + ((piece->size * 2) / target->size) <= end)
+            piece = piece->prevBuddy;
+        pushFreeBlock(pool, piece, rest / (piece->size / target->size));
+        levelFree[LEVEL_INDEX(piece)]++;
+    }
+}
+
+/*
+    Compact the pools of the nodes the calling CPU allocates from, nearest
+    first, for a request of blocks that failed. Stops at the first pool 
+    that gets a free block of that size. Returns the number of blocks 
+    moved, 0 without a migrate client.
+*/
+uint32_t compactNodes(struct pmm_cpu_node *cpu, uint32_t blocks)
+{
+    uint32_t node = (cpu->policy == PMM_POLICY_BIND) ? cpu->bindNode : cpu->node;
+    uint32_t tries = (cpu->policy == PMM_POLICY_BIND) ? 1 : pmm_nodes[node].fallbackCount + 1;
+    uint32_t moved = 0, from;
+    struct zone *zone;
+    struct buddy *goal;
+
+    if (__atomic_load_n(&migrateBlock, __ATOMIC_ACQUIRE) == NULL)
+        return 0;
+
+    STAT_ADD(cpu->compactions, 1);
+    for (uint32_t i = 0; i < tries; i++)
+    {
+        from = (i == 0) ? node : pmm_nodes[node].fallback[i - 1];
+        for (uint32_t z = 0; z < 2; z++)
+        {
+            zone = (z == 0) ? pmm_nodes[from].high : pmm_nodes[from].normal;
+            for (struct pool *currentPool = zone->poolStart; currentPool != NULL; currentPool = currentPool->nextPool)
+            {
+                if (currentPool->poolBuddiesTop->size < blocks)
+                    continue;
+                goal = buddyForBlocks(currentPool, blocks);
+                moved += compactPool(zone, currentPool, goal, cpu);
+                for (; goal != NULL; goal = goal->prevBuddy)
+                    if (COUNTER_READ(goal->freeBlocks) > 0)
+                        return moved;
+            }
+        }
+    }
+    return moved;
+}
+
+/*
+    Compact a pool. The migrate scanner walks down from the top of the pool
+    over the movable pageblocks, and each block in them that was handed out
+    as PMM_MOVABLE is moved into the lowest free block of its size in a 
+    movable pageblock below it, which the free scanner takes from the 
+    bottom of the pool. The client copies the block with the pool unlocked,
+    and the block that is left behind, or the target if the client turned
+    the move down, is freed and merged. Once a block finds no room below it,
+    the blocks of its size or larger further down are skipped, as there is
+    only less room below them. With a goal this stops as soon as a block of
+    that buddy or larger is free. Returns the number of blocks moved.
+*/
+uint32_t compactPool(struct zone *zone, struct pool *pool, struct buddy *goal, struct pmm_cpu_node *cpu)
+{
+    pmm_migrate_t migrate = __atomic_load_n(&migrateBlock, __ATOMIC_ACQUIRE);
+    uint8_t *orders = ALLOC_ORDERS(pool), *types = PAGEBLOCK_TYPES(pool);
+    int32_t levelFree[BUDDY_LEVELS];
+    uint32_t moved = 0, scan, to, noRoom = UINT32_MAX; // smallest block size that found no room
+    uint8_t order;
+    struct buddy *level, *larger;
+    bool done = false, ok;
+
+    spin_lock(&pool->lock);
+    scan = pool->initBlocks;
+    while (scan > 0 && !done)
+    {
+        scan--;
+        if (types[scan / PMM_PAGEBLOCK_BLOCKS] != PMM_MOVABLE)
+        {
+            scan -= scan % PMM_PAGEBLOCK_BLOCKS; // skip the rest of the pageblock
+            continue;
+        }
+        order = __atomic_load_n(&orders[scan], __ATOMIC_RELAXED); // the bits of PMM_CHECK_FREE change without the lock
+        if ((order & (ORDER_MOVABLE | ORDER_CACHED)) != ORDER_MOVABLE)
+            continue;
+
+        level = buddyForBlocks(pool, 1u << ORDER_OF(order));
+        if (level->size >= noRoom)
+            continue;
+        memset(levelFree, 0, sizeof(levelFree));
+        to = takeMovableBelow(pool, level, scan / level->size, levelFree);
+        applyLevelFree(pool, levelFree);
+        if (to == NO_FREE_BLOCK)
+        {
+            if (level == pool->poolBuddiesBottom)
+                break; // the scanners met
+            noRoom = level->size;
+            continue; // smaller blocks below may still fit somewhere
+        }
+
+        // the target counts as handed out while the client copies, it may free it as soon as it has moved
+        orders[to * level->size] = order;
+        COUNTER_SUB(pool->freeBlocks, level->size);
+        COUNTER_SUB(zone->freeBlocks, level->size);
+        spin_unlock(&pool->lock);
+
+        ok = migrate(pool->start + (phys_addr_t)scan * BLOCK_SIZE, pool->start + (phys_addr_t)to * level->size * BLOCK_SIZE, LEVEL_INDEX(level));
+
+        spin_lock(&pool->lock);
+        memset(levelFree, 0, sizeof(levelFree));
+        if (ok)
+        {
+            orders[scan] = 0;
+            freeBlock(pool, level, scan / level->size, levelFree);
+            STAT_ADD(cpu->migrated, 1);
+            moved++;
+        }
+        else
+        {
+            orders[to * level->size] = 0;
+            freeBlock(pool, level, to, levelFree);
+            STAT_ADD(cpu->migrateFails, 1);
+        }
+        applyLevelFree(pool, levelFree);
+        COUNTER_ADD(pool->freeBlocks, level->size);
+        COUNTER_ADD(zone->freeBlocks, level->size);
+
+        for (larger = goal; larger != NULL && !done; larger = larger->prevBuddy)
+            done = COUNTER_READ(larger->freeBlocks) > 0;
+    }
+    spin_unlock(&pool->lock);
+    return moved;
+}
+
+/*
+    Take the lowest free block of the target buddy or larger that lies in
+    a movable pageblock, or spans whole pageblocks that then become 
+    movable, and starts below limit, a block index of target, from a 
+    locked pool, splitting a larger one. Returns the index of the target 
+    block, NO_FREE_BLOCK if there is none.
+*/
+uint32_t takeMovableBelow(struct pool *pool, struct buddy *target, uint32_t limit, int32_t *levelFree)
+{
+    struct buddy *best = NULL;
+    uint32_t bestFirst = limit, per, first;
+    intmax_t found, bestFound = 0;
+
+    for (struct buddy *level = target; level != NULL; level = level->prevBuddy)
+    {
+        STAT_ADD(level->stats.searches, 1);
+        found = findFreeBlock(pool, level, PMM_MOVABLE);
+        per = level->size / target->size;
+        if (found >= 0 && (uint32_t)found * per < bestFirst)
+        {
+            best = level;
+            bestFound = found;
+            bestFirst = found * per;
+        }
+    }
+    if (best == NULL)
+        return NO_FREE_BLOCK;
+
+    removeFreeBlock(pool, best, bestFound);
+    levelFree[LEVEL_INDEX(best)]--;
+    if (best->order >= PMM_PAGEBLOCK_ORDER)
+        claimFreePageblocks(pool, bestFirst * target->size, (bestFirst + 1) * target->size, PMM_MOVABLE);
+    if (best != target)
+    {
+        STAT_ADD(best->stats.splits, 1);
+        first = bestFirst;
+        putBackRest(pool, best, target, first + 1, first + best->size / target->size, levelFree);
+    }
+    return bestFirst;
+}
+
+/*
+    Hand the pageblock of another mobility type with the largest free block
+    of the target buddy or larger over to type, in a locked pool, leaving 
+    its allocated blocks to come back to type when they are freed. Free 
+    blocks of a pageblock or more don't belong to any type and are taken by
+    allocBlocks without this, so there is nothing to steal for them. 
+    Returns false if there is no such pageblock.
+*/
+bool stealPageblock(struct pool *pool, struct buddy *target, uint32_t type)
+{
+    uint8_t *types = PAGEBLOCK_TYPES(pool);
+    intmax_t found;
+
+    for (struct buddy *level = pool->poolBuddiesTop; level != target->nextBuddy; level = level->nextBuddy)
+    {
+        if (level->order >= PMM_PAGEBLOCK_ORDER)
+            continue;
+        if (level->order >= TYPED_ORDERS)
+        {
+            // one summary for every type, skip the pageblocks that are type's already
+            found = findFirstFreeBit(level->bitMap, level->summary, level->mapWordCount);
+            while (found >= 0 && types[PAGEBLOCK_OF(level, found)] == type)
+                found = findFreeBitFrom(level->bitMap, level->summary, level->mapWordCount,
+                                        (PAGEBLOCK_OF(level, found) + 1) << (PMM_PAGEBLOCK_ORDER - level->order));
+            if (found >= 0)
+            {
+                claimPageblock(pool, PAGEBLOCK_OF(level, found), type);
+                return true;
+            }
+            continue;
+        }
+        for (uint32_t i = 0; i < PMM_MOBILITY_TYPES - 1; i++)
+        {
+            found = findFirstFreeBit(level->bitMap, level->summary + fallbackTypes[type][i], level->mapWordCount);
+            if (found >= 0)
+            {
+                claimPageblock(pool, PAGEBLOCK_OF(level, found), type);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Move the free blocks of a pageblock of a locked pool to the summaries of type, and the pageblock with them
+void claimPageblock(struct pool *pool, uint32_t pageblock, uint32_t type)
+{
+    uint8_t *types = PAGEBLOCK_TYPES(pool);
+    uint32_t first, end;
+
+    for (struct buddy *level = pool->poolBuddiesBottom; level != NULL && level->order < TYPED_ORDERS; level = level->prevBuddy)
+    {
+        // a summary bit covers 64 blocks of the order, which never straddle two pageblocks
+        first = (pageblock * PMM_PAGEBLOCK_BLOCKS) / level->size / 64;
+        end = first + PMM_PAGEBLOCK_BLOCKS / level->size / 64;
+        if (end > (level->mapWordCount + 1) / 2)
+            end = (level->mapWordCount + 1) / 2;
+        for (uint32_t word64 = first; word64 < end; word64++)
+            summaryMove(level->summary + types[pageblock], level->summary + type, word64);
+    }
+    __atomic_store_n(&types[pageblock], type, __ATOMIC_RELAXED); // mobilityOf reads it without the lock
+}
+
+/*
+    Hand the pageblocks of the blocks [first, end) of a locked pool over to
+    type. The blocks must have been part of one free block of a pageblock 
+    or more, so there are no free blocks of the typed orders in them to 
+    move. Returns true if any of the pageblocks was of another type.
+*/
+bool claimFreePageblocks(struct pool *pool, uint32_t first, uint32_t end, uint32_t type)
+{
+    uint8_t *types = PAGEBLOCK_TYPES(pool);
+    bool claimed = false;
+
+    for (uint32_t pageblock = first / PMM_PAGEBLOCK_BLOCKS; pageblock <= (end - 1) / PMM_PAGEBLOCK_BLOCKS; pageblock++)
+        if (types[pageblock] != type)
+        {
+            __atomic_store_n(&types[pageblock], type, __ATOMIC_RELAXED);
+            claimed = true;
+        }
+    return claimed;
+}
+
+/*
+    Return a block of the given buddy to the pool, which must be locked, 
+    merging it with its buddy (found by flipping the lowest bit of the index)
+    for as long as that one is free as well. The changes to the per level
+    free counts are added to levelFree, the pool count is left to the caller.
+*/
+void freeBlock(struct pool *pool, struct buddy *level, uint32_t block, int32_t *levelFree)
+{
+    uint32_t buddyBlock;
+
+    while (level->prevBuddy != NULL)
+    {
+        buddyBlock = block ^ 1;
+        if (buddyBlock >= level->maxFreeBlocks || test_bit(level->bitMap, buddyBlock))
+            break;
+
+        removeFreeBlock(pool, level, buddyBlock);
+        levelFree[LEVEL_INDEX(level)]--;
+        STAT_ADD(level->stats.merges, 1);
+        block >>= 1;
+        level = level->prevBuddy;
+    }
+    pushFreeBlock(pool, level, block);
+    levelFree[LEVEL_INDEX(level)]++;
+}
+
+/*
+    Move every pointer of the metadata of a state image by delta: from 
+    addresses to offsets into the image when saving, from offsets to the
+    addresses where the image lies when adopting, or nowhere (delta 0) to
+    check an image. The structures are reached through the offsets, which
+    the fields hold before the move when adopting and after it when saving,
+    as toPointers says. Each header is folded into sum once its fields are 
+    offsets. Returns false, before following it, on an offset that points
+    outside the metadata, and on pools or buddies that don't add up.
+*/
+bool walkState(uint8_t *image, intptr_t delta, bool toPointers, uint64_t *sum)
+{
+    struct pmm_state *header = (struct pmm_state *)image;
+    struct zone *zone;
+    struct pool *pool;
+    struct buddy *level;
+    struct bitmap_summary *summary;
+    struct pool_range *range;
+    uint64_t poolOffset, nextPool, buddyOffset, nextBuddy, offset;
+    uint32_t pools = 0, buddies, types;
+
+    for (uint32_t i = 0; i < header->zoneCount; i++)
+    {
+        if (!STATE_FITS(header, header->zones[i], sizeof(struct zone)))
+            return false;
+        zone = (struct zone *)STATE_AT(image, header->zones[i]);
+        poolOffset = relocateField(&zone->poolStart, delta, toPointers);
+        *sum = stateSum(*sum, zone, sizeof(*zone));
+
+        for (; poolOffset != 0; poolOffset = nextPool)
+        {
+            if (!STATE_FITS(header, poolOffset, sizeof(struct pool)) || ++pools > header->poolRangeCount)
+                return false;
+            pool = (struct pool *)STATE_AT(image, poolOffset);
+            if (delta != 0)
+                spin_lock_init(&pool->lock);
+            buddyOffset = relocateField(&pool->poolBuddiesTop, delta, toPointers);
+            relocateField(&pool->poolBuddiesBottom, delta, toPointers);
+            offset = relocateField(&pool->freeLinks, delta, toPointers);
+            nextPool = relocateField(&pool->nextPool, delta, toPointers);
+            *sum = stateSum(*sum, pool, sizeof(*pool));
+            if (!STATE_FITS(header, offset, (uint64_t)pool->totalBlocks * (sizeof(struct free_link) + 1) + CEIL(pool->totalBlocks, PMM_PAGEBLOCK_BLOCKS)))
+                return false;
+
+            for (buddies = 0; buddyOffset != 0; buddyOffset = nextBuddy, buddies++)
+            {
+                if (!STATE_FITS(header, buddyOffset, sizeof(struct buddy)) || buddies == BUDDY_LEVELS)
+                    return false;
+                level = (struct buddy *)STATE_AT(image, buddyOffset);
+                offset = relocateField(&level->bitMap, delta, toPointers);
+                relocateField(&level->prevBuddy, delta, toPointers);
+                nextBuddy = relocateField(&level->nextBuddy, delta, toPointers);
+                if (!STATE_FITS(header, offset, (uint64_t)level->mapWordCount * 4))
+                    return false;
+
+                // the summaries of the mobility types of the order, header and storage
+                types = (level->order < TYPED_ORDERS) ? PMM_MOBILITY_TYPES : 1;
+                offset = relocateField(&level->summary, delta, toPointers);
+                *sum = stateSum(*sum, level, sizeof(*level));
+                if (!STATE_FITS(header, offset, types * sizeof(struct bitmap_summary)))
+                    return false;
+                for (summary = (struct bitmap_summary *)STATE_AT(image, offset); types > 0; types--, summary++)
+                {
+                    if (summary->levels > SUMMARY_MAX_LEVELS)
+                        return false;
+                    for (uint32_t l = 0; l < summary->levels; l++)
+                    {
+                        offset = relocateField(&summary->level[l], delta, toPointers);
+                        if (!STATE_FITS(header, offset, (uint64_t)summary->levelWords[l] * 8))
+                            return false;
+                    }
+                    *sum = stateSum(*sum, summary, sizeof(*summary));
+                }
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < header->poolRangeCount; i++)
+    {
+        range = (struct pool_range *)STATE_AT(image, header->poolRanges) + i;
+        offset = relocateField(&range->pool, delta, toPointers);
+        if (!STATE_FITS(header, offset, sizeof(struct pool)))
+            return false;
+        offset = relocateField(&range->zone, delta, toPointers);
+        if (!STATE_FITS(header, offset, sizeof(struct zone)))
+            return false;
+        *sum = stateSum(*sum, range, sizeof(*range));
+    }
+
+    for (uint32_t order = 0; order < BUDDY_LEVELS; order++)
+    {
+        if (!STATE_FITS(header, header->huge[order].blocks, (uint64_t)header->huge[order].count * sizeof(phys_addr_t)) ||
+            header->huge[order].free > header->huge[order].count)
+            return false;
+        *sum = stateSum(*sum, STATE_AT(image, header->huge[order].blocks), header->huge[order].count * sizeof(phys_addr_t));
+    }
+    return true;
+}
+
+// Move a pointer field of a state image by delta, unless it is NULL. Returns the offset it holds before the move or after it, see walkState
+uint64_t relocateField(void *field, intptr_t delta, bool toPointers)
+{
+    uintptr_t *value = field;
+    uintptr_t before = *value;
+
+    if (before == 0)
+        return 0;
+    *value = before + delta;
+    return toPointers ? before : *value;
+}
+
+// FNV-1a over the 64-bit words of the data, then over the bytes left
+uint64_t stateSum(uint64_t sum, const void *data, size_t bytes)
+{
+    const uint8_t *byte = data;
+    uint64_t word;
+
+    for (; bytes >= 8; bytes -= 8, byte += 8)
+    {
+        memcpy(&word, byte, 8);
+        sum = (sum ^ word) * 0x100000001B3ull;
     }
-    logf("Returning -1 : external\n");
-    logf("-------------------------\n\n");
-    return -1;
+    for (; bytes > 0; bytes--)
+        sum = (sum ^ *byte++) * 0x100000001B3ull;
+    return sum;
 }
 
-// debugging
+#ifdef PMM_DEBUG
 void printBuddyBitMap(uint32_t *map, uint32_t wordCount)
 {
     for (uint32_t i = 0; i < wordCount && i < 50; i++)
@@ -483,12 +2457,12 @@ void printZoneInfo(struct zone *zone)
     while (p != NULL)
     {
         logf("  Pool details: %x\n", p);
-        logf("\tPoolStart : %x\n", p->start);
+        logf("\tPoolStart : %x:%x\n", PHYS_HALVES(p->start));
         logf("\tfree blocks : %d blocks\n", p->freeBlocks);
         b = p->poolBuddiesTop;
         while (b != NULL)
         {
-            logf("\tBuddy of order %d @ %x:\n", b->buddyOrder, b);
+            logf("\tBuddy of order %d @ %x:\n", b->size, b);
             logf("\t\tMapWordCount : %d\n", b->mapWordCount);
             logf("\t\tMaxFreeBlocks: %d\n", b->maxFreeBlocks);
             logf("\t\tRealFreeBlocks: %d\n", b->freeBlocks);
@@ -502,3 +2476,4 @@ void printZoneInfo(struct zone *zone)
     }
     logf("---------------------------------------------\n\n");
 }
+#endif
@@ -2,26 +2,176 @@
 #define PMM_H
 
 #include <lumos/multiboot.h>
+#include <lumos/bitmap.h>
+#include <lumos/spinlock.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 // MISC
 #define BLOCK_SIZE 4096   // 4 KB in bytes
-#define MAX_BLOCK_ORDER 8 // ORDER * BLOCK_SIZE will be the maximum possible allocation
+
+/*
+    Largest order, blocks of 2^PMM_MAX_ORDER pages. Every order up to it has
+    a buddy of its own and its blocks are naturally aligned in physical 
+    memory. Define it when building the pmm to change it: the default is 
+    4 MB blocks (2 MB and 4 MB large pages) on 32-bit kernels and 1 GB on 
+    64-bit ones. It can't go below the pageblock order, nor above 2 GB.
+*/
+#ifndef PMM_MAX_ORDER
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define PMM_MAX_ORDER 18
+#else
+#define PMM_MAX_ORDER 10
+#endif
+#endif
+#define MAX_ALLOC_BLOCKS (1u << PMM_MAX_ORDER) // largest request pmm_alloc can serve, in blocks
+#define BUDDY_LEVELS (PMM_MAX_ORDER + 1)       // orders, a pool has the ones its size allows
+#define NO_FREE_BLOCK 0xFFFFFFFF // end of a free list
+#define PMM_INIT_CHUNK 0x2000    // blocks (32 MB) built at a time with deferred init, whole 64-bit bitmap words of orders 0 to 7
+
+// Mobility types. Each pool is split into pageblocks of PMM_PAGEBLOCK_BLOCKS
+// blocks that only hand out blocks of one type, so that memory that never
+// moves doesn't end up scattered over every large block
+#define PMM_UNMOVABLE 0   // kernel data that stays where it is put, what pmm_alloc asks for
+#define PMM_RECLAIMABLE 1 // caches that can be dropped when memory runs short
+#define PMM_MOVABLE 2     // memory that can be copied elsewhere, like user pages. Free pageblocks start as this
+#define PMM_MOBILITY_TYPES 3
+#define PMM_PAGEBLOCK_ORDER 9    // 2 MB, the smallest huge page
+#define PMM_PAGEBLOCK_BLOCKS (1u << PMM_PAGEBLOCK_ORDER) // a divisor of PMM_INIT_CHUNK
+
+#if PMM_MAX_ORDER < PMM_PAGEBLOCK_ORDER || PMM_MAX_ORDER > 19
+#error "PMM_MAX_ORDER must be between PMM_PAGEBLOCK_ORDER and 19, the largest block a 32-bit size can hold"
+#endif
+
+/*
+    Define PMM_CHECK_FREE when building the pmm to check every free against
+    the order its block was handed out at: frees of addresses that aren't
+    the start of a block in use, of blocks freed already and of blocks at
+    another size are logged, counted in badFrees and dropped rather than
+    corrupting the buddies. Without it, frees of memory the pmm doesn't
+    manage are caught, and so are size 0 frees of blocks that aren't handed
+    out right now: never allocated, in the middle of a block, freed already
+    or sitting in a per-CPU cache, the huge page reserve or a zero pool.
+    So are pmm_free_huge and pmm_free_zeroed of such blocks. Other frees at
+    a size are trusted, so one of a block that was freed already still 
+    corrupts the buddies.
+*/
 
 // Macro to take an order and return the size of a block of that order in bytes
-#define ORDER_TO_SIZE_IN_BYTES(order) ((1 << order) * BLOCK_SIZE)
+#define ORDER_TO_SIZE_IN_BYTES(order) ((1u << (order)) * BLOCK_SIZE)
 
 // GRUB Multiboot info
 #define MBT_FLAG_IS_MMAP 0x40 // 6th bit of flags in the mbt
 
+// Physical addresses are 64 bits wide even where pointers are not (PAE)
+typedef uint64_t phys_addr_t;
+
+#define HIGH_MEMORY_START 0x100000000ull // memory from 4 GB up belongs to the HIGH zone
+
 // DMA constants
 #define DMA_MAX_ADDRESS 0xFFFFFF // Highest possible DMA address
 #define DMA_TOTAL_BYTES 0x40000  // 256KB in bytes
 #define DMA_TOTAL_BLOCKS 0x40    // 256 KB in blocks
+#define DMA_DEFAULT_RESERVE 0x20 // DMA blocks NORMAL allocations can never fall back into
+
+// NUMA constants
+#define PMM_MAX_NODES 8
+#define PMM_MAX_NODE_RANGES 32
+#define PMM_POLICY_LOCAL 0      // the calling CPU's node, then the nodes of its fallback order
+#define PMM_POLICY_INTERLEAVE 1 // one node after the other, block by block, each with its fallback order
+#define PMM_POLICY_BIND 2       // only the bound node, fail when it is out of memory
+
+/*
+    Node affinity of a range of physical memory, as in an ACPI SRAT memory
+    affinity structure. Memory not covered by any range belongs to node 0.
+*/
+struct pmm_node_range
+{
+    phys_addr_t base;
+    uint64_t length;
+    uint32_t node; // below PMM_MAX_NODES
+};
 
-void init_pmm(multiboot_info_t *mbtStructure);
-void *pmm_alloc(uint32_t request);
-void pmm_free(uintptr_t address, uint32_t size);
+/*
+    Allocation counters of a node, in blocks. hit is memory taken from the
+    node it was wanted from, miss is memory the node handed out because the
+    wanted node had none, foreign is memory wanted from the node but taken 
+    elsewhere, and interleave is memory the node handed out to an 
+    interleaving CPU. Blocks the per-CPU caches take are counted when they
+    are taken from the node.
+*/
+struct pmm_node_stats
+{
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t foreign;
+    uint64_t interleave;
+};
+
+// Counters of an order of a pool, in blocks of that order. See pmm_get_stats
+struct pmm_order_stats
+{
+    uint64_t allocs;   // blocks handed out
+    uint64_t frees;    // blocks given back
+    uint64_t splits;   // blocks broken up to serve smaller ones
+    uint64_t merges;   // blocks merged with their buddy on a free
+    uint64_t searches; // bitmap summary lookups, per alloc this is the scan length
+    uint64_t steals;   // pageblocks claimed from another mobility type to serve blocks of this order
+};
+
+/*
+    Client that moves movable blocks for compaction, like the virtual
+    memory code that owns the pages of processes. It copies the 2^order 
+    pages at from to to, points whatever mapped from at to and returns 
+    true. It returns false if it doesn't own the block (one sitting in a
+    per-CPU cache, say) or can't move it right now. Called with no pmm lock
+    held, by whichever CPU compacts; from stays allocated until it returns.
+*/
+typedef bool (*pmm_migrate_t)(phys_addr_t from, phys_addr_t to, uint32_t order);
+
+/*
+    Client that gives back free memory cached above the pmm, like the empty
+    slabs of the slab layer, when an allocation can't be served. blocks is
+    the size of the request. It frees what it can with pmm_free and returns
+    how many blocks it freed. Called with no pmm lock held, from inside the
+    failing pmm_alloc, so it must not allocate.
+*/
+typedef uint32_t (*pmm_reclaim_t)(uint32_t blocks);
+
+void init_pmm(multiboot_info_t *mbtStructure);                                                       // everything on node 0
+void init_pmm_numa(multiboot_info_t *mbtStructure, const struct pmm_node_range *ranges, uint32_t rangeCount); // one zone set per node of the table
+phys_addr_t pmm_alloc(uint32_t request); // 0 if out of memory
+phys_addr_t pmm_alloc_type(uint32_t request, uint32_t type); // pmm_alloc for a PMM_* mobility type
+void pmm_free(phys_addr_t address, uint32_t size); // size 0 frees the block at the size it was handed out at
+uint32_t pmm_alloc_bulk(uint32_t order, uint32_t count, phys_addr_t *out);    // up to count blocks of 2^order pages, returns how many
+void pmm_free_bulk(uint32_t order, phys_addr_t *addresses, uint32_t count); // blocks of 2^order pages from pmm_alloc_bulk or pmm_alloc
+phys_addr_t pmm_alloc_dma(uint32_t order);                                   // 2^order pages below DMA_MAX_ADDRESS, naturally aligned
+void pmm_free_dma(phys_addr_t address, uint32_t order);
+void pmm_set_dma_reserve(uint32_t blocks); // DMA blocks kept back from NORMAL fallback allocations
+void pmm_set_deferred_init(uint32_t blocks); // before init_pmm: build only this many blocks of each pool at boot, 0 for all
+bool pmm_init_deferred(uint32_t blocks);     // build up to blocks more, returns true while some are left
+phys_addr_t pmm_alloc_node(uint32_t node, uint32_t order);                   // 2^order pages from node, or from its fallback order. 0 if out of memory
+uint32_t pmm_node_count(void);                                               // nodes of the table passed to init_pmm_numa
+void pmm_set_cpu_node(uint32_t cpu, uint32_t node);                          // after init_pmm: the node a CPU is local to, 0 by default
+void pmm_set_policy(uint32_t policy, uint32_t node);                         // PMM_POLICY_* for the calling CPU, node is the bind target
+bool pmm_set_fallback(uint32_t node, const uint32_t *order, uint32_t count); // after init_pmm: nodes to try, in order, once node is out of memory
+void pmm_get_node_stats(uint32_t node, struct pmm_node_stats *stats);        // sum of the counters of every CPU
+void pmm_set_migrate(pmm_migrate_t migrate); // client compaction moves blocks with, NULL (the default) turns compaction off
+uint32_t pmm_compact(void);                  // compact every NORMAL and HIGH pool now, returns the blocks moved
+void pmm_set_reclaim(pmm_reclaim_t reclaim); // client asked for memory before an allocation fails, NULL (the default) for none
+phys_addr_t pmm_alloc_huge(uint32_t order);                 // 2^order pages aligned to their size, from the huge page reserve first. 0 if there are none
+void pmm_free_huge(phys_addr_t address, uint32_t order);    // release a block of pmm_alloc_huge, into the reserve while it is short
+bool pmm_set_huge_reserve(uint32_t order, uint32_t count);  // before init_pmm: blocks of 2^order pages set aside at boot for pmm_alloc_huge
+
+// internal, shared with percpu.c and zero.c
+uint32_t allocFromZones(uint32_t blocks, phys_addr_t *out, uint32_t count, uint32_t type); // take up to count blocks of a power of two size, by the calling CPU's policy
+void freeToZones(phys_addr_t *addresses, uint32_t count, uint32_t blocks); // give blocks of a power of two size back to the zones they came from
+phys_addr_t allocRequest(uint32_t request, uint32_t type); // pmm_alloc_type counted in the stats but not traced, type already checked
+void countAlloc(phys_addr_t address); // count an allocation call of the calling CPU in the stats, failed if address is 0
+void countFree(void); // count a free call of the calling CPU in the stats
+uint32_t blockMobility(phys_addr_t address); // mobility type of the pageblock of an address, PMM_MOBILITY_TYPES if the pmm doesn't manage it
+void markCached(phys_addr_t *addresses, uint32_t count, bool cached); // flag blocks as sitting in a cache or handed out, for the checks of the frees
+bool claimFree(phys_addr_t address, uint32_t blocks); // flag a block being freed as on its way back, dropping and counting the free if it is bad
 
 struct mmap_entry_t
 {
@@ -33,38 +183,135 @@ struct mmap_entry_t
     uint32_t type;
 };
 
+/*
+    The free block counters of zones, pools and buddies are read without
+    any lock (to pick a pool, or to give up early), so every access to them
+    once the pmm is running goes through these. This needs the counters to 
+    be naturally aligned, see the layout below.
+*/
+#define COUNTER_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define COUNTER_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define COUNTER_SUB(counter, n) __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+
+/*
+    Metadata layout. Zone headers and pools are placed right after the 
+    kernel, one after the other in the order init_pmm creates them, so that
+    a zone can get pools whatever order the memory map and the node table
+    hand them out in. Each pool is laid out by makeBuddies as
+
+        struct pool                  one cache line: the lock, the free count
+                                     and everything the pool walk reads
+        struct buddy[]               two cache lines per order, top first:
+                                     the free lists and bitmaps, then the
+                                     counters of pmm_get_stats
+        bitmaps                      all orders back to back, each starting
+                                     on a cache line
+        summaries                    PMM_MOBILITY_TYPES per order for the 
+                                     orders below 4, each covering the 
+                                     pageblocks of its type, one for the 
+                                     larger orders. Header and storage on a
+                                     cache line
+        free links                   one per block, on a cache line
+        pageblock types              one byte per pageblock, see
+                                     PAGEBLOCK_TYPES in pmm.c
+        allocation orders            one byte per block, see ALLOC_ORDERS
+
+    Nothing is packed, so the counters and pointers are naturally aligned and
+    the search over the bitmaps never has to skip over headers. The reserve
+    of pmm_alloc_huge, an array of addresses per order, follows the last 
+    pool.
+
+    A pool has every order up to the largest its size allows, at most 
+    PMM_MAX_ORDER. Its start is rounded down to a block of that order, so 
+    that blocks are aligned in physical memory the way they are in the 
+    pool, and the blocks before firstBlock belong to whatever comes before
+    the pool and are never released.
+*/
+
 // Structure to create a linked list of zones
 struct zone
 {
-    uint8_t zoneType;
     uint32_t freeBlocks;
     uint32_t zonePhysicalSize;
     struct pool *poolStart;
-} __attribute__((packed));
+    uint8_t zoneType; // 0 DMA, 1 NORMAL, 2 HIGH
+    uint8_t node;
+    uint64_t fails;   // allocations that got fewer blocks than they asked for
+} __attribute__((aligned(64)));
+
+// The zones of a NUMA node. There is one DMA zone for the whole machine
+struct pmm_node
+{
+    struct zone *normal;
+    struct zone *high;
+    uint32_t fallback[PMM_MAX_NODES - 1]; // other nodes to try, nearest first
+    uint32_t fallbackCount;
+};
+
+// NUMA state and counters of a CPU, only written by that CPU once the pmm is running
+struct pmm_cpu_node
+{
+    uint32_t node;           // the node the CPU is local to
+    uint32_t policy;         // PMM_POLICY_*
+    uint32_t bindNode;       // target of PMM_POLICY_BIND
+    uint32_t nextInterleave; // next node PMM_POLICY_INTERLEAVE takes from
+    uint64_t allocCalls;     // API calls, see pmm_get_stats
+    uint64_t freeCalls;
+    uint64_t allocFails;
+    uint64_t badFrees;       // frees dropped because the address isn't a block the pmm handed out
+    uint64_t poolScans;
+    uint64_t compactions;    // compaction runs, on demand or for a failed allocation
+    uint64_t migrated;       // blocks moved by compaction
+    uint64_t migrateFails;   // blocks the migrate client turned down
+    uint64_t reclaimed;      // blocks the reclaim client gave back for a failed allocation
+    struct pmm_node_stats stats[PMM_MAX_NODES];
+} __attribute__((aligned(64)));
 
 struct pool
 {
+    spinlock_t lock;      // protects the buddies, bitmaps and free lists of the pool
     uint32_t freeBlocks;
-    uint32_t start; // starting address of the memory associated with this pool
-    uint32_t poolPhysicalSize;
+    uint32_t totalBlocks; // blocks from start to the end of the pool, the ones before firstBlock included
+    uint32_t initBlocks;  // blocks from the start whose buddy state is built, the rest is built on demand
+    phys_addr_t start;    // address of block 0, aligned to the top order
+    uint32_t firstBlock;  // the first block that is memory of the pool, see the layout above
     struct buddy *poolBuddiesTop;
     struct buddy *poolBuddiesBottom;
+    struct free_link *freeLinks; // free list links, one per block of the pool
     struct pool *nextPool;
-} __attribute__((packed));
+    uint32_t poolPhysicalSize;
+} __attribute__((aligned(64)));
 
 struct buddy
 {
-    uint8_t buddyOrder;     // the order of the buddy in powers of 2
-    uint32_t mapWordCount;  // number of 32-bit words in the bitmap - for iteration
     uint32_t freeBlocks;    // number of free blocks(paint)
-    uint32_t maxFreeBlocks; // max available allocations for this bitmap
+    uint32_t freeListHead;  // index of the first free block of this order, NO_FREE_BLOCK if none
     uint32_t *bitMap;       // pointer to the bitmap for the current buddy
+    struct bitmap_summary *summary; // which words of the bitmap have free blocks, one summary per mobility type
     struct buddy *nextBuddy;
     struct buddy *prevBuddy;
+    uint32_t maxFreeBlocks; // max available allocations for this bitmap
+    uint32_t mapWordCount;  // number of 32-bit words in the bitmap - for iteration
+    uint32_t size;          // blocks in a block of this buddy, 1 << order
+    uint8_t order;
+    struct pmm_order_stats stats __attribute__((aligned(64))); // only written with the pool locked
+} __attribute__((aligned(64)));
+
+/*
+    Doubly linked free lists of the buddies. The pmm can't touch the memory
+    it manages, so instead of living inside the free blocks the links live in
+    a per pool array. A free block is linked through the entry of its first
+    block, and next/prev are block indices within the same buddy.
+*/
+struct free_link
+{
+    uint32_t next;
+    uint32_t prev;
 } __attribute__((packed));
 
 extern uint32_t _kernel_start;
 extern uint32_t _kernel_end;
 extern uint32_t VIRTUAL_KERNEL_OFFSET_LD;
+extern uintptr_t VIRTUAL_KERNEL_OFFSET; // virtual address of physical address 0, shared with slab.c
 
 #endif
\ No newline at end of file
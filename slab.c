@@ -0,0 +1,412 @@
+/*
+    Object caches on top of the pmm. See slab.h.
+*/
+
+#include <lumos/pmm.h>
+#include <lumos/percpu.h>
+#include <lumos/slab.h>
+#include <lumos/spinlock.h>
+#include <stddef.h>
+#include <string.h>
+
+#define ALIGN_UP(x, y) (((x) + (y)-1) & ~((uintptr_t)(y)-1))
+#define SLAB_BYTES(cache) ((uintptr_t)BLOCK_SIZE << (cache)->slabOrder)
+#define SLAB_OF(cache, object) ((struct slab *)((uintptr_t)(object) & ~(SLAB_BYTES(cache) - 1))) // slabs are aligned to their size
+#define SLAB_VIRT(phys) ((struct slab *)(uintptr_t)((phys) + VIRTUAL_KERNEL_OFFSET))
+#define SLAB_PHYS(slab) ((phys_addr_t)((uintptr_t)(slab) - VIRTUAL_KERNEL_OFFSET))
+
+// the caches the descriptors of the others come from, set up by the first kmem_cache_create
+static struct kmem_cache cacheCache;
+
+// every cache but cacheCache, newest first
+static struct kmem_cache *caches = NULL;
+static spinlock_t cachesLock = SPINLOCK_INIT;
+
+// utils
+bool setupCache(struct kmem_cache *cache, const char *name, uint32_t size, uint32_t align, uint32_t flags); // work out the slab layout of a cache
+bool growCache(struct kmem_cache *cache);                                   // add a slab from the pmm to the empty list
+uint32_t takeObjects(struct kmem_cache *cache, void **out, uint32_t count); // take up to count objects out of the slabs, returns how many
+void returnObjects(struct kmem_cache *cache, void **objects, uint32_t count); // put objects back in their slabs
+void drainCpu(struct kmem_cache *cache, struct kmem_cpu_cache *cpu);        // give every object of a per-CPU freelist back to the slabs
+void freeSlabs(struct kmem_cache *cache, struct slab *slab);                // give a list of slabs back to the pmm, cache unlocked
+void linkSlab(struct slab **list, struct slab *slab);
+void unlinkSlab(struct slab **list, struct slab *slab);
+
+/* -------------------- API FUNCTION DEFINITIONS ----------------------- */
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size, uint32_t align, uint32_t flags)
+{
+    struct kmem_cache *cache;
+
+    spin_lock(&cachesLock);
+    if (cacheCache.objectSize == 0)
+        setupCache(&cacheCache, "kmem_cache", sizeof(struct kmem_cache), __alignof__(struct kmem_cache), 0);
+    spin_unlock(&cachesLock);
+
+    cache = kmem_cache_alloc(&cacheCache);
+    if (cache == NULL)
+        return NULL;
+    if (!setupCache(cache, name, size, align, flags))
+    {
+        kmem_cache_free(&cacheCache, cache);
+        return NULL;
+    }
+
+    spin_lock(&cachesLock);
+    cache->next = caches;
+    caches = cache;
+    spin_unlock(&cachesLock);
+    return cache;
+}
+
+/*
+    Allocate an object from the calling CPU's freelist of the cache. When
+    it runs empty a batch is taken from the slabs, partly used ones first,
+    and a new slab is only taken from the pmm when there is no free object
+    left in any of them.
+*/
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    struct kmem_cpu_cache *cpu = &cache->cpus[pmm_cpu_id()];
+    uint32_t count = cpu->count;
+
+    if (count == 0)
+    {
+        count = takeObjects(cache, cpu->objects, SLAB_CPU_BATCH);
+        if (count == 0 && growCache(cache))
+            count = takeObjects(cache, cpu->objects, SLAB_CPU_BATCH);
+        if (count == 0)
+            return NULL;
+    }
+    count--;
+    __atomic_store_n(&cpu->count, count, __ATOMIC_RELAXED); // read by kmem_cache_get_stats
+    __atomic_store_n(&cpu->allocs, cpu->allocs + 1, __ATOMIC_RELAXED);
+    return cpu->objects[count];
+}
+
+/*
+    Release an object of the cache to the calling CPU's freelist, which
+    gives its oldest objects back to their slabs once it grows past
+    SLAB_CPU_HIGH.
+*/
+void kmem_cache_free(struct kmem_cache *cache, void *object)
+{
+    struct kmem_cpu_cache *cpu = &cache->cpus[pmm_cpu_id()];
+    uint32_t count = cpu->count;
+
+    if (object == NULL)
+        return;
+
+    __atomic_store_n(&cpu->frees, cpu->frees + 1, __ATOMIC_RELAXED);
+    cpu->objects[count++] = object;
+    if (count > SLAB_CPU_HIGH)
+    {
+        uint32_t drain = count - SLAB_CPU_LOW;
+        returnObjects(cache, cpu->objects, drain);
+        memmove(cpu->objects, cpu->objects + drain, SLAB_CPU_LOW * sizeof(void *));
+        count = SLAB_CPU_LOW;
+    }
+    __atomic_store_n(&cpu->count, count, __ATOMIC_RELAXED);
+}
+
+uint32_t kmem_cache_shrink(struct kmem_cache *cache)
+{
+    struct slab *empty;
+    uint32_t slabs;
+
+    drainCpu(cache, &cache->cpus[pmm_cpu_id()]);
+
+    spin_lock(&cache->lock);
+    empty = cache->empty;
+    slabs = cache->emptyCount;
+    cache->empty = NULL;
+    cache->emptyCount = 0;
+    cache->slabCount -= slabs;
+    cache->slabFrees += slabs;
+    spin_unlock(&cache->lock);
+
+    freeSlabs(cache, empty);
+    return slabs << cache->slabOrder;
+}
+
+/*
+    Give every slab of a cache back to the pmm and free its descriptor.
+    The freelists of every CPU are drained, so no other CPU may be using
+    the cache. Objects on a freelist count as active until it is drained,
+    so the ones in use are what the freelists don't account for.
+*/
+bool kmem_cache_destroy(struct kmem_cache *cache)
+{
+    struct kmem_cache **link;
+    uint32_t cached = 0;
+
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        cached += COUNTER_READ(cache->cpus[cpu].count);
+    if (COUNTER_READ(cache->activeObjects) != cached)
+        return false;
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        drainCpu(cache, &cache->cpus[cpu]);
+
+    spin_lock(&cachesLock);
+    for (link = &caches; *link != cache; link = &(*link)->next)
+        ;
+    *link = cache->next;
+    spin_unlock(&cachesLock);
+
+    kmem_cache_shrink(cache);
+    kmem_cache_free(&cacheCache, cache);
+    return true;
+}
+
+/*
+    Snapshot of the counters of a cache. The per-CPU counters are read
+    without stopping their CPUs, so it is only roughly consistent.
+*/
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->objectSize = cache->objectSize;
+    stats->slabBytes = SLAB_BYTES(cache);
+    stats->objectsPerSlab = cache->objectsPerSlab;
+    stats->colors = cache->colors;
+
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+    {
+        stats->cachedObjects += COUNTER_READ(cache->cpus[cpu].count);
+        stats->allocs += COUNTER_READ(cache->cpus[cpu].allocs);
+        stats->frees += COUNTER_READ(cache->cpus[cpu].frees);
+    }
+
+    spin_lock(&cache->lock);
+    stats->slabs = cache->slabCount;
+    stats->emptySlabs = cache->emptyCount;
+    stats->activeObjects = cache->activeObjects;
+    stats->slabAllocs = cache->slabAllocs;
+    stats->slabFrees = cache->slabFrees;
+    spin_unlock(&cache->lock);
+
+    stats->activeObjects = (stats->activeObjects > stats->cachedObjects) ? stats->activeObjects - stats->cachedObjects : 0;
+}
+
+/*
+    Give the empty slabs of every cache back to the pmm, after draining the
+    calling CPU's freelists into them. Other CPUs keep their freelists, the
+    way pmm_pcp_drain only drains the calling CPU. Returns the pages freed.
+*/
+uint32_t kmem_reclaim(uint32_t blocks)
+{
+    uint32_t freed = 0;
+
+    spin_lock(&cachesLock);
+    for (struct kmem_cache *cache = caches; cache != NULL; cache = cache->next)
+        freed += kmem_cache_shrink(cache);
+    freed += kmem_cache_shrink(&cacheCache);
+    spin_unlock(&cachesLock);
+    return freed;
+}
+
+/* -------------------- UTILITY FUNCTION DEFINITIONS ----------------------- */
+
+/*
+    Pick the smallest slab, up to SLAB_MAX_ORDER, that wastes at most
+    1/SLAB_WASTE_FRACTION of itself after the header and the objects. What
+    is left over goes to coloring.
+*/
+bool setupCache(struct kmem_cache *cache, const char *name, uint32_t size, uint32_t align, uint32_t flags)
+{
+    uint32_t objectSize, firstObject, slabBytes, count = 0, waste = 0, order;
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (size == 0 || (align & (align - 1)) != 0 || align > BLOCK_SIZE)
+        return false;
+    objectSize = ALIGN_UP(size, align);
+    firstObject = ALIGN_UP(sizeof(struct slab), align);
+
+    for (order = 0; order <= SLAB_MAX_ORDER; order++)
+    {
+        slabBytes = BLOCK_SIZE << order;
+        if (firstObject + objectSize > slabBytes)
+            continue;
+        count = (slabBytes - firstObject) / objectSize;
+        waste = slabBytes - firstObject - count * objectSize;
+        if (waste * SLAB_WASTE_FRACTION <= slabBytes || order == SLAB_MAX_ORDER)
+            break;
+    }
+    if (order > SLAB_MAX_ORDER)
+        return false;
+
+    memset(cache, 0, sizeof(*cache));
+    spin_lock_init(&cache->lock);
+    cache->name = name;
+    cache->size = size;
+    cache->objectSize = objectSize;
+    cache->align = align;
+    cache->flags = flags;
+    cache->slabOrder = order;
+    cache->objectsPerSlab = count;
+    cache->firstObject = firstObject;
+    cache->colorStep = (align > SLAB_CACHE_LINE) ? align : SLAB_CACHE_LINE;
+    cache->colors = waste / cache->colorStep + 1;
+    return true;
+}
+
+/*
+    Take a slab from the pmm, link its objects into its freelist and add it
+    to the empty slabs. The cache is unlocked around pmm_alloc, which may
+    call kmem_reclaim when memory is short.
+*/
+bool growCache(struct kmem_cache *cache)
+{
+    uint32_t type = (cache->flags & SLAB_RECLAIMABLE) ? PMM_RECLAIMABLE : PMM_UNMOVABLE;
+    phys_addr_t address = pmm_alloc_type(SLAB_BYTES(cache), type);
+    struct slab *slab;
+    uint8_t *object;
+    uint32_t color;
+
+    if (address == 0)
+        return false;
+
+    spin_lock(&cache->lock);
+    color = cache->nextColor;
+    cache->nextColor = (color + 1 < cache->colors) ? color + 1 : 0;
+    spin_unlock(&cache->lock);
+
+    slab = SLAB_VIRT(address);
+    slab->inUse = 0;
+    slab->color = color * cache->colorStep;
+    slab->freeList = NULL;
+    object = (uint8_t *)slab + cache->firstObject + slab->color + (cache->objectsPerSlab - 1) * cache->objectSize;
+    for (uint32_t i = 0; i < cache->objectsPerSlab; i++, object -= cache->objectSize)
+    {
+        *(void **)object = slab->freeList;
+        slab->freeList = object;
+    }
+
+    spin_lock(&cache->lock);
+    linkSlab(&cache->empty, slab);
+    cache->emptyCount++;
+    cache->slabCount++;
+    cache->slabAllocs++;
+    spin_unlock(&cache->lock);
+    return true;
+}
+
+uint32_t takeObjects(struct kmem_cache *cache, void **out, uint32_t count)
+{
+    struct slab *slab;
+    uint32_t taken = 0;
+
+    spin_lock(&cache->lock);
+    while (taken < count)
+    {
+        if (cache->partial != NULL)
+            slab = cache->partial;
+        else if (cache->empty != NULL)
+        {
+            slab = cache->empty;
+            unlinkSlab(&cache->empty, slab);
+            cache->emptyCount--;
+            linkSlab(&cache->partial, slab);
+        }
+        else
+            break;
+
+        while (taken < count && slab->freeList != NULL)
+        {
+            out[taken++] = slab->freeList;
+            slab->freeList = *(void **)slab->freeList;
+            slab->inUse++;
+        }
+        if (slab->freeList == NULL)
+            unlinkSlab(&cache->partial, slab);
+    }
+    cache->activeObjects += taken;
+    spin_unlock(&cache->lock);
+    return taken;
+}
+
+/*
+    Slabs that fill up again go back on the partial list, and slabs that
+    empty go on the empty list, or back to the pmm once the cache holds
+    SLAB_EMPTY_KEEP empty slabs.
+*/
+void returnObjects(struct kmem_cache *cache, void **objects, uint32_t count)
+{
+    struct slab *release = NULL, *slab;
+    uint32_t released = 0;
+
+    spin_lock(&cache->lock);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bool wasFull;
+
+        slab = SLAB_OF(cache, objects[i]);
+        wasFull = (slab->freeList == NULL);
+        *(void **)objects[i] = slab->freeList;
+        slab->freeList = objects[i];
+        slab->inUse--;
+
+        if (slab->inUse == 0)
+        {
+            if (!wasFull)
+                unlinkSlab(&cache->partial, slab);
+            if (cache->emptyCount < SLAB_EMPTY_KEEP)
+            {
+                linkSlab(&cache->empty, slab);
+                cache->emptyCount++;
+            }
+            else
+            {
+                slab->next = release;
+                release = slab;
+                released++;
+            }
+        }
+        else if (wasFull)
+            linkSlab(&cache->partial, slab);
+    }
+    cache->activeObjects -= count;
+    cache->slabCount -= released;
+    cache->slabFrees += released;
+    spin_unlock(&cache->lock);
+
+    freeSlabs(cache, release);
+}
+
+void drainCpu(struct kmem_cache *cache, struct kmem_cpu_cache *cpu)
+{
+    if (cpu->count == 0)
+        return;
+    returnObjects(cache, cpu->objects, cpu->count);
+    __atomic_store_n(&cpu->count, 0, __ATOMIC_RELAXED);
+}
+
+void freeSlabs(struct kmem_cache *cache, struct slab *slab)
+{
+    while (slab != NULL)
+    {
+        struct slab *next = slab->next;
+        pmm_free(SLAB_PHYS(slab), SLAB_BYTES(cache));
+        slab = next;
+    }
+}
+
+void linkSlab(struct slab **list, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+void unlinkSlab(struct slab **list, struct slab *slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
@@ -0,0 +1,119 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/*
+    Object caches for allocations smaller than a page, on top of the pmm.
+
+    A cache hands out objects of one size from slabs, blocks of 2^order
+    pages taken from the pmm with pmm_alloc_type. A slab starts with its
+    header, followed by as many objects as fit; its free objects are linked
+    through their first word. Slabs are aligned to their size, so the slab
+    of an object is found by masking its address. The first object of a
+    slab is moved by a few cache lines from one slab to the next (its
+    color), so that the objects at the same index of different slabs don't
+    all fall in the same cache sets.
+
+    Like the per-CPU block caches of the pmm, every CPU has a stack of free
+    objects per cache, used without any lock and refilled from or drained
+    to the slabs in batches under the cache lock. A cache keeps
+    SLAB_EMPTY_KEEP empty slabs for reuse and gives the others back to the
+    pmm as they empty. kmem_reclaim, registered with pmm_set_reclaim, gives
+    back the rest when the pmm runs out of memory.
+
+    Slabs are reached through the mapping of physical memory at
+    VIRTUAL_KERNEL_OFFSET, so every zone the pmm allocates from must be in
+    it.
+*/
+
+#include <lumos/percpu.h>
+#include <lumos/pmm.h>
+#include <lumos/spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SLAB_MAX_ORDER 3       // largest slab, 8 pages. Bounds the object size
+#define SLAB_WASTE_FRACTION 8  // a slab grows until it wastes at most 1/8 of itself, up to SLAB_MAX_ORDER
+#define SLAB_CACHE_LINE 64     // step between the colors of a cache
+#define SLAB_EMPTY_KEEP 2      // empty slabs a cache holds on to
+#define SLAB_CPU_CAPACITY 32   // objects a per-CPU freelist can hold
+#define SLAB_CPU_LOW 8         // a drain stops at this many objects
+#define SLAB_CPU_HIGH 24       // a free that leaves more than this many objects drains the freelist
+#define SLAB_CPU_BATCH 16      // objects taken from the slabs when the freelist runs empty
+
+// flags of kmem_cache_create
+#define SLAB_RECLAIMABLE 0x1 // slabs are PMM_RECLAIMABLE pages rather than PMM_UNMOVABLE ones
+
+// A slab's header, at its start
+struct slab
+{
+    struct slab *next; // in the partial or empty list of the cache, full slabs are on neither
+    struct slab *prev;
+    void *freeList;    // first free object, NULL if none
+    uint32_t inUse;    // objects taken out of the slab, the ones in per-CPU freelists included
+    uint32_t color;    // offset of the first object past the header
+};
+
+struct kmem_cpu_cache
+{
+    uint32_t count;  // objects currently cached
+    uint64_t allocs; // only written by the CPU itself
+    uint64_t frees;
+    void *objects[SLAB_CPU_CAPACITY];
+} __attribute__((aligned(64)));
+
+struct kmem_cache
+{
+    spinlock_t lock;         // protects the slab lists, the freelists of the slabs and the counters below
+    uint32_t objectSize;     // the size asked for rounded up to the alignment
+    uint32_t align;
+    uint32_t flags;
+    uint32_t slabOrder;      // slabs are blocks of 2^slabOrder pages
+    uint32_t objectsPerSlab;
+    uint32_t firstObject;    // offset of the first object of a slab of color 0
+    uint32_t colors;         // offsets the first object takes turns at, colorStep apart
+    uint32_t colorStep;
+    uint32_t nextColor;
+    struct slab *partial;    // slabs with objects in use and free ones
+    struct slab *empty;      // at most SLAB_EMPTY_KEEP of them
+    uint32_t slabCount;      // every slab of the cache, empty ones included
+    uint32_t emptyCount;
+    uint32_t activeObjects;  // objects out of the slabs, the ones in per-CPU freelists included
+    uint64_t slabAllocs;     // slabs taken from the pmm
+    uint64_t slabFrees;      // and given back
+    const char *name;
+    uint32_t size;           // as asked for
+    struct kmem_cache *next; // in the list of every cache
+    struct kmem_cpu_cache cpus[PMM_MAX_CPUS];
+};
+
+struct kmem_cache_stats
+{
+    uint32_t objectSize;     // the size asked for rounded up to the alignment
+    uint32_t slabBytes;
+    uint32_t objectsPerSlab;
+    uint32_t colors;
+    uint32_t slabs;          // slabs the cache holds, empty ones included
+    uint32_t emptySlabs;
+    uint32_t activeObjects;  // objects handed out and not freed
+    uint32_t cachedObjects;  // free objects in the per-CPU freelists
+    uint64_t allocs;         // summed over the CPUs
+    uint64_t frees;
+    uint64_t slabAllocs;     // slabs taken from the pmm
+    uint64_t slabFrees;      // and given back
+};
+
+/*
+    Create a cache of objects of size bytes aligned to align, a power of
+    two (0 for pointer alignment). name is kept, not copied. Returns NULL
+    if an object doesn't fit in a slab of SLAB_MAX_ORDER or there is no
+    memory for the cache.
+*/
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size, uint32_t align, uint32_t flags);
+void *kmem_cache_alloc(struct kmem_cache *cache); // NULL if out of memory
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+uint32_t kmem_cache_shrink(struct kmem_cache *cache); // drain the calling CPU's freelist and free the empty slabs, returns the pages freed
+bool kmem_cache_destroy(struct kmem_cache *cache);    // with no other CPU using the cache. false, and nothing done, while objects are in use
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *stats);
+uint32_t kmem_reclaim(uint32_t blocks); // kmem_cache_shrink every cache, a pmm_reclaim_t
+
+#endif
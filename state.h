@@ -0,0 +1,107 @@
+#ifndef STATE_H
+#define STATE_H
+
+/*
+    Saved state of the pmm, for a warm restart or a kexec into a new kernel
+    that keeps the memory the old one had allocated.
+
+    pmm_save_state copies the zone headers, the pools and everything laid
+    out after them (see the metadata layout in pmm.h) into an image, behind
+    a struct pmm_state header. Every pointer of the copy is turned into an
+    offset from the start of the image, 0 standing for NULL, so the image
+    can be moved or written to a file and read back anywhere. Physical
+    addresses, bitmaps, free lists and counters are kept as they are.
+
+    pmm_adopt_state takes the place of init_pmm: it checks the header and
+    its checksum, turns the offsets back into pointers where the image lies
+    and uses the image as the metadata of the pmm from then on, without
+    copying it. Only the zone, pool, buddy and summary headers are touched,
+    so adopting takes the same time whatever the size of memory. Every
+    block allocated when the state was saved is still allocated after it,
+    and free memory is free; the huge page reserve and the unbuilt part of
+    deferred pools carry over as well.
+
+    The image has to stay mapped for as long as the pmm runs, and must lie
+    either outside the memory the pmm manages or in blocks that were
+    allocated when it was saved, like a buffer from pmm_alloc. The new
+    kernel has to load within the range the old kernel and its pmm
+    structures took, which stays reserved. What is cached above the pmm is
+    not part of the image: the per-CPU caches and the zero pools are given
+    back to the zones before saving, but slab pages and anything else
+    allocated stay allocated, and are for their owners to reclaim.
+*/
+
+#include <lumos/pmm.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PMM_STATE_MAGIC 0x45544154534D4D50ull // "PMMSTATE"
+#define PMM_STATE_VERSION 1
+#define PMM_ADOPT_VERIFY 0x1 // pmm_adopt_state flag: check the checksum of the whole image, not only of the headers
+
+// Zones of a node, as offsets into the image
+struct pmm_state_node
+{
+    uint64_t normal;
+    uint64_t high;
+    uint32_t fallback[PMM_MAX_NODES - 1];
+    uint32_t fallbackCount;
+};
+
+// Huge page reserve of an order, see pmm_set_huge_reserve
+struct pmm_state_huge
+{
+    uint64_t blocks; // offset of the array of reserved blocks, the free ones first
+    uint32_t count;
+    uint32_t free;
+};
+
+/*
+    Header of a saved image. The metadata follows at metadataOffset, with
+    the offsets of the header and of the metadata counted from the start
+    of the header. controlSum covers what comes after the two checksums in
+    the header and the headers of the metadata (zones, pools, buddies,
+    summaries, pool ranges and the huge page reserve), and is always
+    checked. imageSum covers all of the metadata, bitmaps and free links
+    included, and is only checked with PMM_ADOPT_VERIFY, as it reads all of
+    it. Both are taken with the pointers as offsets.
+*/
+struct pmm_state
+{
+    uint64_t magic;       // PMM_STATE_MAGIC
+    uint32_t version;     // PMM_STATE_VERSION
+    uint32_t headerBytes; // sizeof(struct pmm_state)
+    uint64_t controlSum;
+    uint64_t imageSum;
+    uint64_t imageBytes;     // header and metadata
+    uint64_t metadataOffset; // cache line aligned
+
+    // build parameters the layout depends on, an image only fits a pmm built the same way
+    uint32_t blockSize;
+    uint32_t maxOrder;
+    uint32_t pageblockOrder;
+    uint32_t mobilityTypes;
+    uint32_t maxNodes;
+    uint32_t pointerBytes;
+
+    phys_addr_t reservedStart; // the old kernel and its pmm structures
+    phys_addr_t reservedEnd;
+    uint32_t dmaReserve;
+    uint32_t bootBlocks;
+    uint32_t zoneCount;
+    uint32_t nodeCount;
+    uint32_t nodeRangeCount;
+    uint32_t poolRangeCount;
+    uint64_t poolRanges;
+    uint64_t zones[1 + 2 * PMM_MAX_NODES]; // DMA first
+    struct pmm_state_node nodes[PMM_MAX_NODES];
+    struct pmm_node_range nodeRanges[PMM_MAX_NODE_RANGES];
+    struct pmm_state_huge huge[BUDDY_LEVELS];
+};
+
+size_t pmm_state_size(void);                // bytes pmm_save_state needs
+bool pmm_save_state(void *image, size_t bytes); // with no other CPU inside the pmm. false if bytes is too small
+bool pmm_adopt_state(void *image, size_t bytes, uint32_t flags); // instead of init_pmm, image cache line aligned. false if it doesn't check out
+
+#endif
@@ -0,0 +1,200 @@
+/*
+    Per-CPU trace rings, latency histograms and recordings, see trace.h.
+    Everything here but the stubs is left out unless the pmm is built with
+    PMM_TRACE.
+*/
+
+#include <lumos/trace.h>
+#include <lumos/percpu.h>
+#include <lumos/spinlock.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef PMM_TRACE
+
+struct trace_ring
+{
+    uint64_t head;    // records written so far, only the CPU itself writes these two
+    uint64_t writing; // moves to head + 1 before a record is written
+    uint64_t latency[PMM_EVENT_COUNT][PMM_LATENCY_BUCKETS];
+    struct pmm_trace_record records[PMM_TRACE_RING_SIZE];
+} __attribute__((aligned(64)));
+
+static struct trace_ring rings[PMM_MAX_CPUS];
+
+// the running recording, NULL if none. See pmm_record_start
+static struct pmm_record_header *recording = NULL;
+static uint64_t recordNext, recordCapacity; // records claimed so far, and room for
+static uint32_t recordWriters;              // calls between checking recording and finishing their record
+
+_Static_assert(sizeof(struct pmm_trace_record) == 32, "records are copied as four 64-bit words");
+
+/*
+    Copy a record a word at a time, so that a reader racing the writer gets
+    a torn copy rather than undefined behaviour. The stores release and the
+    loads acquire, so a reader that saw a word of a record also sees the 
+    move of writing that came before it.
+*/
+static inline void copyRecord(struct pmm_trace_record *to, const struct pmm_trace_record *from)
+{
+    uint64_t *dst = (uint64_t *)to;
+    const uint64_t *src = (const uint64_t *)from;
+
+    for (uint32_t i = 0; i < 4; i++)
+        __atomic_store_n(&dst[i], __atomic_load_n(&src[i], __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// Append a record of a call to the running recording, or count it once the buffer is full
+static void recordEvent(const struct pmm_trace_record *event)
+{
+    struct pmm_record_header *header;
+    struct pmm_record *record;
+    uint64_t slot;
+
+    // pmm_record_stop clears recording and then waits for the writers, so either it sees this one or this one sees NULL
+    __atomic_fetch_add(&recordWriters, 1, __ATOMIC_SEQ_CST);
+    header = __atomic_load_n(&recording, __ATOMIC_SEQ_CST);
+    if (header != NULL && (slot = __atomic_fetch_add(&recordNext, 1, __ATOMIC_RELAXED)) < recordCapacity)
+    {
+        record = (struct pmm_record *)(header + 1) + slot;
+        record->timestamp = (event->timestamp > header->start) ? event->timestamp - header->start : 0; // calls that started before the recording
+        record->page = (uint32_t)(event->address / BLOCK_SIZE);
+        record->arg = event->arg;
+        record->event = event->event;
+        record->cpu = event->cpu;
+        record->zone = (event->address != 0) ? zoneIndex(event->address) : PMM_RECORD_NO_ZONE;
+        record->reserved = 0;
+        record->latency = event->latency;
+    }
+    __atomic_fetch_sub(&recordWriters, 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Write a record to the ring of the calling CPU, overwriting the oldest
+    one when it is full. The record is filled in before head moves past it,
+    so a reader that sees the new head sees the whole record, and writing
+    moves before the record is touched, so a reader that saw any part of it
+    knows the slot was being overwritten.
+*/
+void traceEvent(uint32_t event, phys_addr_t address, uint32_t arg, uint64_t start)
+{
+    uint32_t cpu = pmm_cpu_id();
+    struct trace_ring *ring = &rings[cpu];
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t elapsed = pmm_trace_clock() - start;
+    struct pmm_trace_record record = {
+        .timestamp = start,
+        .address = address,
+        .latency = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsed,
+        .arg = arg,
+        .event = event,
+        .cpu = cpu,
+    };
+    uint32_t bucket = (elapsed == 0) ? 0 : 64 - __builtin_clzll(elapsed);
+
+    if (bucket >= PMM_LATENCY_BUCKETS)
+        bucket = PMM_LATENCY_BUCKETS - 1;
+    __atomic_store_n(&ring->latency[event][bucket], ring->latency[event][bucket] + 1, __ATOMIC_RELAXED);
+
+    // the slot may be in the middle of being copied by a reader, which throws the copy away afterwards
+    __atomic_store_n(&ring->writing, head + 1, __ATOMIC_RELAXED);
+    copyRecord(&ring->records[head & (PMM_TRACE_RING_SIZE - 1)], &record);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&recording, __ATOMIC_RELAXED) != NULL)
+        recordEvent(&record);
+}
+
+uint32_t pmm_trace_read(uint32_t cpu, uint64_t *cursor, struct pmm_trace_record *records, uint32_t max)
+{
+    struct trace_ring *ring;
+    uint64_t head, writing, from, lost;
+    uint32_t n;
+
+    if (cpu >= PMM_MAX_CPUS)
+        return 0;
+    ring = &rings[cpu];
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    from = (head - *cursor > PMM_TRACE_RING_SIZE) ? head - PMM_TRACE_RING_SIZE : *cursor;
+    n = (head - from < max) ? head - from : max;
+    for (uint32_t i = 0; i < n; i++)
+        copyRecord(&records[i], &ring->records[(from + i) & (PMM_TRACE_RING_SIZE - 1)]);
+
+    // records the writer lapped while they were copied are torn, drop them
+    writing = __atomic_load_n(&ring->writing, __ATOMIC_RELAXED);
+    lost = (writing - from > PMM_TRACE_RING_SIZE) ? writing - from - PMM_TRACE_RING_SIZE : 0;
+    if (lost > n)
+        lost = n;
+    memmove(records, records + lost, (n - lost) * sizeof(*records));
+
+    *cursor = from + n;
+    return n - lost;
+}
+
+bool pmm_record_start(void *buffer, size_t bytes)
+{
+    struct pmm_record_header *header = buffer;
+
+    if (bytes < sizeof(*header) || __atomic_load_n(&recording, __ATOMIC_ACQUIRE) != NULL)
+        return false;
+
+    memset(header, 0, sizeof(*header));
+    header->magic = PMM_RECORD_MAGIC;
+    header->version = PMM_RECORD_VERSION;
+    header->recordBytes = sizeof(struct pmm_record);
+    header->blockSize = BLOCK_SIZE;
+    recordSetup(header);
+    header->start = pmm_trace_clock();
+    recordNext = 0;
+    recordCapacity = (bytes - sizeof(*header)) / sizeof(struct pmm_record);
+    __atomic_store_n(&recording, header, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+size_t pmm_record_stop(void)
+{
+    struct pmm_record_header *header = __atomic_exchange_n(&recording, NULL, __ATOMIC_SEQ_CST);
+    uint64_t next;
+
+    if (header == NULL)
+        return 0;
+    while (__atomic_load_n(&recordWriters, __ATOMIC_ACQUIRE) != 0)
+        cpu_relax();
+
+    next = __atomic_load_n(&recordNext, __ATOMIC_RELAXED);
+    header->count = (next < recordCapacity) ? next : recordCapacity;
+    header->dropped = next - header->count;
+    return sizeof(*header) + header->count * sizeof(struct pmm_record);
+}
+
+void traceLatency(uint64_t latency[PMM_EVENT_COUNT][PMM_LATENCY_BUCKETS])
+{
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+        for (uint32_t event = 0; event < PMM_EVENT_COUNT; event++)
+            for (uint32_t bucket = 0; bucket < PMM_LATENCY_BUCKETS; bucket++)
+                latency[event][bucket] += __atomic_load_n(&rings[cpu].latency[event][bucket], __ATOMIC_RELAXED);
+}
+
+#else
+
+bool pmm_record_start(void *buffer, size_t bytes)
+{
+    return false;
+}
+
+size_t pmm_record_stop(void)
+{
+    return 0;
+}
+
+uint32_t pmm_trace_read(uint32_t cpu, uint64_t *cursor, struct pmm_trace_record *records, uint32_t max)
+{
+    return 0;
+}
+
+void traceLatency(uint64_t latency[PMM_EVENT_COUNT][PMM_LATENCY_BUCKETS])
+{
+}
+
+#endif
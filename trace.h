@@ -0,0 +1,209 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+    Tracepoints and statistics of the pmm.
+
+    Built with PMM_TRACE defined, every API call writes a fixed size record
+    into a ring of the calling CPU and adds its latency to a histogram of
+    that CPU. A ring has a single writer, its CPU, and keeps the newest
+    PMM_TRACE_RING_SIZE records. Readers copy records out without stopping
+    the writer and drop the ones it overwrote while they were copying.
+    Without PMM_TRACE the tracepoints compile to nothing and the rings and
+    histograms don't exist.
+
+    A recording, started with pmm_record_start, also has every tracepoint
+    append a compact record to one buffer shared by all CPUs, behind a 
+    header holding the memory map init_pmm was given, the node table and
+    the boot settings. Unlike the rings it keeps every record until the 
+    buffer is full, so that a dump of it can be played back against a
+    freshly booted pmm by the hosted pmm_replay tool.
+
+    The counters of pmm_get_stats are always there. They are updated under
+    the pool locks or by their own CPU only, and read without stopping
+    anything, so a snapshot is only roughly consistent.
+*/
+
+#include <lumos/pmm.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PMM_TRACE_RING_SIZE 4096 // records per CPU, a power of two
+#define PMM_LATENCY_BUCKETS 24   // bucket i counts calls that took [2^(i-1), 2^i) ns, the last one everything longer
+#define PMM_STATS_MAX_POOLS 64   // pools a snapshot has room for, the zone totals cover the rest
+
+// trace events, one per API call
+#define PMM_EVENT_ALLOC 0      // address, arg = PMM_ALLOC_ARG of the pages requested and the mobility type
+#define PMM_EVENT_ALLOC_FAIL 1 // arg = PMM_ALLOC_ARG
+#define PMM_EVENT_FREE 2       // address, arg = pages
+#define PMM_EVENT_ALLOC_BULK 3 // first address, arg = blocks taken
+#define PMM_EVENT_FREE_BULK 4  // first address, arg = blocks
+#define PMM_EVENT_ALLOC_DMA 5  // address (0 on failure), arg = order
+#define PMM_EVENT_FREE_DMA 6   // address, arg = order
+#define PMM_EVENT_ALLOC_NODE 7 // address (0 on failure), arg = node << 8 | order
+#define PMM_EVENT_COMPACT 8    // arg = blocks moved, pmm_compact only
+#define PMM_EVENT_ALLOC_HUGE 9 // address (0 on failure), arg = order
+#define PMM_EVENT_FREE_HUGE 10 // address, arg = order
+#define PMM_EVENT_ALLOC_ZEROED 11 // address (0 on failure), arg = PMM_ALLOC_ARG, the only event of the call
+#define PMM_EVENT_FREE_ZEROED 12 // address, arg = mobility type, unless the page was passed on to pmm_free, which records a FREE
+#define PMM_EVENT_COUNT 13
+
+// Pages of a 32-bit request in bytes take 20 bits at most, the mobility type goes above them
+#define PMM_ALLOC_ARG(pages, type) ((pages) | ((type) << 24))
+#define PMM_ALLOC_ARG_PAGES(arg) ((arg) & 0xFFFFFF)
+#define PMM_ALLOC_ARG_TYPE(arg) ((arg) >> 24)
+
+#define PMM_RECORD_MAGIC 0x44524345524D4D50ull // "PMMRECRD"
+#define PMM_RECORD_VERSION 2
+#define PMM_RECORD_MAX_MAP 64    // memory map entries a recording keeps
+#define PMM_RECORD_NO_ZONE 0xFF
+
+struct pmm_trace_record
+{
+    uint64_t timestamp; // pmm_trace_clock() when the call started
+    phys_addr_t address;
+    uint32_t latency; // ns the call took
+    uint32_t arg;     // depends on the event
+    uint16_t event;   // PMM_EVENT_*
+    uint8_t cpu;
+    uint8_t reserved[5];
+};
+
+// A record of a recording, see pmm_record_start
+struct pmm_record
+{
+    uint64_t timestamp; // ns from pmm_record_start to the start of the call
+    uint32_t page;      // address / BLOCK_SIZE, which reaches 16 TB
+    uint32_t arg;       // as in pmm_trace_record
+    uint8_t event;      // PMM_EVENT_*
+    uint8_t cpu;
+    uint8_t zone;       // index into pmm_stats.zones of the zone of the address, PMM_RECORD_NO_ZONE if none
+    uint8_t reserved;
+    uint32_t latency;   // ns the call took
+};
+
+// An entry of the memory map of a recording, type 1 is available RAM
+struct pmm_record_region
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+/*
+    Header of a recording, followed by count records in the order they 
+    were written, which is the order the calls returned in. The memory map
+    is the one init_pmm was given, or the memory of the pools when the pmm
+    was started with pmm_adopt_state.
+*/
+struct pmm_record_header
+{
+    uint64_t magic;       // PMM_RECORD_MAGIC
+    uint32_t version;     // PMM_RECORD_VERSION
+    uint32_t recordBytes; // sizeof(struct pmm_record)
+    uint64_t count;
+    uint64_t dropped;     // records that didn't fit in the buffer
+    uint64_t start;       // pmm_trace_clock() at pmm_record_start
+    uint32_t blockSize;
+    uint32_t mapCount;
+    uint32_t nodeRangeCount;
+    uint32_t bootBlocks;  // see pmm_set_deferred_init
+    uint32_t dmaReserve;  // see pmm_set_dma_reserve
+    uint32_t hugeReserve[BUDDY_LEVELS]; // see pmm_set_huge_reserve
+    struct pmm_record_region map[PMM_RECORD_MAX_MAP];
+    struct pmm_node_range nodeRanges[PMM_MAX_NODE_RANGES];
+};
+
+struct pmm_pool_stats
+{
+    phys_addr_t start; // address of block 0, the pool's memory starts at firstBlock
+    uint32_t firstBlock;
+    uint32_t zone; // index into pmm_stats.zones
+    uint32_t totalBlocks;
+    uint32_t freeBlocks;
+    uint32_t initBlocks; // blocks whose buddy state is built, see pmm_set_deferred_init
+    struct pmm_order_stats orders[BUDDY_LEVELS]; // orders[i] is for blocks of 2^i pages, up to the top order of the pool
+};
+
+struct pmm_zone_stats
+{
+    uint8_t type; // 0 DMA, 1 NORMAL, 2 HIGH
+    uint8_t node;
+    uint32_t freeBlocks;
+    uint32_t poolCount;
+    uint64_t fails; // allocations the zone couldn't serve in full
+    struct pmm_order_stats orders[BUDDY_LEVELS]; // sum over the pools
+};
+
+struct pmm_stats
+{
+    // API calls, summed over the CPUs
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t allocFails;
+    uint64_t badFrees; // frees of addresses that aren't blocks handed out, dropped. Only caught in full with PMM_CHECK_FREE
+    uint64_t poolScans; // pools locked to take blocks, per zone allocation this is the pool walk length
+    uint64_t compactions; // compaction runs, by pmm_compact or for a failed allocation
+    uint64_t migrated; // blocks compaction moved
+    uint64_t migrateFails; // blocks the migrate client turned down
+    uint64_t reclaimed; // blocks the reclaim client gave back, see pmm_set_reclaim
+    uint32_t hugeReserve[BUDDY_LEVELS]; // blocks of 2^i pages set aside for pmm_alloc_huge, see pmm_set_huge_reserve
+    uint32_t hugeFree[BUDDY_LEVELS];    // the ones of them in the reserve right now
+    uint64_t zeroHits;   // pmm_alloc_zeroed calls served from a zero pool, counted in allocs too
+    uint64_t zeroMisses; // the ones that cleared memory themselves, also in allocs
+    uint64_t zeroed;     // pages pmm_zero_idle cleared
+    uint32_t zeroFree[PMM_MOBILITY_TYPES]; // pages in the zero pool of each mobility type right now
+
+    uint32_t zoneCount;
+    uint32_t poolCount; // may be more than PMM_STATS_MAX_POOLS, only the first ones are in pools
+    struct pmm_zone_stats zones[1 + 2 * PMM_MAX_NODES];
+    struct pmm_pool_stats pools[PMM_STATS_MAX_POOLS];
+
+    uint64_t latency[PMM_EVENT_COUNT][PMM_LATENCY_BUCKETS]; // summed over the CPUs, all 0 without PMM_TRACE
+};
+
+void pmm_get_stats(struct pmm_stats *stats);
+uint64_t pmm_trace_clock(void); // provided by the platform, a monotonic clock in ns
+
+/*
+    Copy the records of a CPU's ring from *cursor on, at most max of them,
+    and move *cursor past them. Start with *cursor at 0. If the writer got
+    more than PMM_TRACE_RING_SIZE records ahead, the ones it overwrote are
+    skipped; the jump of *cursor beyond the records returned tells how many
+    were lost. Returns the number of records copied, always 0 without
+    PMM_TRACE.
+*/
+uint32_t pmm_trace_read(uint32_t cpu, uint64_t *cursor, struct pmm_trace_record *records, uint32_t max);
+
+/*
+    Start recording into a buffer, which the recording takes from its start
+    on: a struct pmm_record_header, then the records. Once it is full 
+    further records are only counted. Returns false without PMM_TRACE, 
+    while another recording runs or if the buffer can't hold the header.
+*/
+bool pmm_record_start(void *buffer, size_t bytes);
+
+/*
+    Stop the recording and fill in its header. Calls that are still writing
+    a record are waited for. Returns the bytes of the buffer the recording
+    takes, ready to be dumped, 0 if there was none.
+*/
+size_t pmm_record_stop(void);
+
+#ifdef PMM_TRACE
+#define PMM_TRACE_START(start) uint64_t start = pmm_trace_clock()
+#define PMM_TRACE_EVENT(event, address, arg, start) traceEvent((event), (address), (arg), (start))
+#else
+#define PMM_TRACE_START(start)
+#define PMM_TRACE_EVENT(event, address, arg, start) ((void)0)
+#endif
+
+// internal, shared with pmm.c
+void traceEvent(uint32_t event, phys_addr_t address, uint32_t arg, uint64_t start); // record an event of the calling CPU
+void traceLatency(uint64_t latency[PMM_EVENT_COUNT][PMM_LATENCY_BUCKETS]);           // add the histograms of every CPU
+void recordSetup(struct pmm_record_header *header); // fill in the memory map, node table and settings of a recording, in pmm.c
+uint32_t zoneIndex(phys_addr_t address);           // index into pmm_stats.zones of the zone of an address, PMM_RECORD_NO_ZONE if none, in pmm.c
+
+#endif
@@ -0,0 +1,374 @@
+/*
+    Pools of zeroed pages. See zero.h.
+*/
+
+#include <lumos/pmm.h>
+#include <lumos/percpu.h>
+#include <lumos/spinlock.h>
+#include <lumos/trace.h>
+#include <lumos/zero.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define ZERO_X86
+#endif
+
+#define CEIL(x, y) (((x) / (y)) + (((x) % (y)) != 0))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define ZERO_VIRT(phys) ((void *)(uintptr_t)((phys) + VIRTUAL_KERNEL_OFFSET))
+
+struct zero_pool
+{
+    spinlock_t lock;  // protects the pages and free
+    uint32_t free;    // pages in the pool, read without the lock to skip an empty one
+    uint32_t target;  // pages pmm_zero_idle fills it to
+    phys_addr_t pages[PMM_ZERO_POOL_MAX];
+} __attribute__((aligned(64)));
+
+// counters of a CPU, only written by the CPU itself
+struct zero_cpu
+{
+    uint64_t hits;   // pmm_alloc_zeroed calls served from a pool
+    uint64_t misses; // and the ones that had to clear memory themselves
+    uint64_t zeroed; // pages cleared by pmm_zero_idle
+} __attribute__((aligned(64)));
+
+struct zero_kernel
+{
+    const char *name;
+    void (*zero)(void *page); // clear BLOCK_SIZE bytes, page aligned
+    bool (*usable)(void);     // NULL if every CPU can run it
+};
+
+static struct zero_pool zeroPools[PMM_MOBILITY_TYPES];
+static struct zero_cpu zeroCpus[PMM_MAX_CPUS];
+
+// utils
+uint32_t trimPool(struct zero_pool *pool, uint32_t keep); // give the pages of a pool above keep back to the zones, returns how many
+static void zeroMemset(void *page);
+#ifdef ZERO_X86
+static void zeroStosb(void *page);
+static void zeroSse2(void *page);
+static void zeroAvx(void *page);
+static bool haveErms(void);
+static bool haveSse2(void);
+static bool haveAvx(void);
+#endif
+
+// best first, zeroInit picks the first one the CPU can run
+static const struct zero_kernel zeroKernels[] = {
+#ifdef ZERO_X86
+    {"avx", zeroAvx, haveAvx},
+    {"sse2", zeroSse2, haveSse2},
+    {"stosb", zeroStosb, haveErms},
+#endif
+    {"memset", zeroMemset, NULL},
+};
+#define ZERO_KERNELS (sizeof(zeroKernels) / sizeof(zeroKernels[0]))
+
+static const struct zero_kernel *zeroKernel = &zeroKernels[ZERO_KERNELS - 1];
+
+/* -------------------- API FUNCTION DEFINITIONS ----------------------- */
+
+phys_addr_t pmm_alloc_zeroed(uint32_t request)
+{
+    return pmm_alloc_zeroed_type(request, PMM_UNMOVABLE);
+}
+
+/*
+    Take a single page from the pool of its mobility type as it is, or
+    when the pool is empty or the request is larger, a block of
+    pmm_alloc_type that is cleared here with plain stores, since the caller
+    is about to write it anyway. Requests of a page or less are served from
+    the pool; the pages of larger ones are cleared up to the request.
+*/
+phys_addr_t pmm_alloc_zeroed_type(uint32_t request, uint32_t type)
+{
+    PMM_TRACE_START(start);
+    struct zero_cpu *cpu = &zeroCpus[pmm_cpu_id()];
+    struct zero_pool *pool;
+    phys_addr_t address = 0;
+
+    if (type >= PMM_MOBILITY_TYPES)
+        type = PMM_UNMOVABLE;
+    pool = &zeroPools[type];
+
+    if (request != 0 && request <= BLOCK_SIZE && __atomic_load_n(&pool->free, __ATOMIC_RELAXED) > 0)
+    {
+        spin_lock(&pool->lock);
+        if (pool->free > 0)
+        {
+            address = pool->pages[pool->free - 1];
+            __atomic_store_n(&pool->free, pool->free - 1, __ATOMIC_RELAXED);
+        }
+        spin_unlock(&pool->lock);
+    }
+
+    if (address != 0)
+    {
+        markCached(&address, 1, false);
+        countAlloc(address);
+        __atomic_store_n(&cpu->hits, cpu->hits + 1, __ATOMIC_RELAXED);
+    }
+    else if ((address = allocRequest(request, type)) != 0)
+    {
+        memset(ZERO_VIRT(address), 0, (size_t)CEIL(request, BLOCK_SIZE) * BLOCK_SIZE);
+        __atomic_store_n(&cpu->misses, cpu->misses + 1, __ATOMIC_RELAXED);
+    }
+
+    PMM_TRACE_EVENT(PMM_EVENT_ALLOC_ZEROED, address, PMM_ALLOC_ARG(CEIL(request, BLOCK_SIZE), type), start);
+    return address;
+}
+
+/*
+    Release a page of pmm_alloc or pmm_alloc_zeroed that the caller left
+    all zero. It goes into the pool of the type of its pageblock if that
+    is short, and is freed like pmm_free otherwise.
+*/
+void pmm_free_zeroed(phys_addr_t address)
+{
+    PMM_TRACE_START(start);
+    uint32_t type = blockMobility(address);
+    struct zero_pool *pool;
+    bool kept = false;
+
+    // not a page of the zones, or no room: pmm_free sorts it out
+    if (type >= PMM_MOBILITY_TYPES ||
+        __atomic_load_n(&zeroPools[type].free, __ATOMIC_RELAXED) >= __atomic_load_n(&zeroPools[type].target, __ATOMIC_RELAXED))
+    {
+        pmm_free(address, BLOCK_SIZE);
+        return;
+    }
+    if (!claimFree(address, 1))
+        return;
+
+    pool = &zeroPools[type];
+    spin_lock(&pool->lock);
+    if (pool->free < __atomic_load_n(&pool->target, __ATOMIC_RELAXED))
+    {
+        pool->pages[pool->free] = address;
+        __atomic_store_n(&pool->free, pool->free + 1, __ATOMIC_RELAXED);
+        kept = true;
+    }
+    spin_unlock(&pool->lock);
+
+    // the pool filled up in the meantime
+    if (!kept)
+        freeToZones(&address, 1, 1);
+    countFree();
+    PMM_TRACE_EVENT(PMM_EVENT_FREE_ZEROED, address, type, start);
+}
+
+/*
+    Set how many zeroed pages to keep for a mobility type, up to
+    PMM_ZERO_POOL_MAX. A pool fills up as pmm_zero_idle runs; pages above
+    a lowered size go back to the zones right away. Can be called any time.
+*/
+bool pmm_set_zero_pool(uint32_t type, uint32_t pages)
+{
+    if (type >= PMM_MOBILITY_TYPES || pages > PMM_ZERO_POOL_MAX)
+        return false;
+
+    __atomic_store_n(&zeroPools[type].target, pages, __ATOMIC_RELAXED);
+    trimPool(&zeroPools[type], pages);
+    return true;
+}
+
+/*
+    Fill the pools that are short of their size with up to pages pages,
+    PMM_ZERO_BATCH at a time. The pages are taken from the zones the way
+    pmm_alloc takes them for the calling CPU, but never from its per-CPU
+    cache or the DMA zone, and cleared with the kernel picked at boot while
+    no lock is held. Meant for the idle loop, or a kernel thread that runs
+    when the CPUs have nothing better to do. Returns the pages cleared, 0
+    once every pool is full or memory has run out.
+*/
+uint32_t pmm_zero_idle(uint32_t pages)
+{
+    const struct zero_kernel *kernel = __atomic_load_n(&zeroKernel, __ATOMIC_RELAXED);
+    struct zero_cpu *cpu = &zeroCpus[pmm_cpu_id()];
+    phys_addr_t batch[PMM_ZERO_BATCH];
+    struct zero_pool *pool;
+    uint32_t zeroed = 0, target, free, want, got, kept;
+
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+    {
+        pool = &zeroPools[type];
+        while (zeroed < pages)
+        {
+            target = __atomic_load_n(&pool->target, __ATOMIC_RELAXED);
+            free = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+            want = MIN(MIN(target - MIN(free, target), PMM_ZERO_BATCH), pages - zeroed);
+            if (want == 0 || (got = allocFromZones(1, batch, want, type)) == 0)
+                break;
+
+            for (uint32_t i = 0; i < got; i++)
+                kernel->zero(ZERO_VIRT(batch[i]));
+            markCached(batch, got, true);
+
+            spin_lock(&pool->lock);
+            target = __atomic_load_n(&pool->target, __ATOMIC_RELAXED); // set without the lock
+            kept = MIN(got, target - MIN(pool->free, target));
+            memcpy(pool->pages + pool->free, batch, kept * sizeof(phys_addr_t));
+            __atomic_store_n(&pool->free, pool->free + kept, __ATOMIC_RELAXED);
+            spin_unlock(&pool->lock);
+
+            // someone else filled it, or shrank it, while these were cleared
+            if (kept < got)
+                freeToZones(batch + kept, got - kept, 1);
+            zeroed += got;
+            if (kept < got)
+                break;
+        }
+    }
+
+    __atomic_store_n(&cpu->zeroed, cpu->zeroed + zeroed, __ATOMIC_RELAXED);
+    return zeroed;
+}
+
+bool pmm_set_zero_kernel(const char *name)
+{
+    for (uint32_t i = 0; i < ZERO_KERNELS; i++)
+        if (strcmp(zeroKernels[i].name, name) == 0)
+        {
+            if (zeroKernels[i].usable != NULL && !zeroKernels[i].usable())
+                return false;
+            __atomic_store_n(&zeroKernel, &zeroKernels[i], __ATOMIC_RELAXED);
+            return true;
+        }
+    return false;
+}
+
+const char *pmm_zero_kernel_name(void)
+{
+    return __atomic_load_n(&zeroKernel, __ATOMIC_RELAXED)->name;
+}
+
+/* -------------------- UTILITY FUNCTION DEFINITIONS ----------------------- */
+
+// The pools of the last boot held pages of memory that is gone, only their sizes are kept
+void zeroInit(void)
+{
+    uint32_t i = 0;
+
+    memset(zeroCpus, 0, sizeof(zeroCpus));
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+    {
+        spin_lock_init(&zeroPools[type].lock);
+        zeroPools[type].free = 0;
+    }
+    while (zeroKernels[i].usable != NULL && !zeroKernels[i].usable())
+        i++;
+    zeroKernel = &zeroKernels[i];
+}
+
+uint32_t zeroRelease(void)
+{
+    uint32_t released = 0;
+
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+        released += trimPool(&zeroPools[type], 0);
+    return released;
+}
+
+void zeroStats(struct pmm_stats *stats)
+{
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
+    {
+        stats->zeroHits += __atomic_load_n(&zeroCpus[cpu].hits, __ATOMIC_RELAXED);
+        stats->zeroMisses += __atomic_load_n(&zeroCpus[cpu].misses, __ATOMIC_RELAXED);
+        stats->zeroed += __atomic_load_n(&zeroCpus[cpu].zeroed, __ATOMIC_RELAXED);
+    }
+    for (uint32_t type = 0; type < PMM_MOBILITY_TYPES; type++)
+        stats->zeroFree[type] = __atomic_load_n(&zeroPools[type].free, __ATOMIC_RELAXED);
+}
+
+// Pages are taken off the top PMM_ZERO_BATCH at a time, so the lock isn't held while they are freed
+uint32_t trimPool(struct zero_pool *pool, uint32_t keep)
+{
+    phys_addr_t batch[PMM_ZERO_BATCH];
+    uint32_t trimmed = 0, count;
+
+    do
+    {
+        spin_lock(&pool->lock);
+        count = (pool->free > keep) ? MIN(pool->free - keep, PMM_ZERO_BATCH) : 0;
+        memcpy(batch, pool->pages + pool->free - count, count * sizeof(phys_addr_t));
+        __atomic_store_n(&pool->free, pool->free - count, __ATOMIC_RELAXED);
+        spin_unlock(&pool->lock);
+
+        if (count > 0)
+            freeToZones(batch, count, 1);
+        trimmed += count;
+    } while (count > 0);
+    return trimmed;
+}
+
+static void zeroMemset(void *page)
+{
+    memset(page, 0, BLOCK_SIZE);
+}
+
+#ifdef ZERO_X86
+// Fast with ERMS, the microcode picks the store width
+static void zeroStosb(void *page)
+{
+    size_t count = BLOCK_SIZE;
+
+    __asm__ volatile("rep stosb" : "+D"(page), "+c"(count) : "a"(0) : "memory");
+}
+
+// Streaming stores go around the caches, the fence orders them before the page is handed to another CPU
+__attribute__((target("sse2"))) static void zeroSse2(void *page)
+{
+    __m128i zero = _mm_setzero_si128();
+
+    for (__m128i *line = page, *end = line + BLOCK_SIZE / sizeof(__m128i); line < end; line += 4)
+    {
+        _mm_stream_si128(line, zero);
+        _mm_stream_si128(line + 1, zero);
+        _mm_stream_si128(line + 2, zero);
+        _mm_stream_si128(line + 3, zero);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx"))) static void zeroAvx(void *page)
+{
+    __m256i zero = _mm256_setzero_si256();
+
+    for (__m256i *line = page, *end = line + BLOCK_SIZE / sizeof(__m256i); line < end; line += 2)
+    {
+        _mm256_stream_si256(line, zero);
+        _mm256_stream_si256(line + 1, zero);
+    }
+    _mm_sfence();
+}
+
+static bool haveErms(void)
+{
+    uint32_t a, b, c, d;
+
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 9)) != 0;
+}
+
+static bool haveSse2(void)
+{
+    uint32_t a, b, c, d;
+
+    return __get_cpuid(1, &a, &b, &c, &d) && (d & bit_SSE2) != 0;
+}
+
+// The CPU has to support AVX and the kernel has to save the YMM registers, which XCR0 tells
+static bool haveAvx(void)
+{
+    uint32_t a, b, c, d, low, high;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) || (c & bit_AVX) == 0 || (c & bit_OSXSAVE) == 0)
+        return false;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return (low & 0x6) == 0x6;
+}
+#endif
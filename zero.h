@@ -0,0 +1,51 @@
+#ifndef ZERO_H
+#define ZERO_H
+
+/*
+    Pools of pages that are known to be zero, for the allocations that are
+    cleared right after they are taken: page tables and the pages a fault
+    maps into a process.
+
+    Every mobility type has a pool of single pages, filled to the size set
+    with pmm_set_zero_pool by pmm_zero_idle, which the idle loop (or a
+    kernel thread of its own) calls: it takes pages from the zones the way
+    pmm_alloc does and clears them with non-temporal stores, so that the
+    4 KB written don't push the working set of the CPU out of its caches.
+    pmm_alloc_zeroed hands out a page of the pool without touching it, and
+    only clears one itself, with plain stores, when the pool is empty. A
+    page counts as known to be zero only while it sits in a pool. Callers
+    that free a page they know to be zero, like an empty page table, give
+    it back with pmm_free_zeroed, which keeps it in the pool while there is
+    room; once the pool is full it is freed like any page, and cleared
+    again when a later pmm_alloc_zeroed misses.
+
+    The clearing kernel is picked at boot from what the CPU supports: AVX
+    or SSE2 streaming stores, then rep stosb, then memset. The pages are
+    written through the mapping of physical memory at VIRTUAL_KERNEL_OFFSET.
+    The pools are shared by every CPU and node; pool pages hold on to their
+    pageblocks like any allocated page, and are given back to the zones
+    before an allocation fails.
+*/
+
+#include <lumos/pmm.h>
+#include <lumos/trace.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PMM_ZERO_POOL_MAX 256 // pages a pool can hold, per mobility type
+#define PMM_ZERO_BATCH 16     // pages pmm_zero_idle takes from the zones at a time
+
+phys_addr_t pmm_alloc_zeroed(uint32_t request);                   // pmm_alloc of memory that reads as zero. 0 if out of memory
+phys_addr_t pmm_alloc_zeroed_type(uint32_t request, uint32_t type); // pmm_alloc_zeroed for a PMM_* mobility type
+void pmm_free_zeroed(phys_addr_t address);                        // pmm_free of a page the caller left all zero
+bool pmm_set_zero_pool(uint32_t type, uint32_t pages);            // pages kept zeroed for a mobility type, 0 (the default) for none. Extra ones are freed
+uint32_t pmm_zero_idle(uint32_t pages);                           // clear up to pages pages into the pools that are short, returns how many
+bool pmm_set_zero_kernel(const char *name);                       // "avx", "sse2", "stosb" or "memset". false if the CPU can't run it
+const char *pmm_zero_kernel_name(void);                           // the kernel pmm_zero_idle clears pages with
+
+// internal, used by pmm.c
+void zeroInit(void);                      // pick the clearing kernel, with every pool empty
+uint32_t zeroRelease(void);               // give every page of the pools back to the zones, returns how many
+void zeroStats(struct pmm_stats *stats);  // add the counters of the pools to a snapshot
+
+#endif